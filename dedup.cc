@@ -0,0 +1,67 @@
+/* vim:expandtab:shiftwidth=4:tabstop=4:smarttab:
+ */
+
+#include <time.h>
+#include <dedup.h>
+
+Dedup::Dedup(int timeout)
+    : timeout_(timeout), now_(nowMsec()), nextScan_(0), repeatMsgs_(0), reportMsgs_(0)
+{
+    memset(windows_, 0x00, sizeof(windows_));
+}
+
+bool Dedup::repeated(const char *msg, size_t n, uint32_t flags, char *report, size_t *nreport)
+{
+    /* sender 0 is every sender without credentials */
+    *nreport = 0;
+    if (msgSender(flags) == 0) return false;
+
+    Window *w = &windows_[msgSender(flags)];
+
+    size_t off = skipHeader(msg, n);
+    uint64_t h = (hashBytes(msg + off, n - off) ^ (flags & MsgPriMask)) | 1;
+
+    if (w->hash == h && w->len == n - off) {
+        ++w->repeats;
+        statAdd(&repeatMsgs_);
+        return true;
+    }
+    if (w->repeats) *nreport = this->report(w, report, maxReport);
+
+    w->hash    = h;
+    w->len     = n - off;
+    w->repeats = 0;
+    w->stamp   = now_;
+    w->flags   = flags;
+
+    /* "TAG[pid]: " or what there is of it */
+    const char *colon = (const char *) memchr(msg + off, ':', n - off);
+    size_t nhead = colon && colon + 2 <= msg + n ? colon + 2 - (msg + off) : 0;
+    if (nhead > sizeof(w->head)) nhead = 0;
+    memcpy(w->head, msg + off, nhead);
+    w->nhead = nhead;
+    return false;
+}
+
+/* the run so far, syslogd's words for it */
+size_t Dedup::report(Window *w, char *buffer, size_t n)
+{
+    time_t t = time(0);
+    struct tm tm;
+    localtime_r(&t, &tm);
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%b %e %H:%M:%S", &tm);
+
+    int nn = snprintf(buffer, n, "<%u>%s %.*slast message repeated %u times",
+                      (unsigned) (w->flags & MsgPriMask), stamp, (int) w->nhead, w->head,
+                      w->repeats);
+    w->repeats = 0;
+    statAdd(&reportMsgs_);
+    return (size_t) nn < n ? nn : n - 1;
+}
+
+void Dedup::dumpStats(FILE *fp, const char *prefix) const
+{
+    statPrint(fp, prefix, "dedup_repeat_msgs", statGet(&repeatMsgs_));
+    statPrint(fp, prefix, "dedup_report_msgs", statGet(&reportMsgs_));
+}
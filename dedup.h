@@ -0,0 +1,123 @@
+/* vim:expandtab:shiftwidth=4:tabstop=4:smarttab:
+ */
+
+#ifndef _DEDUP_H_
+#define _DEDUP_H_
+
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <stats.h>
+#include <syslogmsg.h>
+
+/* collapses the runs of one message of one reader thread. a sender slot
+ * (syslogmsg.h) remembers the hash and length of its last message,
+ * without the timestamp. a message that has both again is counted and
+ * not buffered, when the sender says something else or the run is
+ * timeout ms old, "last message repeated N times" goes out in its place.
+ * nothing is kept of the message but a few bytes of its TAG for that.
+ * sender 0, the senders without credentials, may be many processes,
+ * their messages always pass.
+ */
+class Dedup {
+public:
+    Dedup(int timeout);
+
+    /* the clock of repeated(), once per batch */
+    void clock() { now_ = nowMsec(); }
+
+    /* whether msg repeats the last message of its sender. if not it may
+     * end a run, *nreport is then the length of the record in report
+     * that goes before msg, else 0. report holds maxReport bytes.
+     */
+    bool repeated(const char *msg, size_t n, uint32_t flags, char *report, size_t *nreport);
+
+    /* the runs that are timeout ms old into outbuffer */
+    template <typename OutputBuffer>
+    void tick(OutputBuffer *outbuffer);
+
+    /* repeats collapsed and reports written so far */
+    void dumpStats(FILE *fp, const char *prefix) const;
+
+    static const size_t maxReport = 128;
+
+private:
+    struct Window {
+        uint64_t hash;           // 0 is none
+        uint32_t len;
+        uint32_t repeats;
+        long     stamp;          // nowMsec() the run started
+        uint32_t flags;
+        uint8_t  nhead;
+        char     head[35];       // "TAG[pid]: " of the message
+    };
+
+    static uint64_t hashBytes(const char *p, size_t n);
+    size_t report(Window *w, char *buffer, size_t n);
+
+private:
+    int      timeout_;
+    long     now_;
+    long     nextScan_;
+    Window   windows_[nsender];
+
+    uint64_t repeatMsgs_;
+    uint64_t reportMsgs_;
+};
+
+/* four independent lanes of 8 bytes, 32 bytes a round, the compiler
+ * keeps them in registers (or vectors) and no lane waits for another.
+ */
+inline uint64_t Dedup::hashBytes(const char *p, size_t n)
+{
+    const uint64_t k1 = 0x9e3779b185ebca87ULL, k2 = 0xc2b2ae3d27d4eb4fULL;
+    uint64_t lane[4] = { k1, k2, k1 ^ n, k2 ^ n };
+
+    for (; n >= 32; p += 32, n -= 32) {
+        uint64_t w[4];
+        memcpy(w, p, sizeof(w));
+        for (int i = 0; i < 4; ++i) {
+            lane[i] = (lane[i] ^ w[i]) * k1;
+            lane[i] ^= lane[i] >> 29;
+        }
+    }
+
+    uint64_t h = lane[0] ^ (lane[1] * k2) ^ (lane[2] >> 7) ^ (lane[3] << 11);
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        h = ((h ^ w) * k1) ^ (h >> 31);
+    }
+    for (; n > 0; ++p, --n) h = (h ^ (unsigned char) *p) * k2;
+
+    h ^= h >> 33;
+    h *= k1;
+    h ^= h >> 29;
+    return h;
+}
+
+template <typename OutputBuffer>
+void Dedup::tick(OutputBuffer *outbuffer)
+{
+    long now = nowMsec();
+    if (now < nextScan_) return;
+    nextScan_ = now + (timeout_ < 100 ? timeout_ : 100);
+
+    /* a run is reported and goes on, a lone message is forgotten */
+    char buffer[maxReport];
+    for (size_t i = 0; i < (size_t) nsender; ++i) {
+        Window *w = &windows_[i];
+        if (!w->hash || now - w->stamp < timeout_) continue;
+
+        if (w->repeats) {
+            size_t n = report(w, buffer, sizeof(buffer));
+            uint32_t flags = w->flags & (MsgSenderMask | MsgRouteMask);
+            outbuffer->write(buffer, n, parsePri(buffer, n) | flags);
+            w->stamp = now;
+        } else {
+            w->hash = 0;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,69 @@
+/* vim:expandtab:shiftwidth=4:tabstop=4:smarttab:
+ */
+
+#ifndef _INETADDR_H_
+#define _INETADDR_H_
+
+#include <cstdio>
+#include <cstring>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/* "tcp://host:port" and "udp://host:port" are network endpoints, any other
+ * address is an AF_UNIX path. port is 514 if left out, an IPv6 host goes
+ * in brackets, "tcp://[::1]:514", an empty host binds to all addresses.
+ */
+inline bool inetAddr(const char *addr, bool *isStream)
+{
+    if (strncmp(addr, "tcp://", 6) == 0) {
+        *isStream = true;
+        return true;
+    }
+    if (strncmp(addr, "udp://", 6) == 0) {
+        *isStream = false;
+        return true;
+    }
+    return false;
+}
+
+/* passive resolves for bind(), the caller frees it with freeaddrinfo() */
+inline struct addrinfo *resolveInet(const char *addr, bool passive)
+{
+    bool isStream;
+    if (!inetAddr(addr, &isStream)) return 0;
+
+    const char *host = addr + 6, *end;
+    if (*host == '[') {
+        end = strchr(++host, ']');
+    } else {
+        end = strrchr(host, ':');
+        if (!end) end = host + strlen(host);
+    }
+
+    char name[256];
+    if (!end || (size_t) (end - host) >= sizeof(name)) {
+        fprintf(stderr, "bad address %s\n", addr);
+        return 0;
+    }
+    memcpy(name, host, end - host);
+    name[end - host] = '\0';
+
+    if (*end == ']') ++end;
+    const char *port = (*end == ':') ? end + 1 : "514";
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0x00, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = isStream ? SOCK_STREAM : SOCK_DGRAM;
+    hints.ai_flags    = passive ? AI_PASSIVE : 0;
+
+    int rc = getaddrinfo(name[0] ? name : 0, port, &hints, &res);
+    if (rc != 0) {
+        fprintf(stderr, "getaddrinfo(%s) error, %s\n", addr, gai_strerror(rc));
+        return 0;
+    }
+    return res;
+}
+
+#endif
@@ -4,60 +4,307 @@
 #ifndef _LOGREADER_H_
 #define _LOGREADER_H_
 
+#include <cstddef>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <vector>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <syslogmsg.h>
+#include <shmring.h>
+#include <uring.h>
+#include <ratelimit.h>
+#include <dedup.h>
+#include <router.h>
+#include <stats.h>
+
+/* the SCM_CREDENTIALS a unix socket with SO_PASSCRED attaches */
+static const size_t credSpace = CMSG_SPACE(sizeof(struct ucred));
+
+/* the credentials in msg, pid 0 if it has none */
+inline struct ucred credOf(struct msghdr *msg)
+{
+    struct ucred cred;
+    memset(&cred, 0x00, sizeof(cred));
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_CREDENTIALS &&
+        cmsg->cmsg_len >= CMSG_LEN(sizeof(struct ucred))) {
+        memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+    }
+    return cred;
+}
+
+/* counters of one source socket or stream connection */
+struct ConnStats {
+    int        fd;
+    pid_t      pid;              // of the peer, 0 if unknown
+    uid_t      uid;
+    uint64_t   msgs;
+    uint64_t   bytes;
+    ConnStats *prev;
+    ConnStats *next;
+};
+
+/* the reader thread bumps the counters, the live connections are in a
+ * list whose mutex is taken on accept, close and by dump() only.
+ */
+class ReaderStats {
+public:
+    ReaderStats() : msgs_(0), bytes_(0), accepts_(0), closes_(0), shmDrops_(0), waits_(0),
+                    discards_(0) {
+        int eno = pthread_mutex_init(&mutex_, 0);
+        if (eno != 0) throw eno;
+        conns_.prev = conns_.next = &conns_;
+    }
+    ~ReaderStats() {
+        pthread_mutex_destroy(&mutex_);
+    }
+
+    void add(ConnStats *conn) {
+        conn->msgs = conn->bytes = 0;
+        pthread_mutex_lock(&mutex_);
+        conn->prev = conns_.prev;
+        conn->next = &conns_;
+        conns_.prev->next = conn;
+        conns_.prev = conn;
+        pthread_mutex_unlock(&mutex_);
+    }
+
+    void remove(ConnStats *conn) {
+        pthread_mutex_lock(&mutex_);
+        conn->prev->next = conn->next;
+        conn->next->prev = conn->prev;
+        pthread_mutex_unlock(&mutex_);
+        statAdd(&closes_);
+    }
+
+    void recv(ConnStats *conn, uint64_t msgs, uint64_t bytes) {
+        statAdd(&msgs_, msgs);
+        statAdd(&bytes_, bytes);
+        statAdd(&conn->msgs, msgs);
+        statAdd(&conn->bytes, bytes);
+    }
+
+    void accepted() {
+        statAdd(&accepts_);
+    }
+
+    void shmDropped(uint64_t msgs) {
+        statAdd(&shmDrops_, msgs);
+    }
+
+    void waited() {
+        statAdd(&waits_);
+    }
+
+    void discarded() {
+        statAdd(&discards_);
+    }
+
+    void dump(FILE *fp, const char *prefix = "reader") {
+        statPrint(fp, prefix, "recv_msgs", statGet(&msgs_));
+        statPrint(fp, prefix, "recv_bytes", statGet(&bytes_));
+        statPrint(fp, prefix, "accepts", statGet(&accepts_));
+        statPrint(fp, prefix, "closes", statGet(&closes_));
+        statPrint(fp, prefix, "shm_drops", statGet(&shmDrops_));
+        statPrint(fp, prefix, "waits", statGet(&waits_));
+        statPrint(fp, prefix, "discard_msgs", statGet(&discards_));
+
+        pthread_mutex_lock(&mutex_);
+        for (ConnStats *conn = conns_.next; conn != &conns_; conn = conn->next) {
+            fprintf(fp, "%s_conn fd=%d pid=%d uid=%d msgs=%llu bytes=%llu\n", prefix,
+                    conn->fd, (int) conn->pid, (int) conn->uid,
+                    (unsigned long long) statGet(&conn->msgs),
+                    (unsigned long long) statGet(&conn->bytes));
+        }
+        pthread_mutex_unlock(&mutex_);
+    }
+
+private:
+    uint64_t        msgs_;
+    uint64_t        bytes_;
+    uint64_t        accepts_;
+    uint64_t        closes_;
+    uint64_t        shmDrops_;       // the full rings of shm clients refused
+    uint64_t        waits_;          // epoll_wait() or io_uring_enter() calls
+    uint64_t        discards_;       // by a discard rule of -x
+    pthread_mutex_t mutex_;
+    ConnStats       conns_;
+};
+
+template <typename OutputBuffer>
+class EventProcessor;
 
 template <typename OutputBuffer>
 class LogReader {
 public:
-    LogReader(const char *src, OutputBuffer *outbuffer, bool isStream = false);
+    /* the reader takes limiter (-k) and dedup (-c), they are used by
+     * the reader thread only. router (-x) is shared by every reader.
+     */
+    LogReader(const char *src, OutputBuffer *outbuffer, bool isStream = false,
+              size_t batch = 1, const char *shm = 0, bool uring = false,
+              RateLimiter *limiter = 0, Dedup *dedup = 0, const Router *router = 0);
     ~LogReader();
 
+    /* the epoll fd and the source socket, or shared, the socket of
+     * another reader, with exclusive each event wakes one of them.
+     * run() opens a reader that is not open yet.
+     */
+    bool open(int shared = -1, bool exclusive = false);
+    int sourceFd() const { return isStream_ ? sfd_ : dfd_; }
+
     bool run();
     bool stop();
 
+    void dumpStats(FILE *fp, const char *prefix = "reader") {
+        stats_.dump(fp, prefix);
+        if (limiter_) limiter_->dumpStats(fp, prefix);
+        if (dedup_) dedup_->dumpStats(fp, prefix);
+    }
+
 private:
     static int createStreamFd(const char *addr);
-    static bool addStreamFd(int efd, int sfd, OutputBuffer *outbuffer);
+    static bool addStreamFd(int efd, int sfd, OutputBuffer *outbuffer, ReaderStats *stats,
+                            RateLimiter *limiter, Dedup *dedup, const Router *router,
+                            bool exclusive = false);
 
     static int createDgramFd(const char *addr);
-    static bool addDgramFd(int efd, int dfd, OutputBuffer *outbuffer);
+    static bool addDgramFd(int efd, int dfd, OutputBuffer *outbuffer, ReaderStats *stats,
+                           RateLimiter *limiter, Dedup *dedup, const Router *router,
+                           size_t batch, bool exclusive = false);
+    bool addShmFds();
+    bool addSourceFd();
+
+    bool runUring(Uring *ring);
+    bool armSource(Uring *ring, EventProcessor<OutputBuffer> *ep);
+    bool armRecv(Uring *ring, EventProcessor<OutputBuffer> *ep);
+    bool armPoll(Uring *ring);
+
+    /* an arm the SQ had no room for */
+    struct Rearm {
+        EventProcessor<OutputBuffer> *ep;
+        long                          since;     // nowMsec() of the first try
+    };
+    static void rearm(std::vector<Rearm> *rearms, EventProcessor<OutputBuffer> *ep) {
+        Rearm r = { ep, nowMsec() };
+        rearms->push_back(r);
+    }
+    bool rearmAll(Uring *ring, std::vector<Rearm> *rearms);
+
+    static struct iovec recvmsgPayload(char *data, int res, struct ucred *cred);
+    int  processEvents(struct epoll_event *events, int nevent, int timeout);
+
+    static const size_t nsqe  = 256;
+    static const size_t nubuf = 256;     // provided buffers, nbuffer bytes each and a recvmsg header
+    static const int    rearmms = 1000;  // how long an arm is tried again
+    static const size_t nuhdr = sizeof(struct io_uring_recvmsg_out) + credSpace;
 
 private:
     bool          isStream_;
+    size_t        batch_;
     const char   *src_;
     OutputBuffer *outbuffer_;
     int efd_;
     int sfd_;
     int dfd_;
+    bool owned_;                 // sfd_ or dfd_ is not shared
+    bool exclusive_;
+    bool uring_;                 // the source is read by io_uring, the rest by epoll
+    struct msghdr rmsg_;         // what the multishot recvmsg of a dgram source takes
+    RateLimiter  *limiter_;      // -k, of this reader, 0 if none
+    Dedup        *dedup_;        // -c
+    const Router *router_;       // -x
+
+    /* -u, the rings of shm clients */
+    const char                   *shm_;
+    EventProcessor<OutputBuffer> *bell_;
 
     bool quit_;
+
+    ReaderStats stats_;
 };
 
 template <typename OutputBuffer>
 class EventProcessor {
 public:
-    enum FdType { Stream, Dgram, Normal };
+    /* ShmListen accepts ShmConn, one per client ring, ShmBell is the
+     * eventfd the clients ring and heads the list of their rings.
+     */
+    enum FdType { Stream, Dgram, Normal, ShmListen, ShmConn, ShmBell };
 
-    EventProcessor(int fd, int efd, OutputBuffer *outbuffer, FdType type = Normal)
-        : fd_(fd), efd_(efd), outbuffer_(outbuffer), fdType_(type) {
-        buffer_ = new char[OutputBuffer::nbuffer];
+    EventProcessor(int fd, int efd, OutputBuffer *outbuffer, ReaderStats *stats,
+                   FdType type = Normal, size_t batch = 1, EventProcessor *bell = 0,
+                   RateLimiter *limiter = 0, Dedup *dedup = 0, const Router *router = 0)
+        : fd_(fd), efd_(efd), outbuffer_(outbuffer), fdType_(type), stats_(stats),
+          limiter_(limiter), dedup_(dedup), router_(router), batch_(batch), msgs_(0), iovs_(0), tags_(0),
+          ctls_(0), sender_(0), nbuf_(0), skip_(0), skipLine_(false),
+          bell_(bell), prev_(this), next_(this), ring_(0), rsize_(0), maplen_(0), drops_(0) {
+        buffer_ = new char[OutputBuffer::nbuffer * batch_];
+        if (batch_ > 1) initBatch();
+        if (fdType_ == Normal || fdType_ == ShmConn) initFrames();
+        if (hasConn()) initStats();
     }
     ~EventProcessor() {
+        if (ring_) unmapRing();
+        if (hasConn()) stats_->remove(&conn_);
         close(fd_);
         delete[] buffer_;
+        delete[] msgs_;
+        delete[] iovs_;
+        delete[] tags_;
+        delete[] ctls_;
     }
 
     bool process();
+    bool pollRings(bool idle);
+
+    int fd() const { return fd_; }
+    FdType type() const { return fdType_; }
+
+    /* the io_uring reader, a connection the ring accepted, bytes of a
+     * connection and datagrams it received into provided buffers.
+     * received(0, 0) is the end of the connection, it deletes it. the
+     * datagrams are limited in place, tags is filled.
+     */
+    EventProcessor *accepted(int fd);
+    bool received(const char *data, size_t n);
+    void received(struct iovec *records, uint32_t *tags, const struct ucred *creds, size_t n);
+
+private:
+    bool hasConn() const {
+        return fdType_ == Dgram || fdType_ == Normal || fdType_ == ShmConn;
+    }
+
+    void initBatch();
+    void initFrames();
+    void initStats();
+    void clock();
+    bool admit(const char *data, size_t len, pid_t pid, uid_t uid, uint32_t *tag,
+               const struct iovec *records, const uint32_t *tags, size_t *cnt);
+    bool processBatch();
+    size_t splitFrames(bool eof);
+
+    bool processShm();
+    bool mapRing(int mfd);
+    void unmapRing();
+    size_t drainRing();
+    size_t drainRings();
+
+    static const size_t nframe = 256;
 
 private:
     int           fd_;
@@ -65,12 +312,233 @@ private:
     OutputBuffer *outbuffer_;
     FdType        fdType_;
     char         *buffer_;
+
+    ReaderStats  *stats_;
+    ConnStats     conn_;
+    RateLimiter  *limiter_;
+    Dedup        *dedup_;
+    const Router *router_;
+
+    /* recvmmsg state, one nbuffer slot of buffer_ and one credSpace
+     * slot of ctls_ per datagram.
+     */
+    size_t          batch_;
+    struct mmsghdr *msgs_;
+    struct iovec   *iovs_;
+    uint32_t       *tags_;
+    char           *ctls_;
+
+    /* the peer of a connection, senderTag() of its SO_PEERCRED */
+    uint32_t        sender_;
+
+    /* stream reassembly, buffer_ holds nbuf_ bytes of which the head is
+     * an incomplete message, skip_ bytes of a truncated one are discarded,
+     * or with skipLine_ what comes up to its LF or NUL.
+     */
+    size_t          nbuf_;
+    size_t          skip_;
+    bool            skipLine_;
+
+    /* a ShmConn maps the ring of its client, rsize_ is the size it had
+     * then, the client can not change it under us. drops_ were counted.
+     */
+    EventProcessor *bell_;
+    EventProcessor *prev_;
+    EventProcessor *next_;
+    ShmRing        *ring_;
+    uint32_t        rsize_;
+    size_t          maplen_;
+    uint64_t        drops_;
 };
 
+template <typename OutputBuffer>
+void EventProcessor<OutputBuffer>::initBatch()
+{
+    msgs_ = new struct mmsghdr[batch_];
+    iovs_ = new struct iovec[batch_ * 2];
+    tags_ = new uint32_t[batch_];
+    ctls_ = new char[credSpace * batch_];
+
+    memset(msgs_, 0x00, sizeof(struct mmsghdr) * batch_);
+    for (size_t i = 0; i < batch_; ++i) {
+        iovs_[i].iov_base = buffer_ + i * OutputBuffer::nbuffer;
+        iovs_[i].iov_len  = OutputBuffer::nbuffer;
+        msgs_[i].msg_hdr.msg_iov     = iovs_ + i;
+        msgs_[i].msg_hdr.msg_iovlen  = 1;
+        msgs_[i].msg_hdr.msg_control = ctls_ + i * credSpace;
+    }
+}
+
+template <typename OutputBuffer>
+void EventProcessor<OutputBuffer>::initFrames()
+{
+    iovs_ = new struct iovec[nframe];
+    tags_ = new uint32_t[nframe];
+}
+
+/* cut the messages of buffer_ into records pointing into it, the rest
+ * is moved to the front. a message larger than buffer_ is truncated to
+ * it, the rest of it is discarded as it comes, by its octet count or up
+ * to its trailer. with eof the incomplete message is taken as it is.
+ */
+template <typename OutputBuffer>
+size_t EventProcessor<OutputBuffer>::splitFrames(bool eof)
+{
+    clock();
+
+    size_t pos = 0, cnt = 0, nmsg = 0;
+    while (pos < nbuf_) {
+        if (skip_) {
+            size_t n = (skip_ < nbuf_ - pos) ? skip_ : nbuf_ - pos;
+            pos   += n;
+            skip_ -= n;
+            continue;
+        }
+        if (skipLine_) {
+            const char *p   = buffer_ + pos;
+            const char *lf  = (const char *) memchr(p, '\n', nbuf_ - pos);
+            const char *nul = (const char *) memchr(p, '\0', lf ? lf - p : nbuf_ - pos);
+            const char *end = nul ? nul : lf;
+            pos = end ? end + 1 - buffer_ : nbuf_;
+            skipLine_ = !end;
+            continue;
+        }
+
+        size_t off, len;
+        size_t frame = parseFrame(buffer_ + pos, nbuf_ - pos, &off, &len);
+        if (frame == 0) {
+            if (!eof && (pos > 0 || nbuf_ < OutputBuffer::nbuffer)) break;
+
+            if (off + len > nbuf_ - pos) skip_ = off + len - (nbuf_ - pos);
+            if (off == 0 && !eof) skipLine_ = true;
+            len   = nbuf_ - pos - off;
+            frame = nbuf_ - pos;
+        }
+
+        const char *data = buffer_ + pos + off;
+        uint32_t    tag  = len ? parsePri(data, len) | sender_ : 0;
+        if (len) ++nmsg;
+        if (len && admit(data, len, conn_.pid, conn_.uid, &tag, iovs_, tags_, &cnt)) {
+            iovs_[cnt].iov_base = (void *) data;
+            iovs_[cnt].iov_len  = len;
+            tags_[cnt] = tag;
+            ++cnt;
+        }
+        pos += frame;
+
+        if (cnt == nframe) {
+            outbuffer_->write(iovs_, cnt, tags_);
+            cnt = 0;
+        }
+    }
+    if (cnt) outbuffer_->write(iovs_, cnt, tags_);
+
+    nbuf_ -= pos;
+    if (nbuf_) memmove(buffer_, buffer_ + pos, nbuf_);
+    return nmsg;
+}
+
+template <typename OutputBuffer>
+void EventProcessor<OutputBuffer>::initStats()
+{
+    conn_.fd  = fd_;
+    conn_.pid = 0;
+    conn_.uid = 0;
+
+    /* the peer of a connection does not change, no SCM_CREDENTIALS on
+     * every recv() for it.
+     */
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if ((fdType_ == Normal || fdType_ == ShmConn) &&
+        getsockopt(fd_, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.pid > 0) {
+        conn_.pid = cred.pid;
+        conn_.uid = cred.uid;
+        sender_   = senderTag(cred.pid, cred.uid);
+    }
+    stats_->add(&conn_);
+}
+
+template <typename OutputBuffer>
+void EventProcessor<OutputBuffer>::clock()
+{
+    if (limiter_) limiter_->clock();
+    if (dedup_) dedup_->clock();
+}
+
+/* -x, -c and -k, whether a message joins records[0, *cnt), its route
+ * joins *tag. one that ends a run of repeats has the report of the run
+ * written first, and with it the records before it, *cnt is 0 then.
+ * the report has the PRI and TAG of the run, so it takes its route.
+ * repeats are collapsed before -k, they cost the sender no tokens.
+ */
+template <typename OutputBuffer>
+bool EventProcessor<OutputBuffer>::admit(const char *data, size_t len, pid_t pid, uid_t uid,
+                                         uint32_t *tag, const struct iovec *records,
+                                         const uint32_t *tags, size_t *cnt)
+{
+    if (router_ && !router_->route(data, len, tag)) {
+        stats_->discarded();
+        return false;
+    }
+
+    if (dedup_) {
+        char report[Dedup::maxReport];
+        size_t n;
+        if (dedup_->repeated(data, len, *tag, report, &n)) return false;
+        if (n) {
+            uint32_t flags = parsePri(report, n) | (*tag & MsgSenderMask);
+            if (*cnt) outbuffer_->write(records, *cnt, tags);
+            if (!router_ || router_->route(report, n, &flags)) outbuffer_->write(report, n, flags);
+            *cnt = 0;
+        }
+    }
+    return !limiter_ || limiter_->allow(data, len, pid, uid);
+}
+
+/* iovs_[0, batch_) are the receive slots, iovs_[batch_, 2*batch_)
+ * describe the received records handed to the bulk write, less those
+ * those admit() held back.
+ */
+template <typename OutputBuffer>
+bool EventProcessor<OutputBuffer>::processBatch()
+{
+    struct iovec *records = iovs_ + batch_;
+
+    int n;
+    for (;;) {
+        for (size_t i = 0; i < batch_; ++i) msgs_[i].msg_hdr.msg_controllen = credSpace;
+        if ((n = recvmmsg(fd_, msgs_, batch_, MSG_DONTWAIT, 0)) <= 0) break;
+
+        clock();
+
+        size_t bytes = 0, cnt = 0;
+        for (int i = 0; i < n; ++i) {
+            const char  *data = (const char *) iovs_[i].iov_base;
+            size_t       len  = msgs_[i].msg_len;
+            struct ucred cred = credOf(&msgs_[i].msg_hdr);
+            uint32_t     tag  = parsePri(data, len) | senderTag(cred.pid, cred.uid);
+            bytes += len;
+            if (!admit(data, len, cred.pid, cred.uid, &tag, records, tags_, &cnt)) continue;
+
+            records[cnt].iov_base = (void *) data;
+            records[cnt].iov_len  = len;
+            tags_[cnt] = tag;
+            ++cnt;
+        }
+        if (cnt) outbuffer_->write(records, cnt, tags_);
+        stats_->recv(&conn_, n, bytes);
+
+        /* a short batch means the queue is drained, epoll tells us the rest */
+        if ((size_t) n < batch_) break;
+    }
+    return true;
+}
+
 template <typename OutputBuffer>
 bool EventProcessor<OutputBuffer>::process()
 {
-    if (fdType_ == Stream) {
+    if (fdType_ == Stream || fdType_ == ShmListen) {
         int fd = accept(fd_, 0, 0);
         if (fd > 0) {
             int flags = 1;
@@ -78,7 +546,7 @@ bool EventProcessor<OutputBuffer>::process()
                 fprintf(stderr, "ioctl(FIONBIO) error, %d:%s\n", errno, strerror(errno));
             }
 
-            EventProcessor *ep = new EventProcessor(fd, efd_, outbuffer_);
+            EventProcessor *ep = accepted(fd);
 
             struct epoll_event eevent;
             eevent.events = EPOLLIN;
@@ -91,16 +559,47 @@ bool EventProcessor<OutputBuffer>::process()
             return true;
         }
     } else if (fdType_ == Dgram) {
+        if (batch_ > 1) return processBatch();
+
+        char ctl[credSpace];
+        struct iovec iov = { buffer_, OutputBuffer::nbuffer };
+
+        struct msghdr msg;
+        memset(&msg, 0x00, sizeof(msg));
+        msg.msg_iov     = &iov;
+        msg.msg_iovlen  = 1;
+        msg.msg_control = ctl;
+
         ssize_t nn;
-        while ((nn = recv(fd_, buffer_, OutputBuffer::nbuffer, 0)) > 0) {
-            outbuffer_->write(buffer_, nn);
+        for (;;) {
+            msg.msg_controllen = sizeof(ctl);
+            if ((nn = recvmsg(fd_, &msg, 0)) <= 0) break;
+
+            struct ucred cred = credOf(&msg);
+            uint32_t     tag  = parsePri(buffer_, nn) | senderTag(cred.pid, cred.uid);
+            size_t       cnt  = 0;
+            clock();
+            if (admit(buffer_, nn, cred.pid, cred.uid, &tag, 0, 0, &cnt)) {
+                outbuffer_->write(buffer_, nn, tag);
+            }
+            stats_->recv(&conn_, 1, nn);
+        }
+        return true;
+    } else if (fdType_ == ShmConn) {
+        return processShm();
+    } else if (fdType_ == ShmBell) {
+        /* the rings are drained by pollRings() after every event */
+        uint64_t n;
+        while (read(fd_, &n, sizeof(n)) > 0) {
         }
         return true;
     } else {
         ssize_t nn;
-        while ((nn = recv(fd_, buffer_, OutputBuffer::nbuffer, 0)) > 0) {
-            outbuffer_->write(buffer_, nn);
+        while ((nn = recv(fd_, buffer_ + nbuf_, OutputBuffer::nbuffer - nbuf_, 0)) > 0) {
+            nbuf_ += nn;
+            stats_->recv(&conn_, splitFrames(false), nn);
         }
+        if (nn == 0 && nbuf_) stats_->recv(&conn_, splitFrames(true), 0);
 
         if (nn == 0 || (nn == -1 && errno != EAGAIN)) {
             delete this;
@@ -112,16 +611,289 @@ bool EventProcessor<OutputBuffer>::process()
 }
 
 template <typename OutputBuffer>
-LogReader<OutputBuffer>::LogReader(const char *src, OutputBuffer *outbuffer, bool isStream)
-    : isStream_(isStream), src_(src), outbuffer_(outbuffer),
-      efd_(-1), sfd_(-1), dfd_(-1), quit_(false) { }
+EventProcessor<OutputBuffer> *EventProcessor<OutputBuffer>::accepted(int fd)
+{
+    stats_->accepted();
+    return (fdType_ == Stream) ?
+        new EventProcessor(fd, efd_, outbuffer_, stats_, Normal, 1, 0, limiter_, dedup_,
+                           router_) :
+        new EventProcessor(fd, efd_, outbuffer_, stats_, ShmConn, 1, bell_, limiter_, dedup_,
+                           router_);
+}
+
+/* the same reassembly as recv() into buffer_, n may be more than fits */
+template <typename OutputBuffer>
+bool EventProcessor<OutputBuffer>::received(const char *data, size_t n)
+{
+    if (n == 0) {
+        if (nbuf_) stats_->recv(&conn_, splitFrames(true), 0);
+        delete this;
+        return false;
+    }
+
+    while (n > 0) {
+        size_t nn = OutputBuffer::nbuffer - nbuf_;
+        if (nn > n) nn = n;
+
+        memcpy(buffer_ + nbuf_, data, nn);
+        nbuf_ += nn;
+        data  += nn;
+        n     -= nn;
+        stats_->recv(&conn_, splitFrames(false), nn);
+    }
+    return true;
+}
+
+template <typename OutputBuffer>
+void EventProcessor<OutputBuffer>::received(struct iovec *records, uint32_t *tags,
+                                            const struct ucred *creds, size_t n)
+{
+    clock();
+
+    size_t bytes = 0, cnt = 0;
+    for (size_t i = 0; i < n; ++i) {
+        const char *data = (const char *) records[i].iov_base;
+        size_t      len  = records[i].iov_len;
+        uint32_t    tag  = parsePri(data, len) | senderTag(creds[i].pid, creds[i].uid);
+        bytes += len;
+        if (!admit(data, len, creds[i].pid, creds[i].uid, &tag, records, tags, &cnt)) continue;
+
+        records[cnt] = records[i];
+        tags[cnt]    = tag;
+        ++cnt;
+    }
+    if (cnt) outbuffer_->write(records, cnt, tags);
+    stats_->recv(&conn_, n, bytes);
+}
+
+/* the first message of a client brings the memfd of its ring, it gets
+ * the eventfd of the bell back. after that only the end of the
+ * connection matters, what is left in the ring is drained then.
+ */
+template <typename OutputBuffer>
+bool EventProcessor<OutputBuffer>::processShm()
+{
+    union {
+        struct cmsghdr hdr;
+        char           buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+
+    ssize_t nn;
+    for (;;) {
+        char byte;
+        struct iovec iov = { &byte, 1 };
+
+        struct msghdr msg;
+        memset(&msg, 0x00, sizeof(msg));
+        msg.msg_iov        = &iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+
+        if ((nn = recvmsg(fd_, &msg, MSG_CMSG_CLOEXEC)) <= 0) break;
+
+        int mfd = -1;
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(&mfd, CMSG_DATA(cmsg), sizeof(int));
+        }
+
+        bool ok = !ring_ && mfd != -1 && mapRing(mfd);
+        if (mfd != -1) close(mfd);
+        if (!ok) {
+            fprintf(stderr, "shm client pid %d refused\n", (int) conn_.pid);
+            delete this;
+            return false;
+        }
+
+        memset(&msg, 0x00, sizeof(msg));
+        msg.msg_iov        = &iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type  = SCM_RIGHTS;
+        cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &bell_->fd_, sizeof(int));
+
+        if (sendmsg(fd_, &msg, MSG_NOSIGNAL | MSG_DONTWAIT) != 1) {
+            fprintf(stderr, "sendmsg() error, %d:%s\n", errno, strerror(errno));
+            delete this;
+            return false;
+        }
+    }
+
+    if (nn == 0 || (nn == -1 && errno != EAGAIN)) {
+        drainRing();
+        delete this;
+        return nn == 0;
+    }
+    return true;
+}
+
+/* the client may not shrink the memfd, a read past its end is SIGBUS */
+template <typename OutputBuffer>
+bool EventProcessor<OutputBuffer>::mapRing(int mfd)
+{
+    struct stat st;
+    int seals = fcntl(mfd, F_GET_SEALS);
+    if (seals == -1 || !(seals & F_SEAL_SHRINK) || fstat(mfd, &st) != 0 ||
+        st.st_size < (off_t) (sizeof(ShmRing) + shmMinSize) ||
+        st.st_size > (off_t) (sizeof(ShmRing) + shmMaxSize)) {
+        return false;
+    }
+
+    void *addr = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "mmap() error, %d:%s\n", errno, strerror(errno));
+        return false;
+    }
+
+    ShmRing *ring = (ShmRing *) addr;
+    uint32_t size = ring->size;
+    if (ring->magic != SHM_RING_MAGIC || size < shmMinSize || (size & (size - 1)) != 0 ||
+        sizeof(ShmRing) + size > (size_t) st.st_size) {
+        munmap(addr, st.st_size);
+        return false;
+    }
+
+    ring_   = ring;
+    rsize_  = size;
+    maplen_ = st.st_size;
+    drops_  = 0;
+
+    prev_ = bell_->prev_;
+    next_ = bell_;
+    bell_->prev_->next_ = this;
+    bell_->prev_ = this;
+    return true;
+}
+
+template <typename OutputBuffer>
+void EventProcessor<OutputBuffer>::unmapRing()
+{
+    prev_->next_ = next_;
+    next_->prev_ = prev_;
+    prev_ = next_ = this;
+
+    munmap(ring_, maplen_);
+    ring_ = 0;
+}
+
+/* records go to the output buffer right out of the ring, the tail is
+ * moved after they are copied. a broken ring is let go, the client
+ * sees its connection end.
+ */
+template <typename OutputBuffer>
+size_t EventProcessor<OutputBuffer>::drainRing()
+{
+    if (!ring_) return 0;
+
+    uint64_t tail = ring_->tail;
+    uint64_t head = __atomic_load_n(&ring_->head, __ATOMIC_ACQUIRE);
+    size_t cnt = 0, nmsg = 0, bytes = 0;
+    bool broken = head - tail > rsize_;
+    clock();
+
+    while (tail != head && !broken) {
+        uint32_t off = tail & (rsize_ - 1), len;
+        memcpy(&len, ring_->data + off, sizeof(len));
+
+        if (len == shmPad) {
+            broken = rsize_ - off > head - tail;
+            tail  += rsize_ - off;
+            continue;
+        }
+        if (len > shmMaxMsg || shmSlot(len) > rsize_ - off || shmSlot(len) > head - tail) {
+            broken = true;
+            break;
+        }
+
+        const char *data = ring_->data + off + sizeof(len);
+        uint32_t    tag  = parsePri(data, len) | sender_;
+        bytes += len;
+        tail  += shmSlot(len);
+        ++nmsg;
+        if (!admit(data, len, conn_.pid, conn_.uid, &tag, iovs_, tags_, &cnt)) continue;
+
+        iovs_[cnt].iov_base = (void *) data;
+        iovs_[cnt].iov_len  = len;
+        tags_[cnt] = tag;
+
+        if (++cnt == nframe) {
+            outbuffer_->write(iovs_, cnt, tags_);
+            __atomic_store_n(&ring_->tail, tail, __ATOMIC_RELEASE);
+            cnt = 0;
+        }
+    }
+    if (cnt) outbuffer_->write(iovs_, cnt, tags_);
+    __atomic_store_n(&ring_->tail, tail, __ATOMIC_RELEASE);
+    if (nmsg) stats_->recv(&conn_, nmsg, bytes);
+
+    uint64_t drops = __atomic_load_n(&ring_->drops, __ATOMIC_RELAXED);
+    if (drops != drops_) {
+        stats_->shmDropped(drops - drops_);
+        drops_ = drops;
+    }
+
+    if (broken) {
+        fprintf(stderr, "shm ring of pid %d is broken, let go\n", (int) conn_.pid);
+        unmapRing();
+        shutdown(fd_, SHUT_RDWR);
+    }
+    return nmsg;
+}
+
+template <typename OutputBuffer>
+size_t EventProcessor<OutputBuffer>::drainRings()
+{
+    size_t nmsg = 0;
+    for (EventProcessor *ep = next_, *next; ep != this; ep = next) {
+        next  = ep->next_;
+        nmsg += ep->drainRing();
+    }
+    return nmsg;
+}
+
+/* on the bell, after every round of events. while messages keep coming
+ * the reader looks at the rings every ms and the clients never ring,
+ * after a round with nothing the rings are armed and the reader may
+ * sleep, the next message rings. returns whether they are armed.
+ */
+template <typename OutputBuffer>
+bool EventProcessor<OutputBuffer>::pollRings(bool idle)
+{
+    if (drainRings() > 0 || !idle) return false;
+
+    for (EventProcessor *ep = next_; ep != this; ep = ep->next_) {
+        __atomic_store_n(&ep->ring_->waiting, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return drainRings() == 0;
+}
+
+template <typename OutputBuffer>
+LogReader<OutputBuffer>::LogReader(const char *src, OutputBuffer *outbuffer, bool isStream,
+                                   size_t batch, const char *shm, bool uring,
+                                   RateLimiter *limiter, Dedup *dedup, const Router *router)
+    : isStream_(isStream), batch_(batch), src_(src), outbuffer_(outbuffer),
+      efd_(-1), sfd_(-1), dfd_(-1), owned_(true), exclusive_(false), uring_(uring),
+      limiter_(limiter), dedup_(dedup), router_(router), shm_(shm), bell_(0), quit_(false)
+{
+    memset(&rmsg_, 0x00, sizeof(rmsg_));
+    rmsg_.msg_controllen = credSpace;
+}
 
 template <typename OutputBuffer>
 LogReader<OutputBuffer>::~LogReader()
 {
+    delete limiter_;
+    delete dedup_;
     if (efd_ != -1) close(efd_);
-    if (sfd_ != -1) close(sfd_);
-    if (dfd_ != -1) close(dfd_);
+    if (sfd_ != -1 && owned_) close(sfd_);
+    if (dfd_ != -1 && owned_) close(dfd_);
 }
 
 template <typename OutputBuffer>
@@ -172,13 +944,18 @@ int LogReader<OutputBuffer>::createStreamFd(const char *addr)
 }
 
 template <typename OutputBuffer>
-bool LogReader<OutputBuffer>::addStreamFd(int efd, int sfd, OutputBuffer *outbuffer)
+bool LogReader<OutputBuffer>::addStreamFd(int efd, int sfd, OutputBuffer *outbuffer,
+                                          ReaderStats *stats, RateLimiter *limiter,
+                                          Dedup *dedup, const Router *router,
+                                          bool exclusive)
 {
     EventProcessor<OutputBuffer> *ep =
-        new EventProcessor<OutputBuffer>(sfd, efd, outbuffer, EventProcessor<OutputBuffer>::Stream);
+        new EventProcessor<OutputBuffer>(sfd, efd, outbuffer, stats,
+                                         EventProcessor<OutputBuffer>::Stream, 1, 0,
+                                         limiter, dedup, router);
 
     struct epoll_event eevent;
-    eevent.events = EPOLLIN;
+    eevent.events = exclusive ? EPOLLIN | EPOLLEXCLUSIVE : EPOLLIN;
     eevent.data.ptr = ep;
 
     return epoll_ctl(efd, EPOLL_CTL_ADD, sfd, &eevent) == 0;
@@ -200,6 +977,12 @@ int LogReader<OutputBuffer>::createDgramFd(const char *addr)
         return -1;
     }
 
+    /* every datagram brings the pid and uid of its sender */
+    int on = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) != 0) {
+        fprintf(stderr, "setsockopt(SO_PASSCRED) error, %d:%s\n", errno, strerror(errno));
+    }
+
     struct sockaddr_un un;
     socklen_t len;
 
@@ -226,56 +1009,361 @@ int LogReader<OutputBuffer>::createDgramFd(const char *addr)
 }
 
 template <typename OutputBuffer>
-bool LogReader<OutputBuffer>::addDgramFd(int efd, int dfd, OutputBuffer *outbuffer)
+bool LogReader<OutputBuffer>::addDgramFd(int efd, int dfd, OutputBuffer *outbuffer,
+                                         ReaderStats *stats, RateLimiter *limiter,
+                                         Dedup *dedup, const Router *router,
+                                         size_t batch, bool exclusive)
 {
     EventProcessor<OutputBuffer> *ep =
-        new EventProcessor<OutputBuffer>(dfd, efd, outbuffer, EventProcessor<OutputBuffer>::Dgram);
+        new EventProcessor<OutputBuffer>(dfd, efd, outbuffer, stats,
+                                         EventProcessor<OutputBuffer>::Dgram, batch, 0,
+                                         limiter, dedup, router);
 
     struct epoll_event eevent;
-    eevent.events = EPOLLIN;
+    eevent.events = exclusive ? EPOLLIN | EPOLLEXCLUSIVE : EPOLLIN;
     eevent.data.ptr = ep;
 
     return epoll_ctl(efd, EPOLL_CTL_ADD, dfd, &eevent) == 0;
 }
 
+/* the -u socket and the bell, both live as long as the reader */
 template <typename OutputBuffer>
-bool LogReader<OutputBuffer>::run()
+bool LogReader<OutputBuffer>::addShmFds()
 {
-    size_t nevent = 1024;
-    efd_ = epoll_create(nevent);
+    int bfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (bfd == -1) {
+        fprintf(stderr, "eventfd() error, %d:%s\n", errno, strerror(errno));
+        return false;
+    }
+    bell_ = new EventProcessor<OutputBuffer>(bfd, efd_, outbuffer_, &stats_,
+                                             EventProcessor<OutputBuffer>::ShmBell);
+
+    struct epoll_event eevent;
+    eevent.events = EPOLLIN;
+    eevent.data.ptr = bell_;
+    if (epoll_ctl(efd_, EPOLL_CTL_ADD, bfd, &eevent) != 0) return false;
+
+    int lfd = createStreamFd(shm_);
+    if (lfd == -1) return false;
+
+    eevent.data.ptr =
+        new EventProcessor<OutputBuffer>(lfd, efd_, outbuffer_, &stats_,
+                                         EventProcessor<OutputBuffer>::ShmListen, 1, bell_,
+                                         limiter_, dedup_, router_);
+    return epoll_ctl(efd_, EPOLL_CTL_ADD, lfd, &eevent) == 0;
+}
+
+template <typename OutputBuffer>
+bool LogReader<OutputBuffer>::open(int shared, bool exclusive)
+{
+    efd_ = epoll_create(1024);
     if (efd_ == -1) {
         fprintf(stderr, "epoll_create() error, %d:%s\n", errno, strerror(errno));
         return false;
     }
-
-    struct epoll_event *events =
-        (struct epoll_event *) calloc(nevent, sizeof(struct epoll_event));
+    owned_     = shared == -1;
+    exclusive_ = exclusive;
 
     if (isStream_) {
-        sfd_ = createStreamFd(src_);
+        sfd_ = owned_ ? createStreamFd(src_) : shared;
         if (sfd_ == -1) return false;
-
-        if (!addStreamFd(efd_, sfd_, outbuffer_)) return false;
     } else {
-        dfd_ = createDgramFd(src_);
+        dfd_ = owned_ ? createDgramFd(src_) : shared;
         if (dfd_ == -1) return false;
+    }
 
-        if (!addDgramFd(efd_, dfd_, outbuffer_)) return false;
+    if (uring_ && !Uring::supported()) {
+        fprintf(stderr, "io_uring is not supported, use epoll\n");
+        uring_ = false;
     }
+    if (!uring_ && !addSourceFd()) return false;
+
+    return !shm_ || addShmFds();
+}
+
+template <typename OutputBuffer>
+bool LogReader<OutputBuffer>::addSourceFd()
+{
+    return isStream_ ?
+        addStreamFd(efd_, sfd_, outbuffer_, &stats_, limiter_, dedup_, router_, exclusive_) :
+        addDgramFd(efd_, dfd_, outbuffer_, &stats_, limiter_, dedup_, router_, batch_,
+                   exclusive_);
+}
+
+/* the source, its connections and the recycled buffers are on the
+ * ring, what else the reader has stays in the epoll fd, which the ring
+ * polls. a multishot recv or accept keeps going until it comes back
+ * without IORING_CQE_F_MORE, it is armed again then (ENOBUFS, after the
+ * buffers were recycled) or the connection is gone.
+ *
+ * an arm the SQ has no room for is tried again every pass. a connection
+ * that stays unarmed for rearmms is closed, a source that does returns
+ * false, run() goes on with epoll then.
+ */
+template <typename OutputBuffer>
+bool LogReader<OutputBuffer>::runUring(Uring *ring)
+{
+    typedef EventProcessor<OutputBuffer> Processor;
 
+    if (!ring->addBuffers(nubuf, OutputBuffer::nbuffer + nuhdr)) return false;
+
+    Processor *src = new Processor(sourceFd(), efd_, outbuffer_, &stats_,
+                                   isStream_ ? Processor::Stream : Processor::Dgram,
+                                   1, 0, limiter_, dedup_, router_);
+    if (!armSource(ring, src) || !armPoll(ring)) return false;
+
+    size_t nevent = 1024;
+    struct epoll_event *events =
+        (struct epoll_event *) calloc(nevent, sizeof(struct epoll_event));
+
+    /* the datagrams of a round, written at once */
+    struct iovec records[nubuf];
+    uint32_t     tags[nubuf];
+    struct ucred creds[nubuf];
+    uint16_t     bids[nubuf];
+
+    std::vector<Rearm> rearms;
+    bool polled = true;
+
+    bool armed = false, ok = true;
+    while (!quit_) {
+        stats_.waited();
+        bool retry = !rearms.empty() || !polled;
+        if (ring->wait((retry || (bell_ && !armed)) ? 1 : 500) == -1 &&
+            errno != ETIME && errno != EINTR) {
+            fprintf(stderr, "io_uring_enter() error, %d:%s\n", errno, strerror(errno));
+            break;
+        }
+
+        size_t cnt = 0, n = 0;
+        struct io_uring_cqe *cqe;
+        while ((cqe = ring->peek()) != 0) {
+            Processor *ep  = (Processor *) (uintptr_t) cqe->user_data;
+            int      res   = cqe->res;
+            uint32_t flags = cqe->flags;
+            bool     more  = flags & IORING_CQE_F_MORE;
+            ring->seen();
+            ++n;
+
+            if (!ep) {
+                processEvents(events, nevent, 0);
+                polled = armPoll(ring);
+                continue;
+            }
+
+            if (ep->type() == Processor::Stream) {
+                Processor *conn = res >= 0 ? ep->accepted(res) : 0;
+                if (conn && !armRecv(ring, conn)) rearm(&rearms, conn);
+                if (!more && !armSource(ring, ep)) rearm(&rearms, ep);
+                continue;
+            }
+
+            char *data = 0;
+            uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+            if (flags & IORING_CQE_F_BUFFER) data = ring->buffer(bid);
+
+            if (ep->type() == Processor::Dgram) {
+                if (data && res >= (int) nuhdr) {
+                    records[cnt] = recvmsgPayload(data, res, &creds[cnt]);
+                    bids[cnt] = bid;
+                    ++cnt;
+                } else if (data) {
+                    ring->recycle(bid);
+                }
+                if (cnt == nubuf) {
+                    ep->received(records, tags, creds, cnt);
+                    for (size_t i = 0; i < cnt; ++i) ring->recycle(bids[i]);
+                    ring->publish();
+                    cnt = 0;
+                }
+                if (!more && !armSource(ring, ep)) rearm(&rearms, ep);
+                continue;
+            }
+
+            /* a connection, copied out of the buffer at once */
+            if (data && res > 0) ep->received(data, res);
+            if (data) ring->recycle(bid);
+            if (more) continue;
+
+            if (res > 0 || res == -ENOBUFS) {
+                if (!armRecv(ring, ep)) rearm(&rearms, ep);
+            } else {
+                ep->received(0, 0);
+            }
+        }
+
+        if (cnt) {
+            src->received(records, tags, creds, cnt);
+            for (size_t i = 0; i < cnt; ++i) ring->recycle(bids[i]);
+        }
+        ring->publish();
+
+        if (!polled) polled = armPoll(ring);
+        if (!rearms.empty() && !(ok = rearmAll(ring, &rearms))) break;
+
+        if (bell_) armed = bell_->pollRings(n == 0);
+        if (limiter_) limiter_->tick(outbuffer_, router_);
+        if (dedup_) dedup_->tick(outbuffer_);
+        outbuffer_->tick();
+    }
+    free(events);
+    return ok;
+}
+
+/* the arms of the last pass again, false if a source is out of time */
+template <typename OutputBuffer>
+bool LogReader<OutputBuffer>::rearmAll(Uring *ring, std::vector<Rearm> *rearms)
+{
+    typedef EventProcessor<OutputBuffer> Processor;
+
+    long now = nowMsec();
+    size_t left = 0;
+    for (size_t i = 0; i < rearms->size(); ++i) {
+        Rearm r = (*rearms)[i];
+        bool source = r.ep->type() != Processor::Normal;
+        if (source ? armSource(ring, r.ep) : armRecv(ring, r.ep)) continue;
+
+        if (now - r.since < rearmms) {
+            (*rearms)[left++] = r;
+        } else if (source) {
+            fprintf(stderr, "can't arm the source on io_uring for %d ms\n", rearmms);
+            return false;
+        } else {
+            r.ep->received(0, 0);
+        }
+    }
+    rearms->resize(left);
+    return true;
+}
+
+/* the source gets a multishot recvmsg into the buffers, for the
+ * credentials, or a multishot accept.
+ */
+template <typename OutputBuffer>
+bool LogReader<OutputBuffer>::armSource(Uring *ring, EventProcessor<OutputBuffer> *ep)
+{
+    struct io_uring_sqe *sqe = ring->sqe();
+    if (!sqe) return false;
+
+    if (ep->type() != EventProcessor<OutputBuffer>::Stream) {
+        sqe->opcode    = IORING_OP_RECVMSG;
+        sqe->fd        = ep->fd();
+        sqe->addr      = (uint64_t) (uintptr_t) &rmsg_;
+        sqe->len       = 1;
+        sqe->ioprio    = IORING_RECV_MULTISHOT;
+        sqe->flags     = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = Uring::bgid;
+        sqe->user_data = (uint64_t) (uintptr_t) ep;
+        return true;
+    }
+
+    sqe->opcode       = IORING_OP_ACCEPT;
+    sqe->fd           = ep->fd();
+    sqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data    = (uint64_t) (uintptr_t) ep;
+    return true;
+}
+
+template <typename OutputBuffer>
+bool LogReader<OutputBuffer>::armRecv(Uring *ring, EventProcessor<OutputBuffer> *ep)
+{
+    struct io_uring_sqe *sqe = ring->sqe();
+    if (!sqe) return false;
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = ep->fd();
+    sqe->ioprio    = IORING_RECV_MULTISHOT;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = Uring::bgid;
+    sqe->user_data = (uint64_t) (uintptr_t) ep;
+    return true;
+}
+
+/* a multishot recvmsg fills a buffer with [io_uring_recvmsg_out][the
+ * credentials, rmsg_.msg_controllen bytes][payload], res bytes of it.
+ */
+template <typename OutputBuffer>
+struct iovec LogReader<OutputBuffer>::recvmsgPayload(char *data, int res, struct ucred *cred)
+{
+    struct io_uring_recvmsg_out out;
+    memcpy(&out, data, sizeof(out));
+
+    struct msghdr msg;
+    memset(&msg, 0x00, sizeof(msg));
+    msg.msg_control    = data + sizeof(out);
+    msg.msg_controllen = out.controllen;
+
+    struct iovec iov;
+    iov.iov_base = data + nuhdr;
+    iov.iov_len  = out.payloadlen < res - nuhdr ? out.payloadlen : res - nuhdr;
+    *cred = credOf(&msg);
+    return iov;
+}
+
+/* one shot, it completes at once if epoll still has events */
+template <typename OutputBuffer>
+bool LogReader<OutputBuffer>::armPoll(Uring *ring)
+{
+    struct io_uring_sqe *sqe = ring->sqe();
+    if (!sqe) return false;
+    sqe->opcode        = IORING_OP_POLL_ADD;
+    sqe->fd            = efd_;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data     = 0;
+    return true;
+}
+
+template <typename OutputBuffer>
+int LogReader<OutputBuffer>::processEvents(struct epoll_event *events, int nevent, int timeout)
+{
+    int n = epoll_wait(efd_, events, nevent, timeout);
+    for (int i = 0; i < n; ++i) {
+        EventProcessor<OutputBuffer> *ep = (EventProcessor<OutputBuffer> *) events[i].data.ptr;
+        ep->process();
+    }
+    return n;
+}
+
+template <typename OutputBuffer>
+bool LogReader<OutputBuffer>::run()
+{
+    if (efd_ == -1 && !open()) return false;
+
+    /* the ring belongs to the thread that runs the reader */
+    if (uring_) {
+        try {
+            Uring ring(nsqe);
+            if (runUring(&ring)) return true;
+        } catch (int eno) {
+            fprintf(stderr, "io_uring_setup() error, %d:%s\n", eno, strerror(eno));
+        }
+        if (quit_) return true;
+
+        fprintf(stderr, "io_uring failed, use epoll\n");
+        uring_ = false;
+        if (!addSourceFd()) return false;
+    }
+
+    size_t nevent = 1024;
+    struct epoll_event *events =
+        (struct epoll_event *) calloc(nevent, sizeof(struct epoll_event));
+
+    bool armed = false;
     while (!quit_) {
-        int n = epoll_wait(efd_, events, nevent, 500);
+        stats_.waited();
+        int n = processEvents(events, nevent, (bell_ && !armed) ? 1 : 500);
 
         if (n == -1) {
             if (errno == EINTR) continue;
             else break;
         }
 
-        for (int i = 0; i < n; ++i) {
-            EventProcessor<OutputBuffer> *ep = (EventProcessor<OutputBuffer> *) events[i].data.ptr;
-            ep->process();
-        }
+        if (bell_) armed = bell_->pollRings(n == 0);
+        if (limiter_) limiter_->tick(outbuffer_, router_);
+        if (dedup_) dedup_->tick(outbuffer_);
+        outbuffer_->tick();
     }
+    free(events);
     return true;
 }
 
@@ -4,45 +4,253 @@
 #ifndef _LOGWRITER_H_
 #define _LOGWRITER_H_
 
+#include <cstddef>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <errno.h>
+#include <limits.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/epoll.h>
+#include <syslogmsg.h>
+#include <inetaddr.h>
+#include <uring.h>
+#include <stats.h>
 
+/* the destination socket is non-blocking and waited on with the
+ * writer's own epoll, only while it is full. records are released from
+ * the input buffer once the kernel took them, a stream send that stops
+ * in the middle of a record copies that record and the rest of the
+ * batch into pending_ and resumes at the exact byte, after a reconnect
+ * the record is sent again whole. a destination that takes nothing for
+ * timeout ms is taken as wedged, reconnects back off exponentially.
+ *
+ * dst may list backups after the primary, "primary,backup", a broken
+ * destination fails over to the next one at once, the backoff starts
+ * after the whole list failed. on a backup the primary is tried again
+ * every failbackms.
+ *
+ * tcp:// and udp:// destinations are forwarded to over the network, tcp
+ * frames with octet counting (RFC 6587) and keeps one connection. with a
+ * latency budget the socket is corked, the kernel coalesces the batches
+ * into full segments and the cork is pulled once the oldest unpushed
+ * byte is latency ms old or nothing more is queued, without one every
+ * batch goes out at once (TCP_NODELAY).
+ *
+ * file://path appends to a file, one line per record, a whole batch of
+ * records per writev() straight out of the input buffer. it rotates
+ * after rotateSize bytes or at every rotateSec boundary of the wall
+ * clock, to path.YYYYmmdd-HHMMSS. path always names a file, the new one
+ * replaces the old by rename(). reopen() closes and opens path again
+ * between batches, for logrotate. with syncms the data is fdatasync()ed
+ * at most syncms after it was written.
+ *
+ * with uring a dgram batch goes out as a chain of linked sends on an
+ * io_uring of the writer thread instead of sendmmsg(), epoll if the
+ * kernel has none.
+ */
 template <typename InputBuffer>
 class LogWriter {
 public:
-    LogWriter(const char *dst, InputBuffer *inbuffer, bool isStream = false);
+    LogWriter(const char *dst, InputBuffer *inbuffer, bool isStream = false,
+              size_t batch = 1, int latency = 0, Framing framing = FrameLF,
+              int timeout = 10000, size_t rotateSize = 0, int rotateSec = 0,
+              int syncms = 0, bool uring = false);
     ~LogWriter();
 
     bool run();
     bool stop();
+    void reopen();
+
+    void dumpStats(FILE *fp, const char *prefix = "writer") const;
 
 private:
+    enum Status { Done, Idle, Blocked, Broken };
+
     static int open(const char *addr, bool isStream); 
+    static int openInet(const char *addr, int timeout);
+    static const char *filePath(const char *addr);
+    static ssize_t sendv(int fd, struct iovec *iov, size_t niov, bool file = false);
+
+    bool connect();
+    void disconnect();
+    void failback();
+    void push();
+    int  openFile();
+    bool rotateDue();
+    void rotate();
+    void syncFile(bool force);
+    Status waitWritable();
+    Status sent(size_t nn);
+
+    void keepPending(const struct iovec *iov, size_t niov, size_t skip);
+    Status flushPending();
+
+    Status drain();
+    Status drainBatch();
+    Status drainStream();
+    size_t peekBatch();
+    size_t frameBatch(size_t n, size_t *bytes);
+
+    static const size_t niov = 64;
+    static const size_t nhdr = 12;           // "MSGLEN SP"
+    static const int    minBackoff = 100;    // ms
+    static const int    maxBackoff = 30000;
+    static const int    failbackms = 60000;
+    static const size_t maxDst = 4;
 
 private:
     bool         isStream_;
-    const char  *dst_;
+    char        *dsts_;              // the dst argument, split at ','
+    const char  *dst_[maxDst];
+    size_t       ndst_;
+    size_t       cur_;               // connected, or tried next
+    size_t       active_;            // the last one connected
+    long         failbackAt_;
+    bool         inet_[maxDst];
+    bool         tcp_;               // the current one is tcp://
+    bool         cork_;
+    long         corkedAt_;          // the first send since the last push
+    const char  *file_;              // the path of a file:// dst
+    volatile bool reopen_;
     InputBuffer *inbuffer_;
     int          fd_;
-    char         buffer_[InputBuffer::nbuffer];
+    int          epfd_;
+    struct iovec iov_[niov];
     bool         quit_;
+
+    /* reconnect and wedge detection, ms of the monotonic clock */
+    int          timeout_;
+    int          backoff_;
+    long         retryAt_;
+    long         blockedSince_;
+
+    /* whole records behind a partial stream send, npending_ bytes of
+     * which opending_ are already sent.
+     */
+    char        *pending_;
+    size_t       npending_;
+    size_t       cpending_;
+    size_t       opending_;
+
+    /* sendmmsg state for dgram destinations */
+    size_t          batch_;
+    int             latency_;
+    struct iovec   *biov_;
+    struct mmsghdr *msgs_;
+    bool            uring_;
+    Uring          *ring_;
+
+    /* stream destinations, biov_ records with their framing */
+    Framing         framing_;
+    struct iovec   *fiov_;
+    size_t         *flen_;
+    char           *hdrs_;
+
+    /* counters, written by the writer thread only */
+    uint64_t connects_;
+    uint64_t connectErrors_;
+    uint64_t sendErrors_;        // the connection was given up
+    uint64_t wedged_;            // given up after timeout_
+    uint64_t sendBytes_;
+    uint64_t blocked_;           // waits for the destination to drain
+    uint64_t oversizeMsgs_;      // EMSGSIZE, dropped
+    uint64_t oversizeBytes_;
+    uint64_t resentBytes_;       // of records cut by a reconnect, sent again
+    uint64_t failovers_;         // connected to another destination of dst
+
+    /* file destinations */
+    size_t   rotateSize_;
+    int      rotateSec_;
+    int      syncms_;
+    size_t   fileSize_;
+    time_t   rotateAt_;
+    long     syncedAt_;
+    bool     dirty_;             // written since the last fdatasync()
+    uint64_t rotations_;
+    uint64_t syncs_;
+    uint64_t reopens_;
 };
 
 template <typename InputBuffer>
-LogWriter<InputBuffer>::LogWriter(const char *dst, InputBuffer *inbuffer, bool isStream)
-    : isStream_(isStream), dst_(dst), inbuffer_(inbuffer), fd_(-1), quit_(false) { }
+LogWriter<InputBuffer>::LogWriter(const char *dst, InputBuffer *inbuffer, bool isStream,
+                                  size_t batch, int latency, Framing framing, int timeout,
+                                  size_t rotateSize, int rotateSec, int syncms, bool uring)
+    : isStream_(isStream), dsts_(strdup(dst)), ndst_(0), cur_(0), active_(0), failbackAt_(0),
+      tcp_(false), cork_(false), corkedAt_(0), file_(0), reopen_(false),
+      inbuffer_(inbuffer), fd_(-1), epfd_(-1), quit_(false),
+      timeout_(timeout), backoff_(0), retryAt_(0), blockedSince_(0),
+      pending_(0), npending_(0), cpending_(0), opending_(0),
+      batch_(batch), latency_(latency), biov_(0), msgs_(0), uring_(uring), ring_(0),
+      framing_(framing), fiov_(0), flen_(0), hdrs_(0),
+      connects_(0), connectErrors_(0), sendErrors_(0), wedged_(0), sendBytes_(0), blocked_(0),
+      oversizeMsgs_(0), oversizeBytes_(0), resentBytes_(0), failovers_(0),
+      rotateSize_(rotateSize), rotateSec_(rotateSec), syncms_(syncms), fileSize_(0),
+      rotateAt_(0), syncedAt_(0), dirty_(false), rotations_(0), syncs_(0), reopens_(0)
+{
+    if (!dsts_) throw errno;
+
+    char *save;
+    for (char *p = strtok_r(dsts_, ",", &save); p && ndst_ < maxDst; p = strtok_r(0, ",", &save)) {
+        dst_[ndst_++] = p;
+    }
+    if (ndst_ == 0) throw EINVAL;
+
+    /* a file takes the stream path with a large batch, it has no backups */
+    file_ = filePath(dst_[0]);
+    for (size_t i = 1; i < ndst_; ++i) {
+        if (file_ || filePath(dst_[i])) throw EINVAL;
+    }
+    if (file_) {
+        isStream = true;
+        batch_   = IOV_MAX / 3;
+    }
+
+    /* tcp:// and udp:// decide for themselves, the list may not mix */
+    for (size_t i = 0; i < ndst_; ++i) {
+        bool stream = isStream;
+        inet_[i] = inetAddr(dst_[i], &stream);
+        if (i == 0) isStream_ = stream;
+        else if (stream != isStream_) throw EINVAL;
+    }
+
+    if (isStream_) {
+        /* a record takes up to 3 iovecs in one sendmsg() */
+        if (batch_ > IOV_MAX / 3) batch_ = IOV_MAX / 3;
+        biov_ = new struct iovec[batch_ * 2];
+        fiov_ = new struct iovec[batch_ * 3];
+        flen_ = new size_t[batch_];
+        hdrs_ = new char[batch_ * nhdr];
+    } else if (batch_ > 1) {
+        biov_ = new struct iovec[batch_ * 2];
+        msgs_ = new struct mmsghdr[batch_];
+        memset(msgs_, 0x00, sizeof(struct mmsghdr) * batch_);
+    }
+}
 
 template <typename InputBuffer>
 LogWriter<InputBuffer>::~LogWriter() 
 {
     if (fd_ != -1) close(fd_);
+    if (epfd_ != -1) close(epfd_);
+    delete ring_;
+    free(dsts_);
+    free(pending_);
+    delete[] biov_;
+    delete[] msgs_;
+    delete[] fiov_;
+    delete[] flen_;
+    delete[] hdrs_;
 }
 
 template <typename InputBuffer>
@@ -50,7 +258,7 @@ int LogWriter<InputBuffer>::open(const char *dst, bool isStream)
 {
     int fd;
 
-    if ((fd = socket(AF_UNIX, isStream ? SOCK_STREAM : SOCK_DGRAM, 0)) < 0) {
+    if ((fd = socket(AF_UNIX, (isStream ? SOCK_STREAM : SOCK_DGRAM) | SOCK_NONBLOCK, 0)) < 0) {
         fprintf(stderr, "socket() error, %d:%s\n", errno, strerror(errno));
         return -1;
     }
@@ -79,7 +287,7 @@ int LogWriter<InputBuffer>::open(const char *dst, bool isStream)
     strcpy(un.sun_path, dst);
     len = offsetof(struct sockaddr_un, sun_path) + strlen(dst);
 
-    if (connect(fd, (struct sockaddr*)(&un), len) < 0) {
+    if (::connect(fd, (struct sockaddr*)(&un), len) < 0) {
         fprintf(stderr, "connect(%s) error, %d:%s\n", dst, errno, strerror(errno));
         close(fd);
         return -1;
@@ -88,29 +296,565 @@ int LogWriter<InputBuffer>::open(const char *dst, bool isStream)
     return fd;
 }
 
+/* the first address that connects, a tcp connect is waited for here
+ * at most timeout ms, nothing can be sent before it is done.
+ */
+template <typename InputBuffer>
+int LogWriter<InputBuffer>::openInet(const char *dst, int timeout)
+{
+    struct addrinfo *res = resolveInet(dst, false);
+    if (!res) return -1;
+
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai && fd == -1; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK, ai->ai_protocol);
+        if (fd == -1) continue;
+
+        int rc = ::connect(fd, ai->ai_addr, ai->ai_addrlen);
+        if (rc != 0 && errno == EINPROGRESS) {
+            struct pollfd pfd;
+            pfd.fd     = fd;
+            pfd.events = POLLOUT;
+
+            int err = ETIMEDOUT;
+            socklen_t len = sizeof(err);
+            if (poll(&pfd, 1, timeout) == 1) getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            errno = err;
+            rc = err ? -1 : 0;
+        }
+
+        if (rc != 0) {
+            fprintf(stderr, "connect(%s) error, %d:%s\n", dst, errno, strerror(errno));
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    freeaddrinfo(res);
+    return fd;
+}
+
+template <typename InputBuffer>
+const char *LogWriter<InputBuffer>::filePath(const char *dst)
+{
+    return strncmp(dst, "file://", 7) == 0 ? dst + 7 : 0;
+}
+
+/* appends only, the size is where rotation counts from */
+template <typename InputBuffer>
+int LogWriter<InputBuffer>::openFile()
+{
+    int fd = ::open(file_, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "open(%s) error, %d:%s\n", file_, errno, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    fileSize_ = (fstat(fd, &st) == 0) ? st.st_size : 0;
+    if (rotateSec_ > 0) rotateAt_ = (time(0) / rotateSec_ + 1) * rotateSec_;
+    return fd;
+}
+
+/* an empty file is never rotated */
+template <typename InputBuffer>
+bool LogWriter<InputBuffer>::rotateDue()
+{
+    if (fileSize_ == 0) return false;
+    return (rotateSize_ > 0 && fileSize_ >= rotateSize_) ||
+        (rotateSec_ > 0 && time(0) >= rotateAt_);
+}
+
+/* the old file gets its dated name by link(), the new one takes path
+ * by rename(), path is never missing. a rotation that fails is tried
+ * again after another rotateSize_ bytes or rotateSec_.
+ */
+template <typename InputBuffer>
+void LogWriter<InputBuffer>::rotate()
+{
+    time_t now = time(0);
+    struct tm tm;
+    char stamp[32];
+    localtime_r(&now, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+
+    char name[PATH_MAX], tmp[PATH_MAX];
+    snprintf(name, sizeof(name), "%s.%s", file_, stamp);
+    for (int i = 1; access(name, F_OK) == 0 && i < 100; ++i) {
+        snprintf(name, sizeof(name), "%s.%s.%d", file_, stamp, i);
+    }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", file_);
+
+    fileSize_ = 0;
+    if (rotateSec_ > 0) rotateAt_ = (now / rotateSec_ + 1) * rotateSec_;
+
+    syncFile(true);
+
+    int fd = ::open(tmp, O_WRONLY | O_APPEND | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 || link(file_, name) != 0) {
+        fprintf(stderr, "rotate(%s) error, %d:%s\n", file_, errno, strerror(errno));
+        if (fd != -1) close(fd);
+        unlink(tmp);
+        return;
+    }
+    if (rename(tmp, file_) != 0) {
+        fprintf(stderr, "rename(%s) error, %d:%s\n", tmp, errno, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        unlink(name);
+        return;
+    }
+
+    close(fd_);
+    fd_ = fd;
+    statAdd(&rotations_);
+}
+
+/* force syncs what is dirty at once, else syncms_ after the last one */
+template <typename InputBuffer>
+void LogWriter<InputBuffer>::syncFile(bool force)
+{
+    if (syncms_ <= 0 || !dirty_) return;
+
+    long now = nowMsec();
+    if (!force && now - syncedAt_ < syncms_) return;
+
+    if (fdatasync(fd_) != 0) {
+        fprintf(stderr, "fdatasync(%s) error, %d:%s\n", file_, errno, strerror(errno));
+    }
+    statAdd(&syncs_);
+    syncedAt_ = now;
+    dirty_    = false;
+}
+
+template <typename InputBuffer>
+ssize_t LogWriter<InputBuffer>::sendv(int fd, struct iovec *iov, size_t niov, bool file)
+{
+    ssize_t nn;
+    if (file) {
+        while ((nn = writev(fd, iov, niov)) == -1 && errno == EINTR) {
+        }
+        return nn;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0x00, sizeof(msg));
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = niov;
+
+    while ((nn = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT)) == -1 && errno == EINTR) {
+    }
+    return nn;
+}
+
+/* waits out the backoff first, the wait ends early on stop() */
+template <typename InputBuffer>
+bool LogWriter<InputBuffer>::connect()
+{
+    long now = nowMsec();
+    if (now < retryAt_) {
+        struct epoll_event event;
+        long left = retryAt_ - now;
+        epoll_wait(epfd_, &event, 1, left < 500 ? left : 500);
+        return false;
+    }
+
+    int fd = file_ ? openFile() :
+        inet_[cur_] ? openInet(dst_[cur_], timeout_) : open(dst_[cur_], isStream_);
+    if (fd == -1) {
+        statAdd(&connectErrors_);
+        cur_ = (cur_ + 1) % ndst_;
+        if (cur_ != 0) return false;
+
+        backoff_ = backoff_ ? (backoff_ * 2 < maxBackoff ? backoff_ * 2 : maxBackoff) : minBackoff;
+        retryAt_ = nowMsec() + backoff_;
+        return false;
+    }
+
+    /* a regular file is always writable, epoll refuses it */
+    struct epoll_event event;
+    event.events  = EPOLLOUT;
+    event.data.fd = fd;
+    if (!file_ && epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &event) != 0) {
+        fprintf(stderr, "epoll_ctl() error, %d:%s\n", errno, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    tcp_  = inet_[cur_] && isStream_;
+    cork_ = tcp_ && latency_ > 0;
+    corkedAt_ = 0;
+    if (tcp_) {
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+        setsockopt(fd, IPPROTO_TCP, cork_ ? TCP_CORK : TCP_NODELAY, &on, sizeof(on));
+    }
+
+    fd_ = fd;
+    blockedSince_ = 0;
+    statAdd(&connects_);
+
+    if (cur_ != active_) {
+        fprintf(stderr, "writing to %s\n", dst_[cur_]);
+        statAdd(&failovers_);
+        __atomic_store_n(&active_, cur_, __ATOMIC_RELAXED);
+    }
+    if (cur_ != 0) failbackAt_ = nowMsec() + failbackms;
+
+    /* the receiver saw a piece of the first pending record at most,
+     * a file keeps it, the rest is appended.
+     */
+    if (!file_) {
+        statAdd(&resentBytes_, opending_);
+        opending_ = 0;
+    }
+    return true;
+}
+
+/* pull the cork so the kernel sends what it holds, and put it back */
+template <typename InputBuffer>
+void LogWriter<InputBuffer>::push()
+{
+    int off = 0, on = 1;
+    setsockopt(fd_, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+    setsockopt(fd_, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    corkedAt_ = 0;
+}
+
+/* the backoff is reset by the first send that goes through */
+template <typename InputBuffer>
+void LogWriter<InputBuffer>::disconnect()
+{
+    if (file_) syncFile(true);
+    close(fd_);
+    fd_ = -1;
+    corkedAt_ = 0;
+
+    cur_ = (cur_ + 1) % ndst_;
+    if (cur_ != 0) return;
+
+    if (backoff_ == 0) backoff_ = minBackoff;
+    retryAt_ = nowMsec() + backoff_;
+}
+
+/* leave the backup between records, connect() tries the primary
+ * and comes back to the backup at once if it is still down.
+ */
+template <typename InputBuffer>
+void LogWriter<InputBuffer>::failback()
+{
+    close(fd_);
+    fd_  = -1;
+    cur_ = 0;
+    corkedAt_ = 0;
+}
+
+template <typename InputBuffer>
+typename LogWriter<InputBuffer>::Status LogWriter<InputBuffer>::sent(size_t nn)
+{
+    statAdd(&sendBytes_, nn);
+    if (file_) {
+        fileSize_ += nn;
+        dirty_     = true;
+        syncFile(false);
+    }
+    backoff_      = 0;
+    blockedSince_ = 0;
+    if (cork_ && corkedAt_ == 0) corkedAt_ = nowMsec();
+    return Done;
+}
+
+template <typename InputBuffer>
+typename LogWriter<InputBuffer>::Status LogWriter<InputBuffer>::waitWritable()
+{
+    long now = nowMsec();
+    if (blockedSince_ == 0) blockedSince_ = now;
+    statAdd(&blocked_);
+
+    long left = blockedSince_ + timeout_ - now;
+    if (left <= 0) {
+        fprintf(stderr, "%s took nothing for %d ms, reconnect\n", dst_[cur_], timeout_);
+        statAdd(&wedged_);
+        return Broken;
+    }
+
+    struct epoll_event event;
+    int n = epoll_wait(epfd_, &event, 1, left < 500 ? left : 500);
+    if (n == 1 && (event.events & (EPOLLERR | EPOLLHUP))) {
+        statAdd(&sendErrors_);
+        return Broken;
+    }
+    return Done;
+}
+
+template <typename InputBuffer>
+void LogWriter<InputBuffer>::keepPending(const struct iovec *iov, size_t niov, size_t skip)
+{
+    npending_ = 0;
+    for (size_t i = 0; i < niov; ++i) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+
+        size_t n = iov[i].iov_len - skip;
+        if (npending_ + n > cpending_) {
+            cpending_ = npending_ + n;
+            pending_  = (char *) realloc(pending_, cpending_);
+            if (!pending_) throw errno;
+        }
+        memcpy(pending_ + npending_, (char *) iov[i].iov_base + skip, n);
+        npending_ += n;
+        skip = 0;
+    }
+}
+
+template <typename InputBuffer>
+typename LogWriter<InputBuffer>::Status LogWriter<InputBuffer>::flushPending()
+{
+    ssize_t nn = file_ ? write(fd_, pending_ + opending_, npending_ - opending_) :
+        send(fd_, pending_ + opending_, npending_ - opending_, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (nn > 0) {
+        opending_ += nn;
+        if (opending_ == npending_) npending_ = opending_ = 0;
+        return sent(nn);
+    } else if (nn == -1 && errno == EINTR) {
+        return Done;
+    } else if (nn == -1 && errno == EAGAIN) {
+        return Blocked;
+    }
+    statAdd(&sendErrors_);
+    return Broken;
+}
+
+/* one record per datagram, out of the input buffer. peekRecords()
+ * keeps records apart where peek() may not, a udp:// dest behind a
+ * stream source reads a ring without readBorder.
+ */
+template <typename InputBuffer>
+typename LogWriter<InputBuffer>::Status LogWriter<InputBuffer>::drain()
+{
+    if (inbuffer_->peekRecords(iov_, 1, InputBuffer::nbuffer) == 0) return Idle;
+    size_t n = iov_[0].iov_len + iov_[1].iov_len;
+
+    ssize_t nn = sendv(fd_, iov_, iov_[1].iov_len ? 2 : 1);
+    if (nn >= 0) {
+        inbuffer_->commit(1);
+        return sent(nn);
+    } else if (errno == EAGAIN) {
+        inbuffer_->rollback();
+        return Blocked;
+    } else if (errno == EMSGSIZE) {
+        fprintf(stderr, "send() error, drop %lu bytes, %d:%s\n",
+                (unsigned long) n, errno, strerror(errno));
+        inbuffer_->commit(1);
+        statAdd(&oversizeMsgs_);
+        statAdd(&oversizeBytes_, n);
+        return Done;
+    }
+    inbuffer_->rollback();
+    statAdd(&sendErrors_);
+    return Broken;
+}
+
+/* claim up to batch_ records, if fewer are queued wait at most
+ * latency_ ms for the batch to fill, without holding the claim.
+ */
+template <typename InputBuffer>
+size_t LogWriter<InputBuffer>::peekBatch()
+{
+    size_t limit = batch_ * InputBuffer::nbuffer;
+    size_t n = inbuffer_->peekRecords(biov_, batch_, limit);
+    if (n == 0 || n == batch_ || latency_ <= 0 || cork_) return n;
+
+    long start = nowMsec();
+    while (n < batch_ && !quit_) {
+        int left = latency_ - (nowMsec() - start);
+        if (left <= 0) break;
+
+        inbuffer_->rollback();
+        bool more = inbuffer_->waitMore(left);
+        n = inbuffer_->peekRecords(biov_, batch_, limit);
+        if (!more) break;
+    }
+    return n;
+}
+
+/* dgram destinations, one sendmmsg() per batch keeps every record
+ * a datagram of its own, a short count commits just the sent ones.
+ */
+template <typename InputBuffer>
+typename LogWriter<InputBuffer>::Status LogWriter<InputBuffer>::drainBatch()
+{
+    size_t n = peekBatch();
+    if (n == 0) return Idle;
+
+    for (size_t i = 0; i < n; ++i) {
+        msgs_[i].msg_hdr.msg_iov    = biov_ + 2 * i;
+        msgs_[i].msg_hdr.msg_iovlen = biov_[2 * i + 1].iov_len ? 2 : 1;
+    }
+
+    int nn;
+    if (ring_) {
+        nn = ring_->sendmmsg(fd_, msgs_, n, MSG_NOSIGNAL | MSG_DONTWAIT);
+    } else {
+        while ((nn = sendmmsg(fd_, msgs_, n, MSG_NOSIGNAL | MSG_DONTWAIT)) == -1 && errno == EINTR) {
+        }
+    }
+
+    if (nn > 0) {
+        inbuffer_->commit(nn);
+
+        size_t bytes = 0;
+        for (int i = 0; i < nn; ++i) bytes += biov_[2 * i].iov_len + biov_[2 * i + 1].iov_len;
+        return sent(bytes);
+    } else if (errno == EAGAIN) {
+        inbuffer_->rollback();
+        return Blocked;
+    } else if (errno == EMSGSIZE) {
+        fprintf(stderr, "sendmmsg() error, drop a record, %d:%s\n", errno, strerror(errno));
+        statAdd(&oversizeMsgs_);
+        statAdd(&oversizeBytes_, biov_[0].iov_len + biov_[1].iov_len);
+        inbuffer_->commit(1);
+        return Done;
+    }
+    inbuffer_->rollback();
+    statAdd(&sendErrors_);
+    return Broken;
+}
+
+/* records are stored without framing, each gets its LF trailer or its
+ * octet count header here, flen_ keeps the framed length of each. in a
+ * file a record that ends with a LF already gets no other.
+ */
+template <typename InputBuffer>
+size_t LogWriter<InputBuffer>::frameBatch(size_t n, size_t *bytes)
+{
+    static const char lf = '\n';
+
+    Framing framing = tcp_ ? FrameOctet : (file_ ? FrameLF : framing_);
+
+    size_t cnt = 0;
+    *bytes = 0;
+    for (size_t i = 0; i < n; ++i) {
+        size_t len = biov_[2 * i].iov_len + biov_[2 * i + 1].iov_len;
+        flen_[i] = len;
+
+        if (framing == FrameOctet) {
+            char *hdr = hdrs_ + i * nhdr;
+            fiov_[cnt].iov_base = hdr;
+            fiov_[cnt].iov_len  = snprintf(hdr, nhdr, "%lu ", (unsigned long) len);
+            flen_[i] += fiov_[cnt].iov_len;
+            ++cnt;
+        }
+
+        fiov_[cnt++] = biov_[2 * i];
+        if (biov_[2 * i + 1].iov_len) fiov_[cnt++] = biov_[2 * i + 1];
+
+        const struct iovec *last = biov_[2 * i + 1].iov_len ? &biov_[2 * i + 1] : &biov_[2 * i];
+        bool hasLF = last->iov_len && ((const char *) last->iov_base)[last->iov_len - 1] == '\n';
+
+        if (framing == FrameLF && !(file_ && hasLF)) {
+            fiov_[cnt].iov_base = (void *) &lf;
+            fiov_[cnt].iov_len  = 1;
+            flen_[i] += 1;
+            ++cnt;
+        }
+        *bytes += flen_[i];
+    }
+    return cnt;
+}
+
+/* stream and file destinations, a batch of framed records per sendmsg()
+ * or writev(), the
+ * claim is released after a partial send, the cut record and the ones
+ * behind it go to pending_.
+ */
+template <typename InputBuffer>
+typename LogWriter<InputBuffer>::Status LogWriter<InputBuffer>::drainStream()
+{
+    size_t n = peekBatch();
+    if (n == 0) return Idle;
+
+    size_t bytes;
+    size_t cnt = frameBatch(n, &bytes);
+
+    ssize_t nn = sendv(fd_, fiov_, cnt, file_);
+    if (nn >= 0 && (size_t) nn < bytes) {
+        size_t start = 0;
+        for (size_t i = 0; i < n && start + flen_[i] <= (size_t) nn; ++i) start += flen_[i];
+
+        keepPending(fiov_, cnt, start);
+        opending_ = nn - start;
+    }
+
+    if (nn >= 0) {
+        inbuffer_->commit();
+        return sent(nn);
+    } else if (errno == EAGAIN) {
+        inbuffer_->rollback();
+        return Blocked;
+    }
+    inbuffer_->rollback();
+    statAdd(&sendErrors_);
+    return Broken;
+}
+
 template <typename InputBuffer>
 bool LogWriter<InputBuffer>::run()
 {
+    epfd_ = epoll_create(1);
+    if (epfd_ == -1) {
+        fprintf(stderr, "epoll_create() error, %d:%s\n", errno, strerror(errno));
+        return false;
+    }
+
+    /* on the writer thread, it owns the ring */
+    if (uring_ && msgs_) {
+        try {
+            ring_ = new Uring(batch_);
+        } catch (int eno) {
+            fprintf(stderr, "io_uring_setup() error, %d:%s, use sendmmsg()\n", eno, strerror(eno));
+        }
+    }
+
     while (!quit_) {
-        int fd = open(dst_, isStream_);
-        if (fd == -1) {
-            sleep(1);
+        if (fd_ == -1 && !connect()) continue;
+        if (cur_ != 0 && npending_ == 0 && nowMsec() >= failbackAt_) {
+            failback();
             continue;
         }
-
-        while (!quit_) {
-            size_t n = inbuffer_->read(buffer_, InputBuffer::nbuffer);
-            size_t pos = 0;
-            ssize_t nn = 0;
-            while((nn = send(fd, buffer_ + pos, n - pos, MSG_NOSIGNAL)) > 0) {
-                pos += nn;
+        if (file_ && npending_ == 0) {
+            if (reopen_) {
+                reopen_ = false;
+                syncFile(true);
+                close(fd_);
+                fd_ = -1;
+                statAdd(&reopens_);
+                continue;
             }
-            if (nn == -1 && errno != EAGAIN) break;
+            if (rotateDue()) rotate();
         }
 
-        close(fd);
+        Status status;
+        if (npending_) {
+            status = flushPending();
+        } else if (!inbuffer_->ready(corkedAt_ ? 0 : 500)) {
+            if (corkedAt_) push();
+            if (file_) syncFile(false);
+            status = Idle;
+        } else if (isStream_) {
+            status = drainStream();
+        } else {
+            status = (batch_ > 1) ? drainBatch() : drain();
+        }
+
+        if (status == Blocked) status = waitWritable();
+        if (status == Broken) disconnect();
+        else if (corkedAt_ && nowMsec() - corkedAt_ >= latency_) push();
     }
 
+    if (fd_ != -1) disconnect();
     return true;
 }
 
@@ -121,4 +865,36 @@ bool LogWriter<InputBuffer>::stop()
     return true;
 }
 
+/* from a signal handler, run() picks it up between batches */
+template <typename InputBuffer>
+void LogWriter<InputBuffer>::reopen()
+{
+    reopen_ = true;
+}
+
+template <typename InputBuffer>
+void LogWriter<InputBuffer>::dumpStats(FILE *fp, const char *prefix) const
+{
+    uint64_t connects = statGet(&connects_);
+
+    statPrint(fp, prefix, "connects", connects);
+    statPrint(fp, prefix, "reconnects", connects ? connects - 1 : 0);
+    statPrint(fp, prefix, "connect_errors", statGet(&connectErrors_));
+    statPrint(fp, prefix, "send_errors", statGet(&sendErrors_));
+    statPrint(fp, prefix, "wedged", statGet(&wedged_));
+    statPrint(fp, prefix, "send_bytes", statGet(&sendBytes_));
+    statPrint(fp, prefix, "blocked", statGet(&blocked_));
+    statPrint(fp, prefix, "pending_bytes", npending_ - opending_);
+    statPrint(fp, prefix, "resent_bytes", statGet(&resentBytes_));
+    statPrint(fp, prefix, "drop_oversize_msgs", statGet(&oversizeMsgs_));
+    statPrint(fp, prefix, "drop_oversize_bytes", statGet(&oversizeBytes_));
+    statPrint(fp, prefix, "failovers", statGet(&failovers_));
+    statPrint(fp, prefix, "active_dest", __atomic_load_n(&active_, __ATOMIC_RELAXED));
+    if (file_) {
+        statPrint(fp, prefix, "rotations", statGet(&rotations_));
+        statPrint(fp, prefix, "syncs", statGet(&syncs_));
+        statPrint(fp, prefix, "reopens", statGet(&reopens_));
+    }
+}
+
 #endif
@@ -0,0 +1,148 @@
+/* vim:expandtab:shiftwidth=4:tabstop=4:smarttab:
+ */
+
+#include <cstring>
+#include <lz.h>
+
+static const int    hashBits     = 13;
+static const size_t lastLiterals = 5;     // no match starts this close to the end
+
+static inline uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash4(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - hashBits);
+}
+
+/* the length bytes after a token nibble of 15 */
+static unsigned char *putLength(unsigned char *op, size_t len)
+{
+    for (len -= 15; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (unsigned char) len;
+    return op;
+}
+
+static bool getLength(const unsigned char **ip, const unsigned char *end, size_t *len)
+{
+    unsigned char b;
+    do {
+        if (*ip == end) return false;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+/* nmatch 0 is the last sequence, literals only */
+static unsigned char *putSequence(unsigned char *op, const unsigned char *lit, size_t nlit,
+                                  size_t offset, size_t nmatch)
+{
+    unsigned char *token = op++;
+    *token = (unsigned char) ((nlit < 15 ? nlit : 15) << 4);
+    if (nlit >= 15) op = putLength(op, nlit);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (nmatch == 0) return op;
+
+    *op++ = (unsigned char) (offset & 0xff);
+    *op++ = (unsigned char) (offset >> 8);
+
+    nmatch -= lzMinMatch;
+    *token |= (unsigned char) (nmatch < 15 ? nmatch : 15);
+    if (nmatch >= 15) op = putLength(op, nmatch);
+    return op;
+}
+
+/* greedy, the last position of every 4 byte hash is the only candidate.
+ * a long run without matches (packed or random data) probes further
+ * apart, so such a chunk costs less than one of text.
+ */
+size_t lzCompress(const char *src, size_t n, char *dst)
+{
+    const unsigned char *in  = (const unsigned char *) src;
+    const unsigned char *end = in + n;
+    unsigned char       *op  = (unsigned char *) dst;
+
+    uint32_t table[1 << hashBits];
+    memset(table, 0x00, sizeof(table));
+
+    const unsigned char *anchor = in, *ip = in;
+    const unsigned char *limit  = n > lastLiterals ? end - lastLiterals : in;
+    size_t miss = 0;
+
+    while (ip < limit) {
+        uint32_t h = hash4(read32(ip));
+        const unsigned char *ref = in + table[h];
+        table[h] = (uint32_t) (ip - in);
+
+        if (ref >= ip || (size_t) (ip - ref) > lzMaxOffset || read32(ref) != read32(ip)) {
+            ip += 1 + (miss++ >> 6);
+            continue;
+        }
+        miss = 0;
+
+        while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+            --ip;
+            --ref;
+        }
+        const unsigned char *mp = ip + lzMinMatch, *mr = ref + lzMinMatch;
+        while (mp < end && *mp == *mr) {
+            ++mp;
+            ++mr;
+        }
+
+        op = putSequence(op, anchor, ip - anchor, ip - ref, mp - ip);
+        ip = anchor = mp;
+    }
+
+    op = putSequence(op, anchor, end - anchor, 0, 0);
+    return op - (unsigned char *) dst;
+}
+
+/* every length and offset is checked, a corrupted chunk fails, it
+ * never writes out of dst.
+ */
+bool lzDecompress(const char *src, size_t n, char *dst, size_t size)
+{
+    const unsigned char *ip   = (const unsigned char *) src;
+    const unsigned char *end  = ip + n;
+    unsigned char       *op   = (unsigned char *) dst;
+    unsigned char       *oend = op + size;
+
+    while (ip < end) {
+        unsigned token = *ip++;
+
+        size_t nlit = token >> 4;
+        if (nlit == 15 && !getLength(&ip, end, &nlit)) return false;
+        if ((size_t) (end - ip) < nlit || (size_t) (oend - op) < nlit) return false;
+        memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+        if (ip == end) break;
+
+        if (end - ip < 2) return false;
+        size_t offset = ip[0] | (size_t) ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t) (op - (unsigned char *) dst)) return false;
+
+        size_t nmatch = token & 15;
+        if (nmatch == 15 && !getLength(&ip, end, &nmatch)) return false;
+        nmatch += lzMinMatch;
+        if ((size_t) (oend - op) < nmatch) return false;
+
+        /* an offset shorter than the match repeats what it copies */
+        const unsigned char *ref = op - offset;
+        if (offset >= nmatch) {
+            memcpy(op, ref, nmatch);
+            op += nmatch;
+        } else {
+            for (size_t i = 0; i < nmatch; ++i) *op++ = *ref++;
+        }
+    }
+    return op == oend;
+}
@@ -0,0 +1,35 @@
+/* vim:expandtab:shiftwidth=4:tabstop=4:smarttab:
+ */
+
+#ifndef _LZ_H_
+#define _LZ_H_
+
+#include <cstddef>
+#include <stdint.h>
+
+/* a byte oriented LZ77 in the manner of LZ4, for chunks of ring records.
+ * a chunk is a run of sequences [token][literals][offset][match], the
+ * token holds 4 bits of each length, 15 means more length bytes follow,
+ * each adds up to 255. offsets are 2 bytes little endian, a match is at
+ * least minMatch bytes, the last sequence has literals only.
+ *
+ * one hash probe per position and no entropy coding, syslog text is
+ * mostly repeated tags, hostnames and timestamps, that is enough for
+ * several times and costs little more than a memcpy.
+ */
+static const size_t lzMinMatch  = 4;
+static const size_t lzMaxOffset = 65535;
+
+/* the most lzCompress() writes for n bytes */
+inline size_t lzBound(size_t n)
+{
+    return n + n / 255 + 16;
+}
+
+/* dst holds lzBound(n) bytes, returns the bytes written */
+size_t lzCompress(const char *src, size_t n, char *dst);
+
+/* true if src is a whole chunk of exactly size bytes */
+bool lzDecompress(const char *src, size_t n, char *dst, size_t size);
+
+#endif
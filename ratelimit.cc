@@ -0,0 +1,138 @@
+/* vim:expandtab:shiftwidth=4:tabstop=4:smarttab:
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <time.h>
+#include <ratelimit.h>
+
+RateLimiter::RateLimiter(Key key, uint32_t rate, uint32_t burst, int reportms)
+    : key_(key), rate_(rate), burst_((uint64_t) burst * 1000), buckets_(0), now_(nowMsec()),
+      reportms_(reportms), nextReport_(now_ + reportms), lastReport_(now_), nreport_(0),
+      others_(0), passMsgs_(0), suppressMsgs_(0)
+{
+    void *ptr;
+    if (posix_memalign(&ptr, sizeof(Bucket), nbucket * sizeof(Bucket)) != 0) throw ENOMEM;
+    buckets_ = (Bucket *) ptr;
+    memset(buckets_, 0x00, nbucket * sizeof(Bucket));
+}
+
+RateLimiter::~RateLimiter()
+{
+    free(buckets_);
+}
+
+/* the bucket of key, a fresh one is full and has no name yet */
+RateLimiter::Bucket *RateLimiter::find(uint64_t key, bool *fresh)
+{
+    size_t i = (key * 0x9e3779b97f4a7c15ULL) >> (64 - bucketBits);
+
+    Bucket *victim = 0;
+    for (size_t k = 0; k < maxProbe; ++k) {
+        Bucket *b = &buckets_[(i + k) & (nbucket - 1)];
+        if (b->key == key) {
+            *fresh = false;
+            return b;
+        }
+        if (b->key == 0) {
+            victim = b;
+            break;
+        }
+        if (!victim || b->stamp < victim->stamp) victim = b;
+    }
+
+    others_ += victim->suppressed;
+    victim->key        = key;
+    victim->tokens     = burst_;
+    victim->stamp      = now_;
+    victim->suppressed = 0;
+    *fresh = true;
+    return victim;
+}
+
+bool RateLimiter::allow(const char *msg, size_t n, pid_t pid, uid_t uid)
+{
+    uint64_t key;
+    const char *tag = 0;
+    size_t ntag = 0;
+
+    if (key_ == ByTag) {
+        tag = parseTag(msg, n, &ntag);
+        key = 0xcbf29ce484222325ULL;             // FNV-1a
+        for (size_t i = 0; i < ntag; ++i) key = (key ^ (unsigned char) tag[i]) * 0x100000001b3ULL;
+        key |= 1;
+    } else if (pid <= 0) {
+        key = 1ULL << 32;
+    } else {
+        key = (2ULL << 32) | (uint32_t) (key_ == ByPid ? (uint32_t) pid : (uint32_t) uid);
+    }
+
+    bool fresh;
+    Bucket *b = find(key, &fresh);
+    if (fresh) {
+        if (key_ == ByTag) snprintf(b->name, sizeof(b->name), "tag %.*s", (int) ntag, tag);
+        else if (pid <= 0) snprintf(b->name, sizeof(b->name), "unknown senders");
+        else if (key_ == ByPid) snprintf(b->name, sizeof(b->name), "pid %d", (int) pid);
+        else snprintf(b->name, sizeof(b->name), "uid %d", (int) uid);
+    }
+
+    if (now_ > b->stamp) {
+        b->tokens += (uint64_t) (now_ - b->stamp) * rate_;
+        if (b->tokens > burst_) b->tokens = burst_;
+        b->stamp = now_;
+    }
+
+    if (b->tokens >= 1000) {
+        b->tokens -= 1000;
+        statAdd(&passMsgs_);
+        return true;
+    }
+    ++b->suppressed;
+    statAdd(&suppressMsgs_);
+    return false;
+}
+
+/* the next record of the report, 0 when it is complete. the bucket
+ * that suppressed most goes first, after maxReports of them the rest
+ * is one record.
+ */
+size_t RateLimiter::report(char *buffer, size_t n)
+{
+    Bucket *top = 0;
+    uint64_t rest = others_;
+    for (size_t i = 0; i < nbucket; ++i) {
+        Bucket *b = &buckets_[i];
+        if (!b->suppressed) continue;
+        if (!top || b->suppressed > top->suppressed) top = b;
+        rest += b->suppressed;
+    }
+    if (rest == 0) return 0;
+
+    time_t t = time(0);
+    struct tm tm;
+    localtime_r(&t, &tm);
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%b %e %H:%M:%S", &tm);
+
+    long ms = nowMsec() - lastReport_;
+    int nn;
+    if (top && nreport_ < maxReports) {
+        nn = snprintf(buffer, n, "<%d>%s syslog-safer: suppressed %u messages of %s in %ld ms",
+                      5 << 3 | 4, stamp, top->suppressed, top->name, ms);
+        top->suppressed = 0;
+        ++nreport_;
+    } else {
+        nn = snprintf(buffer, n, "<%d>%s syslog-safer: suppressed %llu messages of others in %ld ms",
+                      5 << 3 | 4, stamp, (unsigned long long) rest, ms);
+        for (size_t i = 0; i < nbucket; ++i) buckets_[i].suppressed = 0;
+        others_ = 0;
+    }
+    return (size_t) nn < n ? nn : n - 1;
+}
+
+void RateLimiter::dumpStats(FILE *fp, const char *prefix) const
+{
+    statPrint(fp, prefix, "limit_pass_msgs", statGet(&passMsgs_));
+    statPrint(fp, prefix, "limit_suppress_msgs", statGet(&suppressMsgs_));
+}
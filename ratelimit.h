@@ -0,0 +1,102 @@
+/* vim:expandtab:shiftwidth=4:tabstop=4:smarttab:
+ */
+
+#ifndef _RATELIMIT_H_
+#define _RATELIMIT_H_
+
+#include <cstdio>
+#include <stdint.h>
+#include <sys/types.h>
+#include <stats.h>
+#include <syslogmsg.h>
+#include <router.h>
+
+/* token buckets of one reader thread, keyed by the pid or uid of the
+ * sender or by the TAG of the message. a bucket holds up to burst
+ * messages and gains rate per second, a message that finds it empty
+ * is suppressed. tokens are kept in thousandths of a message.
+ *
+ * the buckets are a fixed open addressing table, one cache line each,
+ * linear probing over at most maxProbe of them. a key that finds no
+ * room there takes the bucket idle the longest, what that one had
+ * suppressed is reported as others.
+ *
+ * every reportms the suppressed counts go out as syslog.warning
+ * records, the busiest maxReports keys by name and the rest summed.
+ */
+class RateLimiter {
+public:
+    enum Key { ByPid, ByUid, ByTag };
+
+    RateLimiter(Key key, uint32_t rate, uint32_t burst, int reportms);
+    ~RateLimiter();
+
+    /* the clock of allow(), once per batch */
+    void clock() { now_ = nowMsec(); }
+
+    /* whether one more message of this sender may pass, pid 0 is
+     * a sender without credentials.
+     */
+    bool allow(const char *msg, size_t n, pid_t pid, uid_t uid);
+
+    /* passed and suppressed so far */
+    void dumpStats(FILE *fp, const char *prefix) const;
+
+    /* every reportms, the reports into outbuffer, by the -x rules if
+     * there is a router, as any message.
+     */
+    template <typename OutputBuffer>
+    void tick(OutputBuffer *outbuffer, const Router *router = 0);
+
+    static const int    bucketBits = 12;
+    static const size_t nbucket    = 1 << bucketBits;
+    static const size_t maxProbe   = 8;
+    static const size_t maxReports = 32;
+
+private:
+    struct Bucket {
+        uint64_t key;            // 0 is a free bucket
+        uint64_t tokens;         // thousandths of a message
+        long     stamp;          // nowMsec() of the last refill
+        uint32_t suppressed;     // since the last report
+        char     name[36];
+    };
+
+    Bucket *find(uint64_t key, bool *fresh);
+    size_t report(char *buffer, size_t n);
+
+private:
+    Key      key_;
+    uint64_t rate_;              // thousandths of a message per ms, that is per second
+    uint64_t burst_;             // thousandths
+    Bucket  *buckets_;
+    long     now_;
+
+    int      reportms_;
+    long     nextReport_;
+    long     lastReport_;
+    size_t   nreport_;           // records of this report so far
+    uint64_t others_;            // suppressed by evicted buckets, unreported
+
+    uint64_t passMsgs_;
+    uint64_t suppressMsgs_;
+};
+
+template <typename OutputBuffer>
+void RateLimiter::tick(OutputBuffer *outbuffer, const Router *router)
+{
+    long now = nowMsec();
+    if (now < nextReport_) return;
+    nextReport_ = now + reportms_;
+
+    char buffer[256];
+    size_t n;
+    nreport_ = 0;
+    while ((n = report(buffer, sizeof(buffer))) > 0) {
+        uint32_t flags = parsePri(buffer, n);
+        if (!router || router->route(buffer, n, &flags)) outbuffer->write(buffer, n, flags);
+    }
+    lastReport_ = now;
+}
+
+#endif
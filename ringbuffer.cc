@@ -3,158 +3,1026 @@
 
 #include <cstdlib>
 #include <time.h>
+#include <sched.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
 #include <ringbuffer.h>
+#include <spill.h>
+#include <router.h>
+#include <syslogmsg.h>
+
+static const char spoolMagic[8] = { 'S', 'S', 'A', 'F', 'E', 'R', '0', '3' };
 
 RingBuffer::RingBuffer(size_t size, bool verbose,
-        const char *notifyf, bool readBorder)
+        int reportms, bool readBorder, SyncMode mode, const char *spool,
+        Spill *spill, EvictPolicy evict)
 {
     int eno = pthread_mutex_init(&mutex_, 0);
     if (eno != 0) throw eno;
 
-    eno = pthread_cond_init(&cond_, 0);
-    if (eno != 0) throw eno;
+    verbose_ = verbose;
 
-    size_   = size;
-    buffer_ = (char *) malloc(size_);
-    if (!buffer_) throw errno;
+    size_    = size & ~(size_t) 7;
+    spoolfd_ = -1;
+    spool_   = 0;
+    nspool_  = 0;
+
+    if (spool) {
+        if (!openSpool(spool, size_)) throw errno;
+        recover();
+    } else {
+        void *ptr;
+        if (posix_memalign(&ptr, pagesize, pagesize + size_) != 0) throw ENOMEM;
+        ctl_ = (Control *) ptr;
+        memset(ctl_, 0x00, sizeof(Control));
+        ctl_->size = size_;
+        ctl_->seq  = 1;
+        buffer_ = (char *) ptr + pagesize;
+    }
+    seq_ = ctl_->seq;
+
+    locked_ = (mode == Locked);
+
+    memset(&pstats_, 0x00, sizeof(pstats_));
+
+    nconsumer_  = 0;
+    evictSeq_   = 0;
+    spill_      = spill;
+    for (size_t i = 0; i < (size_t) nroute; ++i) routes_[i] = ~(uint32_t) 0;
+    router_     = 0;
+    if (spill_) spill_->routeBy(routes_);
+
+    bySeverity_ = (evict == BySeverity) && !spill_;
+    memset(sevBytes_, 0x00, sizeof(sevBytes_));
+    bySender_   = (evict == BySender) && !spill_;
+    memset(senderBytes_, 0x00, sizeof(senderBytes_));
+    senders_    = 0;
+    usedBytes_  = 0;
+    scratch_    = 0;
+    nscratch_   = 0;
+    if (bySeverity_ || bySender_) countRecords(ctl_->tail, ctl_->head, true);
 
     quit_    = false;
-    verbose_ = verbose;
 
-    notifyf_ = notifyf;
+    reportms_    = reportms;
+    lastReport_  = nowUsec();
+    nextReport_  = lastReport_ + (uint64_t) reportms * 1000;
+    reportMsgs_  = 0;
+    reportBytes_ = 0;
     readBorder_ = readBorder;
+
+    addConsumer(true);
 }
 
 RingBuffer::~RingBuffer()
 {
+    for (size_t i = 0; i < nconsumer_; ++i) delete consumers_[i];
+
     pthread_mutex_destroy(&mutex_);
-    pthread_cond_destroy(&cond_);
-    free(buffer_);
+    free(scratch_);
+
+    if (spool_) {
+        msync(spool_, nspool_, MS_ASYNC);
+        munmap(spool_, nspool_);
+        close(spoolfd_);
+    } else {
+        free(ctl_);
+    }
 }
 
-/* ring deque <-[][]<-
- * raw buffer ->[][]->
+/* file layout: [Control, padded to a page][ring of size bytes].
+ * an existing spool keeps its own size, its records are worth more
+ * than the -b of this run.
  */
+bool RingBuffer::openSpool(const char *spool, size_t size)
+{
+    spoolfd_ = open(spool, O_RDWR | O_CREAT, 0600);
+    if (spoolfd_ == -1) {
+        fprintf(stderr, "open(%s) error, %d:%s\n", spool, errno, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(spoolfd_, &st) != 0) return false;
 
-bool RingBuffer::ensureSpace(size_t n, bool *droped)
+    Control ctl;
+    bool reuse = false;
+    if ((size_t) st.st_size >= pagesize &&
+        pread(spoolfd_, &ctl, sizeof(ctl), 0) == (ssize_t) sizeof(ctl) &&
+        memcmp(ctl.magic, spoolMagic, sizeof(spoolMagic)) == 0 &&
+        ctl.size > 0 && ctl.size % 8 == 0 && (size_t) st.st_size == pagesize + ctl.size) {
+        if (ctl.size != size) {
+            fprintf(stderr, "spool %s keeps its size %lu\n", spool, (unsigned long) ctl.size);
+        }
+        size  = ctl.size;
+        reuse = true;
+    } else if (ftruncate(spoolfd_, 0) != 0 || ftruncate(spoolfd_, pagesize + size) != 0) {
+        fprintf(stderr, "ftruncate(%s) error, %d:%s\n", spool, errno, strerror(errno));
+        return false;
+    }
+
+    nspool_ = pagesize + size;
+    spool_  = (char *) mmap(0, nspool_, PROT_READ | PROT_WRITE, MAP_SHARED, spoolfd_, 0);
+    if (spool_ == MAP_FAILED) {
+        fprintf(stderr, "mmap(%s) error, %d:%s\n", spool, errno, strerror(errno));
+        spool_ = 0;
+        return false;
+    }
+
+    size_   = size;
+    ctl_    = (Control *) spool_;
+    buffer_ = spool_ + pagesize;
+
+    if (!reuse) {
+        memset(ctl_, 0x00, sizeof(Control));
+        ctl_->size = size_;
+        ctl_->seq  = 1;          // zeroed pages never look like a record
+        memcpy(ctl_->magic, spoolMagic, sizeof(spoolMagic));
+    }
+    return true;
+}
+
+bool RingBuffer::validRecord(uint64_t pos, uint64_t seq, uint64_t tail) const
 {
-    bool hasSpace = false;
-    if (droped) *droped = false;
-    
-    while (!hasSpace) {
-        size_t qlen = queue_.size();
-        if (qlen == 0) {
-            hasSpace = true;
-        } else {
-            std::pair<size_t, size_t> range;
-            range.first  = queue_.front().first;
-            range.second = queue_.back().second;
-
-            size_t used = (range.second > range.first) ?
-                range.second - range.first :
-                size_ + range.second - range.first;
-            if (used + n > size_) {
-                if (droped) *droped = true;
-                queue_.pop_front();
-            } else {
-                hasSpace = true;
-            }
+    Record rec;
+    copyOut(&rec, pos, sizeof(rec));
+    return rec.seq == seq && pos + recordSize(rec.len) - tail <= size_;
+}
+
+/* records between tail and head are walked and must carry consecutive
+ * sequence numbers, the chain is cut where it breaks (a torn write after
+ * a power loss). a crash between writing records and publishing head
+ * leaves whole records behind head, they are taken as long as they go
+ * on with the sequence number the control block expects next.
+ */
+bool RingBuffer::recover()
+{
+    uint64_t tail = ctl_->tail;
+    uint64_t head = ctl_->head;
+    if (head < tail || head - tail > size_) head = tail;
+
+    uint64_t pos = tail, seq = ctl_->seq, nrec = 0;
+    if (pos != head) {
+        Record rec;
+        copyOut(&rec, pos, sizeof(rec));
+        seq = rec.seq;
+    }
+
+    while (pos != head && validRecord(pos, seq, tail)) {
+        Record rec;
+        copyOut(&rec, pos, sizeof(rec));
+        pos += recordSize(rec.len);
+        ++seq;
+        ++nrec;
+    }
+
+    if (pos == head && seq == ctl_->seq) {
+        while (pos - tail < size_ && validRecord(pos, seq, tail)) {
+            Record rec;
+            copyOut(&rec, pos, sizeof(rec));
+            pos += recordSize(rec.len);
+            ++seq;
+            ++nrec;
         }
     }
+
+    ctl_->tail = tail;
+    ctl_->head = pos;
+    ctl_->seq  = seq > ctl_->seq ? seq : ctl_->seq;
+
+    if (nrec) {
+        fprintf(stderr, "spool recovered %lu records, %lu bytes\n",
+                (unsigned long) nrec, (unsigned long) (pos - tail));
+    }
     return true;
 }
 
-size_t RingBuffer::write(const char *buffer, size_t n)
+bool RingBuffer::flush(FlushPolicy policy)
 {
-    if (n > size_) return 0;
-    pthread_mutex_lock(&mutex_);
+    if (!spool_ || policy == FlushNone) return true;
+    return msync(spool_, nspool_, policy == FlushSync ? MS_SYNC : MS_ASYNC) == 0;
+}
 
-    bool droped;
-    ensureSpace(n, &droped);
+/* raw buffer ->[rec|data][rec|data]->
+ *            tail             head
+ */
 
-    size_t first, second;
+void RingBuffer::copyIn(uint64_t pos, const void *data, size_t n)
+{
+    size_t off = pos % size_;
+    if (off + n <= size_) {
+        memcpy(buffer_ + off, data, n);
+    } else {
+        memcpy(buffer_ + off, data, size_ - off);
+        memcpy(buffer_, (const char *) data + (size_ - off), n - (size_ - off));
+    }
+}
 
-    size_t qlen = queue_.size();
-    if (qlen == 0) {
-        first  = 0;
-        second = n;
-        memcpy(buffer_, buffer, n);
+void RingBuffer::copyOut(void *data, uint64_t pos, size_t n) const
+{
+    size_t off = pos % size_;
+    if (off + n <= size_) {
+        memcpy(data, buffer_ + off, n);
     } else {
-        std::pair<size_t, size_t> range = queue_.back();
+        memcpy(data, buffer_ + off, size_ - off);
+        memcpy((char *) data + (size_ - off), buffer_, n - (size_ - off));
+    }
+}
 
-        first = range.second;
-        second = (first + n) % size_;
-        if (first <= second) {
-            memcpy(buffer_ + first, buffer, n);
-        } else {
-            memcpy(buffer_ + first, buffer, size_ - first);
-            memcpy(buffer_, buffer + (size_ - first), second);
+RingBuffer::Consumer *RingBuffer::addConsumer(bool required)
+{
+    if (nconsumer_ == maxConsumers) {
+        fprintf(stderr, "at most %lu consumers\n", (unsigned long) maxConsumers);
+        return 0;
+    }
+    if (nconsumer_ > 0 && required && spill_) {
+        fprintf(stderr, "with a spill tier only the first consumer may be required\n");
+        return 0;
+    }
+
+    /* a cursor of the spool resumes at its record, a new one gets
+     * everything queued.
+     */
+    uint64_t pos = ctl_->tail;
+    if (nconsumer_ < ctl_->ncursor) {
+        uint64_t saved = ctl_->cursor[nconsumer_].pos & ~Claimed;
+        while (pos < saved && pos != ctl_->head) {
+            Record rec;
+            copyOut(&rec, pos, sizeof(rec));
+            pos += recordSize(rec.len);
         }
     }
-    queue_.push_back(std::make_pair(first, second));
 
-    pthread_mutex_unlock(&mutex_);
+    Consumer *c = new Consumer(this, nconsumer_, required, pos);
+    consumers_[nconsumer_++] = c;
+    ctl_->ncursor = nconsumer_;
+    return c;
+}
 
-    pthread_cond_signal(&cond_);
+bool RingBuffer::ensureSpace(uint64_t *head, size_t n)
+{
+    size_t budget = (bySeverity_ || bySender_) ? rotateFactor * n : 0;
+
+    while (true) {
+        uint64_t tail = reclaim();
+        if (*head - tail + n <= size_) break;
+
+        /* who is still at the oldest record, for a Required consumer
+         * it is a drop, the others just skip it.
+         */
+        bool required = false, claimed = false, all = true;
+        for (size_t i = 0; i < nconsumer_; ++i) {
+            uint64_t pos = __atomic_load_n(consumers_[i]->pos_, __ATOMIC_ACQUIRE);
+            if ((pos & ~Claimed) != tail) {
+                all = false;
+                continue;
+            }
+            if (consumers_[i]->required_) required = true;
+            if (pos & Claimed) claimed = true;
+        }
 
-    if (droped && notifyf_) notify();
-    if (verbose_) printf("PUSH %.*s", (int) n, buffer);
+        if (spill_ && required) {
+            spillOldest(tail, *head, n);
+            continue;
+        }
+
+        /* a consumer is copying the oldest record out, it is short */
+        if (claimed) {
+            sched_yield();
+            continue;
+        }
 
+        Record rec;
+        copyOut(&rec, tail, sizeof(rec));
+
+        size_t rsize = recordSize(rec.len);
+        bool keep = bySeverity_ ? lessImportant(rec) : bySender_ && withinShare(rec);
+        if (required && all && budget >= rsize && keep) {
+            if (rotateOldest(head, rec)) budget -= rsize;
+            continue;
+        }
+
+        for (size_t i = 0; i < nconsumer_; ++i) {
+            Consumer *c = consumers_[i];
+            if (skipTo(c, tail + rsize) && c->required_ && c->routed(rec) &&
+                rec.seq != evictSeq_) {
+                evictSeq_ = rec.seq;
+                statAdd(&pstats_.evictMsgs);
+                statAdd(&pstats_.evictBytes, rec.len);
+            }
+        }
+    }
     return true;
 }
 
+/* tail follows the oldest cursor, the records it passes leave the ring,
+ * their bytes are intact until the producer writes again.
+ */
+uint64_t RingBuffer::reclaim()
+{
+    uint64_t tail = UINT64_MAX;
+    for (size_t i = 0; i < nconsumer_; ++i) {
+        uint64_t pos = __atomic_load_n(consumers_[i]->pos_, __ATOMIC_ACQUIRE) & ~Claimed;
+        if (pos < tail) tail = pos;
+    }
+
+    if (tail != ctl_->tail) {
+        if (bySeverity_ || bySender_) countRecords(ctl_->tail, tail, false);
+        __atomic_store_n(&ctl_->tail, tail, __ATOMIC_RELEASE);
+    }
+    return tail;
+}
+
+/* move an unclaimed cursor that is before end to end, what it passes
+ * is counted as skipped unless the consumer is Required.
+ */
+bool RingBuffer::skipTo(Consumer *c, uint64_t end)
+{
+    uint64_t pos = __atomic_load_n(c->pos_, __ATOMIC_ACQUIRE);
+    if ((pos & Claimed) || pos >= end) return false;
+    if (!__atomic_compare_exchange_n(c->pos_, &pos, end,
+                                     false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+
+    while (!c->required_ && pos != end) {
+        Record rec;
+        copyOut(&rec, pos, sizeof(rec));
+        if (c->routed(rec)) {
+            statAdd(&c->skipMsgs_);
+            statAdd(&c->skipBytes_, rec.len);
+        }
+        pos += recordSize(rec.len);
+    }
+    return true;
+}
+
+/* true if bytes of a less important severity than rec are queued */
+bool RingBuffer::lessImportant(const Record &rec) const
+{
+    for (int sev = msgSeverity(rec.flags) + 1; sev < 8; ++sev) {
+        if (sevBytes_[sev]) return true;
+    }
+    return false;
+}
+
+/* true if the sender of rec has less than its fair share queued */
+bool RingBuffer::withinShare(const Record &rec) const
+{
+    return senderBytes_[msgSender(rec.flags)] * senders_ < usedBytes_;
+}
+
+/* move the oldest record to the head under a fresh sequence number,
+ * it keeps its bytes in the ring while the tail moves on to drop others.
+ * only a record no consumer took yet is moved, every cursor is claimed
+ * while it is copied.
+ */
+bool RingBuffer::rotateOldest(uint64_t *head, const Record &seen)
+{
+    uint64_t tail = ctl_->tail;
+
+    size_t nclaim = 0;
+    for (; nclaim < nconsumer_; ++nclaim) {
+        uint64_t pos = tail;
+        if (!__atomic_compare_exchange_n(consumers_[nclaim]->pos_, &pos, tail | Claimed,
+                                         false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+    }
+
+    size_t rsize = recordSize(seen.len);
+    bool ok = (nclaim == nconsumer_);
+    if (ok && nscratch_ < rsize) {
+        char *scratch = (char *) realloc(scratch_, rsize);
+        if (scratch) {
+            scratch_  = scratch;
+            nscratch_ = rsize;
+        }
+        ok = (scratch != 0);
+    }
+    if (ok) copyOut(scratch_, tail + sizeof(seen), seen.len);
+
+    for (size_t i = 0; i < nclaim; ++i) {
+        __atomic_store_n(consumers_[i]->pos_, ok ? tail + rsize : tail, __ATOMIC_RELEASE);
+    }
+    if (!ok) return false;
+
+    /* the old copy leaves before the new one may overwrite it */
+    reclaim();
+
+    Record rec = seen;
+    rec.seq = seq_++;
+    copyIn(*head + sizeof(rec), scratch_, rec.len);
+    copyIn(*head, &rec, sizeof(rec));
+    account(rec, true);
+
+    *head = publish(*head + rsize);
+    statAdd(&pstats_.rotateMsgs);
+    return true;
+}
+
+/* severity and sender counts as a record joins or leaves the ring */
+void RingBuffer::account(const Record &rec, bool add)
+{
+    size_t rsize = recordSize(rec.len);
+    if (bySeverity_) {
+        if (add) sevBytes_[msgSeverity(rec.flags)] += rsize;
+        else sevBytes_[msgSeverity(rec.flags)] -= rsize;
+    }
+    if (bySender_) {
+        size_t *bytes = &senderBytes_[msgSender(rec.flags)];
+        if (add) {
+            if (*bytes == 0) ++senders_;
+            *bytes     += rsize;
+            usedBytes_ += rsize;
+        } else {
+            *bytes     -= rsize;
+            usedBytes_ -= rsize;
+            if (*bytes == 0) --senders_;
+        }
+    }
+}
+
+void RingBuffer::countRecords(uint64_t from, uint64_t to, bool add)
+{
+    while (from != to) {
+        Record rec;
+        copyOut(&rec, from, sizeof(rec));
+        account(rec, add);
+        from += recordSize(rec.len);
+    }
+}
+
+/* move at least a Spill::chunkSize run of the oldest records to disk,
+ * the claim keeps the first consumer away while they are copied out,
+ * the Spill writes them later, the other consumers skip them.
+ */
+bool RingBuffer::spillOldest(uint64_t tail, uint64_t head, size_t n)
+{
+    Consumer *owner = consumers_[0];
+    uint64_t pos = owner->claim();
+    if (pos != tail) {           // it took the oldest records meanwhile
+        __atomic_store_n(owner->pos_, pos, __ATOMIC_RELEASE);
+        return false;
+    }
+
+    size_t want = n > Spill::chunkSize ? n : Spill::chunkSize;
+
+    uint64_t end = tail;
+    size_t nrec = 0, nbytes = 0;
+    while (end != head && end - tail < want) {
+        Record rec;
+        copyOut(&rec, end, sizeof(rec));
+        end += recordSize(rec.len);
+        nbytes += rec.len;
+        ++nrec;
+    }
+
+    struct iovec iov[2];
+    size_t niov = 0;
+    size_t off = tail % size_;
+    if (off + (end - tail) <= size_) {
+        iov[niov].iov_base = buffer_ + off;
+        iov[niov].iov_len  = end - tail;
+        ++niov;
+    } else {
+        iov[niov].iov_base = buffer_ + off;
+        iov[niov].iov_len  = size_ - off;
+        ++niov;
+        iov[niov].iov_base = buffer_;
+        iov[niov].iov_len  = (end - tail) - (size_ - off);
+        ++niov;
+    }
+
+    bool ok = spill_->append(iov, niov, nrec, nbytes);
+
+    for (size_t i = 1; i < nconsumer_; ++i) {
+        Consumer *c = consumers_[i];
+        while (!skipTo(c, end) && (__atomic_load_n(c->pos_, __ATOMIC_ACQUIRE) & ~Claimed) < end) {
+            sched_yield();
+        }
+    }
+    __atomic_store_n(owner->pos_, end, __ATOMIC_RELEASE);
+
+    if (ok) {
+        statAdd(&pstats_.spillMsgs, nrec);
+        statAdd(&pstats_.spillBytes, nbytes);
+    }
+    return ok;
+}
+
+uint64_t RingBuffer::publish(uint64_t head)
+{
+    ctl_->seq = seq_;
+    __atomic_store_n(&ctl_->head, head, __ATOMIC_SEQ_CST);
+    return head;
+}
+
+size_t RingBuffer::write(const char *buffer, size_t n, uint32_t flags)
+{
+    struct iovec iov;
+    iov.iov_base = (void *) buffer;
+    iov.iov_len  = n;
+    return write(&iov, 1, &flags) == 1 ? n : 0;
+}
+
+/* bulk insert, every iovec is one record. space is made for as many
+ * records as fit in the ring at once, head is published once per such
+ * run, so a recvmmsg batch costs one eviction pass and one wakeup.
+ * stamps, if given, is when each record was received, not now.
+ */
+size_t RingBuffer::write(const struct iovec *records, size_t n, const uint32_t *flags,
+                         const uint64_t *stamps)
+{
+    if (locked_) pthread_mutex_lock(&mutex_);
+
+    size_t nwrite = 0, nbytes = 0;
+    uint64_t head = ctl_->head;
+    uint64_t now  = nowUsec();
+
+    for (size_t i = 0; i < n; ) {
+        size_t need = 0, j = i;
+        for (; j < n; ++j) {
+            size_t rsize = recordSize(records[j].iov_len);
+            if (rsize > size_) break;
+            if (need + rsize > size_) break;
+            need += rsize;
+        }
+        if (j == i) {            // too large for the ring
+            statAdd(&pstats_.oversizeMsgs);
+            statAdd(&pstats_.oversizeBytes, records[i].iov_len);
+            ++i;
+            continue;
+        }
+
+        ensureSpace(&head, need);
+
+        for (; i < j; ++i) {
+            Record rec;
+            rec.len   = records[i].iov_len;
+            rec.flags = flags ? flags[i] : 0;
+            rec.seq   = seq_++;
+            rec.stamp = stamps ? stamps[i] : now;
+
+            if (bySeverity_ || bySender_) account(rec, true);
+
+            /* header last, a valid header in the spool means whole payload */
+            copyIn(head + sizeof(rec), records[i].iov_base, rec.len);
+            copyIn(head, &rec, sizeof(rec));
+            head   += recordSize(rec.len);
+            nbytes += rec.len;
+            ++nwrite;
+
+            if (verbose_) printf("PUSH %.*s", (int) rec.len, (char *) records[i].iov_base);
+        }
+        publish(head);
+        statMax(&pstats_.highWater, head - ctl_->tail);
+    }
+
+    statAdd(&pstats_.writeMsgs, nwrite);
+    statAdd(&pstats_.writeBytes, nbytes);
+
+    if (locked_) pthread_mutex_unlock(&mutex_);
+
+    if (nwrite) wakeup();
+
+    return nwrite;
+}
+
+/* the calls of the first consumer, a ring with one destination */
 size_t RingBuffer::read(char *buffer, size_t n)
 {
-    pthread_mutex_lock(&mutex_);
-    if (!quit_ && queue_.empty()) {
-        pthread_cond_wait(&cond_, &mutex_);
-    }
-
-    size_t nn = 0;
-    while (!queue_.empty()) {
-        std::pair<size_t, size_t> range = queue_.front();
-        
-        if (range.first <= range.second) {
-            if (nn + range.second - range.first <= n) {
-                memcpy(buffer + nn, buffer_ + range.first, range.second - range.first);
-                nn += range.second - range.first;
-            } else {
-                break;
+    return consumers_[0]->read(buffer, n);
+}
+
+size_t RingBuffer::peek(struct iovec *iov, size_t *niov, size_t n)
+{
+    return consumers_[0]->peek(iov, niov, n);
+}
+
+bool RingBuffer::commit()
+{
+    return consumers_[0]->commit();
+}
+
+bool RingBuffer::rollback()
+{
+    return consumers_[0]->rollback();
+}
+
+size_t RingBuffer::peekRecords(struct iovec *iov, size_t nrecord, size_t n)
+{
+    return consumers_[0]->peekRecords(iov, nrecord, n);
+}
+
+bool RingBuffer::commit(size_t nrecord)
+{
+    return consumers_[0]->commit(nrecord);
+}
+
+bool RingBuffer::waitMore(int timeout)
+{
+    return consumers_[0]->waitMore(timeout);
+}
+
+bool RingBuffer::ready(int timeout)
+{
+    return consumers_[0]->ready(timeout);
+}
+
+void RingBuffer::wakeup()
+{
+    for (size_t i = 0; i < nconsumer_; ++i) consumers_[i]->wakeup();
+}
+
+bool RingBuffer::interrupt()
+{
+    quit_ = true;
+    for (size_t i = 0; i < nconsumer_; ++i) {
+        __atomic_store_n(&consumers_[i]->idle_, 1, __ATOMIC_SEQ_CST);
+        consumers_[i]->wakeup();
+    }
+    return true;
+}
+
+RingBuffer::Consumer::Consumer(RingBuffer *ring, size_t index, bool required, uint64_t pos)
+{
+    efd_ = eventfd(0, 0);
+    if (efd_ == -1) throw errno;
+
+    ring_     = ring;
+    bit_      = 1u << index;
+    pos_      = &ring->ctl_->cursor[index].pos;
+    required_ = required;
+    spill_    = index == 0 ? ring->spill_ : 0;
+    __atomic_store_n(pos_, pos, __ATOMIC_RELEASE);
+
+    idle_ = 0;
+    stats_.commitMsgs  = 0;
+    stats_.commitBytes = 0;
+    skipMsgs_  = 0;
+    skipBytes_ = 0;
+
+    claimStart_ = claimEnd_ = 0;
+    fromSpill_  = false;
+}
+
+RingBuffer::Consumer::~Consumer()
+{
+    __atomic_store_n(pos_, *pos_ & ~Claimed, __ATOMIC_RELEASE);
+    close(efd_);
+}
+
+/* the consumer claims to read, the producer claims to spill */
+uint64_t RingBuffer::Consumer::claim()
+{
+    uint64_t tail = __atomic_load_n(pos_, __ATOMIC_ACQUIRE) & ~Claimed;
+    while (!__atomic_compare_exchange_n(pos_, &tail, tail | Claimed,
+                                        false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        if (tail & Claimed) sched_yield();
+        tail &= ~Claimed;
+    }
+    return tail;
+}
+
+/* paired puts every record in exactly two iovecs, the second is empty
+ * unless the record wraps, so the caller can tell records apart.
+ */
+size_t RingBuffer::Consumer::claimRecords(struct iovec *iov, size_t *niov, size_t n,
+                                          bool paired, size_t *nrecord)
+{
+    fromSpill_ = spill_ && !spill_->empty();
+    if (fromSpill_) return spill_->peek(iov, niov, n, paired, nrecord);
+
+    if (ring_->locked_) pthread_mutex_lock(&ring_->mutex_);
+
+    uint64_t tail = claim();
+    uint64_t head = __atomic_load_n(&ring_->ctl_->head, __ATOMIC_ACQUIRE);
+
+    /* the producer spilled between the check and the claim, the spilled
+     * records are older than anything left in the ring.
+     */
+    fromSpill_ = spill_ && !spill_->empty();
+    if (fromSpill_) __atomic_store_n(pos_, tail, __ATOMIC_RELEASE);
+
+    if (ring_->locked_) pthread_mutex_unlock(&ring_->mutex_);
+
+    if (fromSpill_) return spill_->peek(iov, niov, n, paired, nrecord);
+
+    claimStart_ = tail;
+
+    size_t size = ring_->size_;
+    char  *buffer = ring_->buffer_;
+
+    /* records routed elsewhere are left out, those before the first
+     * claimed one are passed for good.
+     */
+    size_t nn = 0, cnt = 0, nrec = 0;
+    while (tail != head && cnt + 2 <= *niov) {
+        Record rec;
+        ring_->copyOut(&rec, tail, sizeof(rec));
+        if (!routed(rec)) {
+            tail += recordSize(rec.len);
+            if (nrec == 0) claimStart_ = tail;
+            continue;
+        }
+        if (cnt > 0 && nn + rec.len > n) break;
+
+        size_t off = (tail + sizeof(rec)) % size;
+        if (off + rec.len <= size) {
+            iov[cnt].iov_base = buffer + off;
+            iov[cnt].iov_len  = rec.len;
+            ++cnt;
+            if (paired) {
+                iov[cnt].iov_base = buffer;
+                iov[cnt].iov_len  = 0;
+                ++cnt;
             }
         } else {
-            if (nn + size_ + range.second - range.first <= n) {
-                memcpy(buffer + nn,  buffer_ + range.first, size_ - range.first);
-                memcpy(buffer + nn + size_ - range.first, buffer_, range.second);
-                nn += size_ + range.second - range.first;
-            } else {
-                break;
-            }
+            iov[cnt].iov_base = buffer + off;
+            iov[cnt].iov_len  = size - off;
+            iov[cnt+1].iov_base = buffer;
+            iov[cnt+1].iov_len  = rec.len - (size - off);
+            cnt += 2;
         }
-        queue_.pop_front();
+        nn   += rec.len;
+        tail += recordSize(rec.len);
+        ++nrec;
 
-        if (readBorder_) break;
+        if (ring_->readBorder_ && !paired) break;
     }
 
-    pthread_mutex_unlock(&mutex_);
+    claimEnd_ = tail;
+    if (nrec == 0) __atomic_store_n(pos_, tail, __ATOMIC_RELEASE);
 
-    if (verbose_) printf("POP %.*s", (int) nn , buffer);
+    *niov = cnt;
+    if (nrecord) *nrecord = nrec;
+    return nn;
+}
 
+size_t RingBuffer::Consumer::peek(struct iovec *iov, size_t *niov, size_t n)
+{
+    if (!waitData()) {
+        *niov = 0;
+        return 0;
+    }
+
+    size_t nn = claimRecords(iov, niov, n, false, 0);
+    if (ring_->verbose_) {
+        for (size_t i = 0; i < *niov; ++i) {
+            printf("POP %.*s", (int) iov[i].iov_len, (char *) iov[i].iov_base);
+        }
+    }
     return nn;
 }
 
-bool RingBuffer::interrupt()
+size_t RingBuffer::Consumer::peekRecords(struct iovec *iov, size_t nrecord, size_t n)
 {
-    quit_ = true;
-    pthread_cond_signal(&cond_);
+    if (!waitData()) return 0;
+
+    size_t niov = nrecord * 2;
+    claimRecords(iov, &niov, n, true, &nrecord);
+    if (ring_->verbose_) {
+        for (size_t i = 0; i < niov; i += 2) {
+            printf("POP %.*s%.*s", (int) iov[i].iov_len, (char *) iov[i].iov_base,
+                   (int) iov[i+1].iov_len, (char *) iov[i+1].iov_base);
+        }
+    }
+    return nrecord;
+}
+
+bool RingBuffer::Consumer::commit()
+{
+    if (fromSpill_) return spill_->commit(&stats_);
+    __atomic_store_n(pos_, release(claimStart_, claimEnd_, SIZE_MAX), __ATOMIC_RELEASE);
+    return true;
+}
+
+bool RingBuffer::Consumer::commit(size_t nrecord)
+{
+    if (fromSpill_) return spill_->commit(nrecord, &stats_);
+    __atomic_store_n(pos_, release(claimStart_, claimEnd_, nrecord), __ATOMIC_RELEASE);
     return true;
 }
 
-bool RingBuffer::notify() const
+bool RingBuffer::Consumer::waitMore(int timeout)
+{
+    /* spilled records are backlog, nothing to wait for */
+    if (fromSpill_) return false;
+    return waitData(timeout, true);
+}
+
+bool RingBuffer::Consumer::ready(int timeout)
 {
-    FILE *fp = fopen(notifyf_, "w");
-    if (fp) {
-        fprintf(fp, "syslog-safer: DROP @%ld", (long) time(0));
-        fclose(fp);
+    return waitData(timeout);
+}
+
+/* account the first nrecord claimed records and return the new cursor */
+uint64_t RingBuffer::Consumer::release(uint64_t from, uint64_t to, size_t nrecord)
+{
+    uint64_t now = nowUsec();
+    for (size_t i = 0; i < nrecord && from != to; ) {
+        Record rec;
+        ring_->copyOut(&rec, from, sizeof(rec));
+        if (routed(rec)) {
+            stats_.add(rec, now);
+            ++i;
+        }
+        from += recordSize(rec.len);
     }
+    return from;
+}
+
+bool RingBuffer::Consumer::rollback()
+{
+    if (fromSpill_) return spill_->rollback();
+    __atomic_store_n(pos_, claimStart_, __ATOMIC_RELEASE);
     return true;
 }
+
+size_t RingBuffer::Consumer::read(char *buffer, size_t n)
+{
+    if (!waitData()) return 0;
+
+    struct iovec iov[64];
+    size_t niov = sizeof(iov) / sizeof(iov[0]);
+
+    size_t nn = claimRecords(iov, &niov, n, false, 0);
+    if (nn > n) {                // the first record does not fit
+        rollback();
+        return 0;
+    }
+
+    nn = 0;
+    for (size_t i = 0; i < niov; ++i) {
+        memcpy(buffer + nn, iov[i].iov_base, iov[i].iov_len);
+        nn += iov[i].iov_len;
+    }
+    commit();
+
+    if (ring_->verbose_) printf("POP %.*s", (int) nn , buffer);
+
+    return nn;
+}
+
+bool RingBuffer::Consumer::hasData(bool more) const
+{
+    if (spill_ && !spill_->empty()) return true;
+
+    uint64_t pos = more ? claimEnd_ : __atomic_load_n(pos_, __ATOMIC_SEQ_CST) & ~Claimed;
+    return __atomic_load_n(&ring_->ctl_->head, __ATOMIC_SEQ_CST) != pos;
+}
+
+/* the consumer only sleeps on efd_ after it announced idle_,
+ * so the producer pays for write(efd_) only when somebody waits.
+ * more waits for records behind the last claimed one.
+ */
+bool RingBuffer::Consumer::waitData(int timeout, bool more)
+{
+    while (!ring_->quit_) {
+        if (hasData(more)) return true;
+
+        __atomic_store_n(&idle_, 1, __ATOMIC_SEQ_CST);
+        if (hasData(more) || ring_->quit_) {
+            __atomic_store_n(&idle_, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        struct pollfd pfd;
+        pfd.fd     = efd_;
+        pfd.events = POLLIN;
+
+        int rc = poll(&pfd, 1, timeout);
+        if (rc > 0) {
+            uint64_t v;
+            if (::read(efd_, &v, sizeof(v)) == -1 && errno != EAGAIN) return false;
+        } else if (rc == 0) {
+            __atomic_store_n(&idle_, 0, __ATOMIC_SEQ_CST);
+            return hasData(more);
+        } else if (errno != EINTR) {
+            return false;
+        }
+    }
+    return false;
+}
+
+void RingBuffer::Consumer::wakeup()
+{
+    if (__atomic_load_n(&idle_, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&idle_, 0, __ATOMIC_SEQ_CST)) {
+        uint64_t v = 1;
+        if (::write(efd_, &v, sizeof(v)) == -1) {
+            fprintf(stderr, "write(eventfd) error, %d:%s\n", errno, strerror(errno));
+        }
+    }
+}
+
+void RingBuffer::Consumer::dumpStats(FILE *fp, const char *prefix) const
+{
+    uint64_t head = __atomic_load_n(&ring_->ctl_->head, __ATOMIC_ACQUIRE);
+    uint64_t pos  = __atomic_load_n(pos_, __ATOMIC_ACQUIRE) & ~Claimed;
+
+    statPrint(fp, prefix, "lag_bytes", head > pos ? head - pos : 0);
+    statPrint(fp, prefix, "commit_msgs", statGet(&stats_.commitMsgs));
+    statPrint(fp, prefix, "commit_bytes", statGet(&stats_.commitBytes));
+    statPrint(fp, prefix, "skip_msgs", statGet(&skipMsgs_));
+    statPrint(fp, prefix, "skip_bytes", statGet(&skipBytes_));
+
+    char name[64];
+    snprintf(name, sizeof(name), "%s_latency_usec", prefix);
+    stats_.latency.print(fp, name);
+}
+
+void RingBuffer::dropped(uint64_t *msgs, uint64_t *bytes) const
+{
+    uint64_t quotaMsgs = 0, quotaBytes = 0;
+    if (spill_) spill_->dropped(&quotaMsgs, &quotaBytes);
+
+    *msgs  = statGet(&pstats_.evictMsgs) + statGet(&pstats_.oversizeMsgs) +
+             quotaMsgs + statGet(&pstats_.stageMsgs);
+    *bytes = statGet(&pstats_.evictBytes) + statGet(&pstats_.oversizeBytes) +
+             quotaBytes + statGet(&pstats_.stageBytes);
+}
+
+/* the report is an ordinary record, syslog.warning, it may itself push
+ * out older records, they show up in the next report.
+ */
+void RingBuffer::tick()
+{
+    if (reportms_ <= 0) return;
+
+    uint64_t now = nowUsec();
+    if (now < nextReport_) return;
+
+    uint64_t msgs, bytes;
+    dropped(&msgs, &bytes);
+    nextReport_ = now + (uint64_t) reportms_ * 1000;
+    if (msgs == reportMsgs_) return;
+
+    time_t since = lastReport_ / 1000000, t = now / 1000000;
+    struct tm since_tm, now_tm;
+    localtime_r(&since, &since_tm);
+    localtime_r(&t, &now_tm);
+
+    char stamp[32], sincestr[32], buffer[256];
+    strftime(stamp, sizeof(stamp), "%b %e %H:%M:%S", &now_tm);
+    strftime(sincestr, sizeof(sincestr), "%Y-%m-%d %H:%M:%S", &since_tm);
+
+    int n = snprintf(buffer, sizeof(buffer),
+                     "<%d>%s syslog-safer: dropped %llu messages (%llu bytes) since %s",
+                     5 << 3 | 4, stamp, (unsigned long long) (msgs - reportMsgs_),
+                     (unsigned long long) (bytes - reportBytes_), sincestr);
+
+    reportMsgs_  = msgs;
+    reportBytes_ = bytes;
+    lastReport_  = now;
+
+    uint32_t flags = parsePri(buffer, n);
+    if (!router_ || router_->route(buffer, n, &flags)) write(buffer, n, flags);
+}
+
+void RingBuffer::dumpStats(FILE *fp) const
+{
+    uint64_t head = __atomic_load_n(&ctl_->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = head;
+    for (size_t i = 0; i < nconsumer_; ++i) {
+        uint64_t pos = __atomic_load_n(consumers_[i]->pos_, __ATOMIC_ACQUIRE) & ~Claimed;
+        if (pos < tail) tail = pos;
+    }
+
+    statPrint(fp, "buffer_size", size_);
+    statPrint(fp, "buffer_used_bytes", head > tail ? head - tail : 0);
+    statPrint(fp, "buffer_high_water_bytes", statGet(&pstats_.highWater));
+    statPrint(fp, "buffer_write_msgs", statGet(&pstats_.writeMsgs));
+    statPrint(fp, "buffer_write_bytes", statGet(&pstats_.writeBytes));
+    statPrint(fp, "buffer_drop_evict_msgs", statGet(&pstats_.evictMsgs));
+    statPrint(fp, "buffer_drop_evict_bytes", statGet(&pstats_.evictBytes));
+    statPrint(fp, "buffer_drop_oversize_msgs", statGet(&pstats_.oversizeMsgs));
+    statPrint(fp, "buffer_drop_oversize_bytes", statGet(&pstats_.oversizeBytes));
+    statPrint(fp, "buffer_rotate_msgs", statGet(&pstats_.rotateMsgs));
+    if (bySender_) statPrint(fp, "buffer_senders", __atomic_load_n(&senders_, __ATOMIC_RELAXED));
+
+    if (spill_) {
+        uint64_t quotaMsgs, quotaBytes;
+        spill_->dropped(&quotaMsgs, &quotaBytes);
+
+        statPrint(fp, "spill_pending_msgs", spill_->pending());
+        statPrint(fp, "spill_used_bytes", spill_->used());
+        statPrint(fp, "spill_write_msgs", statGet(&pstats_.spillMsgs));
+        statPrint(fp, "spill_write_bytes", statGet(&pstats_.spillBytes));
+        statPrint(fp, "spill_drop_quota_msgs", quotaMsgs);
+        statPrint(fp, "spill_drop_quota_bytes", quotaBytes);
+    }
+
+    /* buffer_commit_msgs for the first consumer, buffer1_ for the next */
+    for (size_t i = 0; i < nconsumer_; ++i) {
+        char prefix[32];
+        if (i == 0) snprintf(prefix, sizeof(prefix), "buffer");
+        else snprintf(prefix, sizeof(prefix), "buffer%lu", (unsigned long) i);
+        consumers_[i]->dumpStats(fp, prefix);
+    }
+}
@@ -6,37 +6,339 @@
 
 #include <cstdio>
 #include <cstring>
-#include <deque>
 #include <errno.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <sys/uio.h>
+#include <stats.h>
+#include <syslogmsg.h>
 
+class Router;
+
+class Spill;
+
+/* single-producer ring with one cursor per consumer, records are stored
+ * inline as [Record][payload][pad to 8], head and the cursors are monotonic
+ * byte positions, tail is the oldest cursor, space behind it is free.
+ *
+ * the producer drops the oldest records by moving cursors forward with CAS,
+ * a consumer sets the Claimed bit of its cursor while it touches ring
+ * memory, so the producer never overwrites bytes a consumer is reading.
+ *
+ * every destination is a Consumer, records stay until all Required ones
+ * took them, a consumer that is not Required and falls behind skips the
+ * oldest records instead of making the others lose them. the RingBuffer
+ * consumer calls act on the first consumer.
+ *
+ * Locked mode serializes write/read with a mutex, it allows more than
+ * one producer thread.
+ *
+ * with a spool file the control block and the ring are a shared mapping
+ * of the file, a crashed or restarted process finds them in the page
+ * cache and recovers the records the destination has not taken yet.
+ *
+ * with a Spill tier the oldest records go to disk, or compressed to
+ * memory, instead of being dropped, they are drained before anything
+ * still in the ring.
+ *
+ * BySeverity eviction keeps a byte count per severity, an important
+ * record at the tail is moved to the head (out of order) as long as
+ * less important bytes are queued, and at most rotateFactor times the
+ * needed space is moved per write, so eviction stays O(1) amortized.
+ *
+ * BySender eviction does the same with a byte count per sender slot
+ * (syslogmsg.h), the fair share is the queued bytes over the senders
+ * that have some. the oldest record of a sender within its share is
+ * moved to the head, one of a sender over it is dropped, so a process
+ * that floods the socket loses its own records and not the others'.
+ * a Spill tier loses nothing to eviction, both are Fifo with one.
+ *
+ * every record carries the time it was written, the consumer puts the
+ * time it spent queued into a histogram when it commits.
+ *
+ * a record's route (syslogmsg.h) names the consumers it is for, the
+ * others pass over it when they claim, as if it was taken.
+ */
 class RingBuffer {
 public:
-    RingBuffer(size_t size, bool verbose = false, const char *notifyf = 0);
+    enum SyncMode { LockFree, Locked };
+    enum FlushPolicy { FlushNone, FlushAsync, FlushSync };
+    enum EvictPolicy { Fifo, BySeverity, BySender };
+
+    class Consumer;
+
+    RingBuffer(size_t size, bool verbose = false, int reportms = 0,
+               bool readBorder = false, SyncMode mode = LockFree,
+               const char *spool = 0, Spill *spill = 0, EvictPolicy evict = Fifo);
     ~RingBuffer();
 
-    size_t write(const char *buffer, size_t n);
+    /* push the spool file to disk, called off the receive path */
+    bool flush(FlushPolicy policy);
+
+    /* flags are the syslogmsg.h tags of each record, 0 if unknown */
+    size_t write(const char *buffer, size_t n, uint32_t flags = 0);
+    size_t write(const struct iovec *records, size_t n, const uint32_t *flags = 0,
+                 const uint64_t *stamps = 0);
     size_t read(char *buffer, size_t n);
     bool interrupt();
 
+    /* zero-copy read, peek() claims pending records and points iov at
+     * their payload inside the ring (two iovecs if a record wraps),
+     * commit() releases them, rollback() keeps them for the next peek().
+     * n bounds the bytes, but the first record is always returned.
+     */
+    size_t peek(struct iovec *iov, size_t *niov, size_t n);
+    bool commit();
+    bool rollback();
+
+    /* batch form of peek(), claims up to nrecord records and puts
+     * record i in iov[2*i] and iov[2*i+1], iov holds 2*nrecord entries.
+     * commit(k) releases only the first k claimed records.
+     * waitMore() waits up to timeout ms for records behind the claim.
+     */
+    size_t peekRecords(struct iovec *iov, size_t nrecord, size_t n);
+    bool commit(size_t nrecord);
+    bool waitMore(int timeout);
+
+    /* waits up to timeout ms for a record, so the reader can do
+     * other work in between instead of blocking in peek().
+     */
+    bool ready(int timeout);
+
+    /* another consumer with its own cursor at the oldest record, added
+     * before the first write. a Spill tier is drained by the first
+     * consumer, so with it the others may not be required.
+     */
+    Consumer *addConsumer(bool required);
+
+    /* route i is for the consumers in the bitmap, all of them unless
+     * set, set before the first write.
+     */
+    void route(size_t i, uint32_t consumers) { routes_[i] = consumers; }
+
+    /* the -x rules the tick() report goes by, as any message */
+    void router(const Router *router) { router_ = router; }
+    Consumer *consumer(size_t i) { return consumers_[i]; }
+    size_t consumers() const { return nconsumer_; }
+
+    /* counters and the latency histogram, "name value" per line */
+    void dumpStats(FILE *fp) const;
+
+    /* messages and bytes lost so far, evicted or over the spill quota
+     * or too large for the ring, or before it, see stageDropped().
+     */
+    void dropped(uint64_t *msgs, uint64_t *bytes) const;
+
+    /* called by the producer, what its -j stage rings dropped since the
+     * last call, they never reached the ring but count as its drops.
+     */
+    void stageDropped(uint64_t msgs, uint64_t bytes) {
+        statAdd(&pstats_.stageMsgs, msgs);
+        statAdd(&pstats_.stageBytes, bytes);
+    }
+
+    /* called by the producer when it is idle or between batches, every
+     * reportms it queues a record telling the destination what was lost.
+     */
+    void tick();
+
     static const size_t nbuffer = 16384; // 16K
+    static const size_t maxConsumers = 16;
+
+    struct Record {
+        uint32_t len;
+        uint32_t flags;
+        uint64_t seq;
+        uint64_t stamp;          // nowUsec() of the write
+    };
+
+    static size_t recordSize(size_t n) {
+        return (sizeof(Record) + n + 7) & ~(size_t) 7;
+    }
+
+    /* written by the producer only */
+    struct ProducerStats {
+        uint64_t writeMsgs,    writeBytes;
+        uint64_t evictMsgs,    evictBytes;      // dropped from the full ring
+        uint64_t spillMsgs,    spillBytes;      // moved to the Spill tier
+        uint64_t oversizeMsgs, oversizeBytes;   // larger than the ring
+        uint64_t stageMsgs,    stageBytes;      // dropped by a full stage ring
+        uint64_t rotateMsgs;                    // kept by BySeverity or BySender
+        uint64_t highWater;                     // most bytes ever queued
+    };
+
+    /* written by the consumer only, Spill::commit() fills it too */
+    struct ConsumerStats {
+        uint64_t  commitMsgs, commitBytes;
+        Histogram latency;                      // usec, write to commit
+
+        void add(const Record &rec, uint64_t now) {
+            statAdd(&commitMsgs);
+            statAdd(&commitBytes, rec.len);
+            latency.add(now > rec.stamp ? now - rec.stamp : 0);
+        }
+    };
 
 private:
-    bool ensureSpace(size_t n, bool *droped = 0);
-    bool notify() const;
+    static const uint64_t Claimed   = 1ULL << 63;
+    static const size_t   cacheline = 64;
+    static const size_t   pagesize  = 4096;
+    static const size_t   rotateFactor = 4;
+
+    /* the first page of a spool file, head, tail and the cursors are
+     * the live values and each sit on their own cache line.
+     */
+    struct Control {
+        char     magic[8];
+        uint64_t size;
+        uint64_t seq;            // of the next record
+        uint64_t ncursor;        // cursors in use
+        char     pad0[cacheline - 32];
+
+        uint64_t head;           // written by the producer
+        char     pad1[cacheline - sizeof(uint64_t)];
+
+        uint64_t tail;           // by the producer, the oldest cursor
+        char     pad2[cacheline - sizeof(uint64_t)];
+
+        struct {
+            uint64_t pos;        // by its consumer, and the producer when it drops
+            char     pad[cacheline - sizeof(uint64_t)];
+        } cursor[maxConsumers];
+    };
+
+    bool ensureSpace(uint64_t *head, size_t n);
+    uint64_t reclaim();
+    bool skipTo(Consumer *c, uint64_t end);
+    bool rotateOldest(uint64_t *head, const Record &rec);
+    bool lessImportant(const Record &rec) const;
+    bool withinShare(const Record &rec) const;
+    void account(const Record &rec, bool add);
+    void countRecords(uint64_t from, uint64_t to, bool add);
+    uint64_t publish(uint64_t head);
+
+    void copyIn(uint64_t pos, const void *data, size_t n);
+    void copyOut(void *data, uint64_t pos, size_t n) const;
+
+    bool openSpool(const char *spool, size_t size);
+    bool recover();
+    bool validRecord(uint64_t pos, uint64_t seq, uint64_t tail) const;
+
+    bool spillOldest(uint64_t tail, uint64_t head, size_t n);
+
+    void wakeup();
 
 private:
-    size_t size_;
-    char *buffer_;
+    size_t   size_;
+    char    *buffer_;
+    bool     locked_;
+    Control *ctl_;
+    uint64_t seq_;
+
+    int    spoolfd_;
+    char  *spool_;
+    size_t nspool_;
+    char   pad0_[cacheline];
+
+    ProducerStats pstats_;
+    char          pad1_[cacheline];
+
+    Consumer *consumers_[maxConsumers];
+    size_t    nconsumer_;
+    uint64_t  evictSeq_;         // the last record counted as evicted
+
+    Spill   *spill_;
+    uint32_t routes_[nroute];
+    const Router *router_;
 
-    std::deque< std::pair<size_t, size_t> > queue_;
+    /* BySeverity and BySender state, bytes queued in the ring per
+     * severity or sender slot, the producer keeps it as tail moves.
+     */
+    bool     bySeverity_;
+    size_t   sevBytes_[8];
+    bool     bySender_;
+    size_t   senderBytes_[nsender];
+    size_t   senders_;           // slots with bytes queued
+    size_t   usedBytes_;
+    char    *scratch_;
+    size_t   nscratch_;
 
     pthread_mutex_t mutex_;
-    pthread_cond_t  cond_;
-    bool            quit_;
+    volatile bool   quit_;
+
+    /* producer private, the loss reported so far */
+    int      reportms_;
+    uint64_t nextReport_;
+    uint64_t lastReport_;
+    uint64_t reportMsgs_;
+    uint64_t reportBytes_;
 
     bool verbose_;
-    const char *notifyf_;
+    bool readBorder_;
+};
+
+/* a destination's view of the ring, its own cursor, claim and wakeup.
+ * the calls are those of RingBuffer, a consumer has one thread.
+ */
+class RingBuffer::Consumer {
+public:
+    size_t read(char *buffer, size_t n);
+    size_t peek(struct iovec *iov, size_t *niov, size_t n);
+    bool commit();
+    bool rollback();
+
+    size_t peekRecords(struct iovec *iov, size_t nrecord, size_t n);
+    bool commit(size_t nrecord);
+    bool waitMore(int timeout);
+    bool ready(int timeout);
+
+    /* whether rec is routed to this consumer */
+    bool routed(const Record &rec) const {
+        return ring_->routes_[msgRoute(rec.flags)] & bit_;
+    }
+
+    /* prefix_commit_msgs and so on, the lag and what was skipped */
+    void dumpStats(FILE *fp, const char *prefix) const;
+
+    static const size_t nbuffer = RingBuffer::nbuffer;
+
+private:
+    friend class RingBuffer;
+
+    Consumer(RingBuffer *ring, size_t index, bool required, uint64_t pos);
+    ~Consumer();
+
+    uint64_t claim();
+    size_t claimRecords(struct iovec *iov, size_t *niov, size_t n,
+                        bool paired, size_t *nrecord);
+    uint64_t release(uint64_t from, uint64_t to, size_t nrecord);
+    bool hasData(bool more) const;
+    bool waitData(int timeout = -1, bool more = false);
+    void wakeup();
+
+private:
+    RingBuffer *ring_;
+    uint32_t    bit_;            // in the routes
+    uint64_t   *pos_;            // in the control block
+    bool        required_;
+    Spill      *spill_;          // the first consumer drains it
+
+    int         idle_;
+    char        pad0_[cacheline - sizeof(int)];
+
+    ConsumerStats stats_;
+    char          pad1_[cacheline];
+
+    /* written by the producer when it moves the cursor past records */
+    uint64_t    skipMsgs_;
+    uint64_t    skipBytes_;
+    char        pad2_[cacheline];
+
+    /* consumer private, the claimed range [claimStart_, claimEnd_) */
+    uint64_t    claimStart_;
+    uint64_t    claimEnd_;
+    bool        fromSpill_;
+    int         efd_;
 };
 
 #endif
@@ -0,0 +1,203 @@
+/* vim:expandtab:shiftwidth=4:tabstop=4:smarttab:
+ */
+
+#include <cstring>
+#include <cstdlib>
+#include <errno.h>
+#include <router.h>
+
+static const char *facilityNames[] = {
+    "kern", "user", "mail", "daemon", "auth", "syslog", "lpr", "news",
+    "uucp", "cron", "authpriv", "ftp", "ntp", "security", "console", "clock",
+    "local0", "local1", "local2", "local3", "local4", "local5", "local6", "local7",
+};
+
+static const char *severityNames[] = {
+    "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug",
+};
+
+static int lookup(const char **names, size_t n, const char *name, size_t len)
+{
+    for (size_t i = 0; i < n; ++i) {
+        if (strlen(names[i]) == len && memcmp(names[i], name, len) == 0) return i;
+    }
+    return -1;
+}
+
+Router::Router(const char *path, const char * const *dests, size_t ndest)
+{
+    ntag_     = 0;
+    masks_[0] = ~(uint32_t) 0;
+    nroute_   = 1;
+
+    Node root;
+    memset(&root, 0x00, sizeof(root));
+    nodes_.push_back(root);
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "fopen(%s) error, %d:%s\n", path, errno, strerror(errno));
+        throw errno;
+    }
+
+    char line[1024];
+    int  lineno = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), fp)) {
+        ++lineno;
+        ok = parseLine(line, dests, ndest);
+        if (!ok) fprintf(stderr, "%s:%d: bad rule\n", path, lineno);
+    }
+    fclose(fp);
+    if (!ok) throw EINVAL;
+
+    compile();
+}
+
+/* "selector tag dest..." or "selector tag discard" */
+bool Router::parseLine(char *line, const char * const *dests, size_t ndest)
+{
+    char *save, *sel, *tag, *dest;
+    char *hash = strchr(line, '#');
+    if (hash) *hash = '\0';
+
+    if ((sel = strtok_r(line, " \t\r\n", &save)) == 0) return true;
+    if ((tag = strtok_r(0, " \t\r\n", &save)) == 0) return false;
+
+    Rule rule;
+    if (!parseSelector(sel, &rule)) return false;
+
+    uint32_t mask = 0;
+    size_t nword = 0;
+    for (; (dest = strtok_r(0, " \t\r\n", &save)) != 0; ++nword) {
+        if (strcmp(dest, "discard") == 0) continue;
+
+        size_t i = 0;
+        while (i < ndest && strcmp(dests[i], dest) != 0) ++i;
+        if (i == ndest) {
+            fprintf(stderr, "%s is not a -d or -a\n", dest);
+            return false;
+        }
+        mask |= 1u << i;
+    }
+    if (nword == 0) return false;
+
+    int route = routeOf(mask);
+    if (route < 0) return false;
+    rule.route = route;
+
+    rule.tagged = strcmp(tag, "*") != 0;
+    if (rule.tagged) {
+        if (ntag_ == maxTagRules) {
+            fprintf(stderr, "at most %lu rules with a tag\n", (unsigned long) maxTagRules);
+            return false;
+        }
+        if (!addTag(tag, ntag_)) return false;
+        tagRoutes_[ntag_++] = rule.route;
+    }
+
+    rules_.push_back(rule);
+    return true;
+}
+
+/* "fac[,fac...].sev", * for any facility or severity, =sev for just sev */
+bool Router::parseSelector(const char *sel, Rule *rule)
+{
+    const char *dot = strrchr(sel, '.');
+    if (!dot) return false;
+
+    rule->facilities = 0;
+    for (const char *p = sel; p < dot; ) {
+        const char *end = (const char *) memchr(p, ',', dot - p);
+        if (!end) end = dot;
+
+        if (end - p == 1 && *p == '*') {
+            rule->facilities = ~(uint32_t) 0;
+        } else {
+            int fac = lookup(facilityNames, npri >> 3, p, end - p);
+            if (fac < 0) return false;
+            rule->facilities |= 1u << fac;
+        }
+        p = end < dot ? end + 1 : dot;
+    }
+    if (!rule->facilities) return false;
+
+    const char *sev = dot + 1;
+    bool exact = (*sev == '=');
+    if (exact) ++sev;
+
+    if (!exact && strcmp(sev, "*") == 0) {
+        rule->severities = 0xff;
+        return true;
+    }
+
+    int n = lookup(severityNames, 8, sev, strlen(sev));
+    if (n < 0) return false;
+    rule->severities = exact ? 1 << n : (2 << n) - 1;
+    return true;
+}
+
+/* a trailing * makes the tag a prefix */
+bool Router::addTag(const char *tag, size_t bit)
+{
+    size_t len = strlen(tag);
+    bool prefix = (tag[len-1] == '*');
+    if (prefix) --len;
+    if (len > 32) return false;
+
+    int node = 0;
+    for (size_t i = 0; i < len; ++i) {
+        int child = nodes_[node].child;
+        while (child && nodes_[child].c != tag[i]) child = nodes_[child].next;
+
+        if (!child) {
+            Node n;
+            memset(&n, 0x00, sizeof(n));
+            n.c    = tag[i];
+            n.next = nodes_[node].child;
+            child  = nodes_.size();
+            nodes_.push_back(n);
+            nodes_[node].child = child;
+        }
+        node = child;
+    }
+
+    if (prefix) nodes_[node].prefix |= 1ULL << bit;
+    else nodes_[node].exact |= 1ULL << bit;
+    return true;
+}
+
+/* the number of a set of dests, the same set shares it */
+int Router::routeOf(uint32_t mask)
+{
+    for (size_t i = 0; i < nroute_; ++i) {
+        if (masks_[i] == mask) return i;
+    }
+    if (nroute_ == (size_t) nroute) return -1;
+
+    masks_[nroute_] = mask;
+    return nroute_++;
+}
+
+void Router::compile()
+{
+    for (size_t pri = 0; pri < npri; ++pri) {
+        cells_[pri]    = 0;
+        cellTags_[pri] = 0;
+
+        size_t tagbit = 0;
+        for (size_t i = 0; i < rules_.size(); ++i) {
+            const Rule &rule = rules_[i];
+            bool match = (rule.facilities & (1u << (pri >> 3))) &&
+                         (rule.severities & (1u << (pri & 7)));
+
+            if (rule.tagged) {
+                if (match) cellTags_[pri] |= 1ULL << tagbit;
+                ++tagbit;
+            } else if (match) {
+                cells_[pri] = rule.route;
+                break;
+            }
+        }
+    }
+}
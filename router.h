@@ -0,0 +1,124 @@
+/* vim:expandtab:shiftwidth=4:tabstop=4:smarttab:
+ */
+
+#ifndef _ROUTER_H_
+#define _ROUTER_H_
+
+#include <cstdio>
+#include <stdint.h>
+#include <vector>
+#include <syslogmsg.h>
+
+/* which dests a message goes to, by its facility, severity and TAG. a
+ * rules file has one rule a line, the first rule that matches decides,
+ * a message no rule matches goes to every dest.
+ *
+ *     # selector          tag     dests, or discard
+ *     auth,authpriv.*     *       /dev/audit
+ *     *.*                 sudo    /dev/audit
+ *     *.=debug            *       discard
+ *     *.*                 *       /dev/xlog
+ *
+ * a selector is facilities (or *) and a severity, "info" is info and
+ * more important, "=info" info only, "*" any. a tag is the TAG itself,
+ * "kube*" a TAG that starts with kube, "*" any. a dest is a -d or -a.
+ *
+ * the rules are compiled once. each of the 192 PRIs gets the route of
+ * the first rule without a tag it matches, and the tag rules before
+ * that one as a bitmap. only a PRI with tag rules has its TAG parsed,
+ * a trie of the tags gives the tag rules the TAG matches, the lowest
+ * bit of both bitmaps is the rule that decides.
+ *
+ * a route is a set of dests, the distinct sets are numbered, route 0 is
+ * every dest. the reader keeps the number in the record flags, each
+ * dest passes over the records whose route leaves it out.
+ */
+class Router {
+public:
+    /* dests are the -d and then the -a dests, in consumer order */
+    Router(const char *path, const char * const *dests, size_t ndest);
+
+    /* false if msg is discarded, else its route joins *flags */
+    bool route(const char *msg, size_t n, uint32_t *flags) const;
+
+    /* route i as a bitmap of consumers, 0 is discard */
+    size_t routes() const { return nroute_; }
+    uint32_t consumers(size_t i) const { return masks_[i]; }
+
+    static const size_t maxTagRules = 64;
+    static const size_t npri        = 192;
+
+private:
+    struct Rule {
+        uint32_t facilities;     // bit per facility
+        uint8_t  severities;     // bit per severity
+        bool     tagged;
+        uint8_t  route;
+    };
+
+    /* first child and next sibling, exact and prefix are the tag rules
+     * whose tag ends here.
+     */
+    struct Node {
+        char     c;
+        int      child;
+        int      next;
+        uint64_t exact;
+        uint64_t prefix;
+    };
+
+    bool parseLine(char *line, const char * const *dests, size_t ndest);
+    bool parseSelector(const char *sel, Rule *rule);
+    bool addTag(const char *tag, size_t bit);
+    uint64_t tagRules(const char *tag, size_t len) const;
+    int routeOf(uint32_t mask);
+    void compile();
+
+private:
+    std::vector<Rule> rules_;
+    std::vector<Node> nodes_;
+    uint8_t  tagRoutes_[maxTagRules];
+    size_t   ntag_;
+
+    uint32_t masks_[nroute];
+    size_t   nroute_;
+
+    /* the decision table */
+    uint8_t  cells_[npri];
+    uint64_t cellTags_[npri];
+};
+
+inline bool Router::route(const char *msg, size_t n, uint32_t *flags) const
+{
+    uint32_t pri   = *flags & MsgPriMask;
+    uint8_t  route = cells_[pri];
+
+    uint64_t rules = cellTags_[pri];
+    if (rules) {
+        size_t len;
+        const char *tag = parseTag(msg, n, &len);
+        rules &= tagRules(tag, len);
+        if (rules) route = tagRoutes_[__builtin_ctzll(rules)];
+    }
+
+    if (masks_[route] == 0) return false;
+    *flags |= (uint32_t) route << msgRouteShift;
+    return true;
+}
+
+inline uint64_t Router::tagRules(const char *tag, size_t len) const
+{
+    int node = 0;
+    uint64_t rules = nodes_[0].prefix;
+    for (size_t i = 0; i < len; ++i) {
+        int child = nodes_[node].child;
+        while (child && nodes_[child].c != tag[i]) child = nodes_[child].next;
+        if (!child) return rules;
+
+        node   = child;
+        rules |= nodes_[node].prefix;
+    }
+    return rules | nodes_[node].exact;
+}
+
+#endif
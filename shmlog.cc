@@ -0,0 +1,325 @@
+/* vim:expandtab:shiftwidth=4:tabstop=4:smarttab:
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <shmring.h>
+#include <shmlog.h>
+
+/* the ring of this process, writes hold mutex, a fork()ed child
+ * forgets it, the parent stays the only producer.
+ */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static ShmRing *ring    = 0;
+static size_t   maplen  = 0;
+static int      conn    = -1;
+static int      bell    = -1;
+static bool     atfork  = false;
+
+/* a ring shmlogOpenNonblock() handed over, waiting for the eventfd */
+static ShmRing *pendRing = 0;
+static size_t   pendLen  = 0;
+static int      pendConn = -1;
+
+static void dropPending()
+{
+    if (pendRing) munmap(pendRing, pendLen);
+    if (pendConn != -1) close(pendConn);
+    pendRing = 0;
+    pendConn = -1;
+}
+
+static void forget()
+{
+    if (ring) munmap(ring, maplen);
+    if (conn != -1) close(conn);
+    if (bell != -1) close(bell);
+    ring = 0;
+    conn = bell = -1;
+    dropPending();
+}
+
+static void forkChild()
+{
+    pthread_mutex_init(&mutex, 0);
+    forget();
+}
+
+static size_t ringSize(size_t size)
+{
+    if (size == 0) size = 1024 * 1024;
+    if (size < shmMinSize) size = shmMinSize;
+    if (size > shmMaxSize) size = shmMaxSize;
+
+    size_t n = shmMinSize;
+    while (n < size) n *= 2;
+    return n;
+}
+
+/* a nonblock socket never waits, a full backlog fails the connect */
+static int connectTo(const char *path, bool nonblock)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | (nonblock ? SOCK_NONBLOCK : 0), 0);
+    if (fd == -1) return -1;
+
+    struct sockaddr_un un;
+    memset(&un, 0x00, sizeof(un));
+    un.sun_family = AF_UNIX;
+    strncpy(un.sun_path, path, sizeof(un.sun_path) - 1);
+
+    if (!nonblock) {
+        struct timeval tv = { 1, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+
+    if (connect(fd, (struct sockaddr *) &un, sizeof(un)) != 0) {
+        int eno = errno;
+        close(fd);
+        errno = eno;
+        return -1;
+    }
+    return fd;
+}
+
+/* the memfd goes to syslog-safer */
+static int sendRing(int fd, int mfd)
+{
+    char byte = 'S';
+    struct iovec iov = { &byte, 1 };
+
+    union {
+        struct cmsghdr hdr;
+        char           buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    memset(ctl.buf, 0x00, sizeof(ctl.buf));
+
+    struct msghdr msg;
+    memset(&msg, 0x00, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &mfd, sizeof(int));
+
+    return sendmsg(fd, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+/* the eventfd comes back, -1 and EAGAIN if it is not there yet on a
+ * nonblock socket or in time on a blocking one.
+ */
+static int receiveBell(int fd)
+{
+    char byte;
+    struct iovec iov = { &byte, 1 };
+
+    union {
+        struct cmsghdr hdr;
+        char           buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    memset(ctl.buf, 0x00, sizeof(ctl.buf));
+
+    struct msghdr msg;
+    memset(&msg, 0x00, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n != 1) {
+        if (n == 0) errno = ECONNREFUSED;
+        return -1;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    int efd;
+    memcpy(&efd, CMSG_DATA(cmsg), sizeof(int));
+    return efd;
+}
+
+/* a sealed memfd of the ring, mapped, mfd is to be sent and closed */
+static ShmRing *createRing(size_t size, int *mfd, size_t *len)
+{
+    size = ringSize(size);
+    *len = sizeof(ShmRing) + size;
+
+    *mfd = memfd_create("syslog-safer", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (*mfd == -1) return 0;
+
+    /* syslog-safer maps only a memfd that can not shrink */
+    void *addr = MAP_FAILED;
+    if (ftruncate(*mfd, *len) == 0 &&
+        fcntl(*mfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == 0) {
+        addr = mmap(0, *len, PROT_READ | PROT_WRITE, MAP_SHARED, *mfd, 0);
+    }
+    if (addr == MAP_FAILED) {
+        int eno = errno;
+        close(*mfd);
+        errno = eno;
+        return 0;
+    }
+
+    ShmRing *r = (ShmRing *) addr;
+    r->magic = SHM_RING_MAGIC;
+    r->size  = size;
+    return r;
+}
+
+/* called with the lock held */
+static void install(ShmRing *r, size_t len, int fd, int efd)
+{
+    forget();
+    ring   = r;
+    maplen = len;
+    conn   = fd;
+    bell   = efd;
+    if (!atfork) atfork = pthread_atfork(0, 0, forkChild) == 0;
+}
+
+int shmlogOpen(const char *path, size_t size)
+{
+    int mfd;
+    size_t len;
+    ShmRing *r = createRing(size, &mfd, &len);
+    if (!r) return -1;
+
+    int fd = connectTo(path, false), efd = -1;
+    if (fd != -1 && sendRing(fd, mfd) == 0) {
+        efd = receiveBell(fd);
+        if (efd == -1 && errno == EAGAIN) errno = ECONNREFUSED;
+    }
+
+    int eno = errno;
+    close(mfd);
+    if (efd == -1) {
+        if (fd != -1) close(fd);
+        munmap(r, len);
+        errno = eno;
+        return -1;
+    }
+
+    pthread_mutex_lock(&mutex);
+    install(r, len, fd, efd);
+    pthread_mutex_unlock(&mutex);
+    return 0;
+}
+
+int shmlogOpenNonblock(const char *path, size_t size)
+{
+    pthread_mutex_lock(&mutex);
+    if (pendConn == -1) {
+        int mfd;
+        size_t len;
+        ShmRing *r = createRing(size, &mfd, &len);
+        if (!r) {
+            pthread_mutex_unlock(&mutex);
+            return -1;
+        }
+
+        int fd = connectTo(path, true);
+        int rc = (fd != -1) ? sendRing(fd, mfd) : -1;
+
+        int eno = errno;
+        close(mfd);
+        if (rc == -1) {
+            if (fd != -1) close(fd);
+            munmap(r, len);
+            pthread_mutex_unlock(&mutex);
+            errno = (eno == EAGAIN) ? ECONNREFUSED : eno;
+            return -1;
+        }
+        pendRing = r;
+        pendLen  = len;
+        pendConn = fd;
+    }
+
+    int efd = receiveBell(pendConn);
+    if (efd == -1) {
+        int eno = (errno == EAGAIN) ? EINPROGRESS : errno;
+        if (eno != EINPROGRESS) dropPending();
+        pthread_mutex_unlock(&mutex);
+        errno = eno;
+        return -1;
+    }
+
+    ShmRing *r = pendRing;
+    int fd = pendConn;
+    pendRing = 0;
+    pendConn = -1;
+    install(r, pendLen, fd, efd);
+    pthread_mutex_unlock(&mutex);
+    return 0;
+}
+
+int shmlogWrite(const char *msg, size_t n)
+{
+    if (n > shmMaxMsg) n = shmMaxMsg;
+    uint32_t slot = shmSlot(n);
+
+    pthread_mutex_lock(&mutex);
+    if (!ring) {
+        pthread_mutex_unlock(&mutex);
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    uint32_t off  = head & (ring->size - 1);
+    uint32_t skip = (ring->size - off < slot) ? ring->size - off : 0;
+
+    if (head + skip + slot - tail > ring->size) {
+        __atomic_add_fetch(&ring->drops, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&mutex);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (skip) {
+        *(uint32_t *) (ring->data + off) = shmPad;
+        head += skip;
+        off   = 0;
+    }
+    uint32_t len = n;
+    memcpy(ring->data + off, &len, sizeof(len));
+    memcpy(ring->data + off + sizeof(len), msg, n);
+    __atomic_store_n(&ring->head, head + slot, __ATOMIC_RELEASE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->waiting, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&ring->waiting, 0, __ATOMIC_ACQ_REL)) {
+        uint64_t one = 1;
+        ssize_t nn = write(bell, &one, sizeof(one));
+        (void) nn;
+    }
+    pthread_mutex_unlock(&mutex);
+    return 0;
+}
+
+void shmlogClose(void)
+{
+    pthread_mutex_lock(&mutex);
+    forget();
+    pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,48 @@
+/* vim:expandtab:shiftwidth=4:tabstop=4:smarttab:
+ */
+
+#ifndef _SHMLOG_H_
+#define _SHMLOG_H_
+
+#include <stddef.h>
+
+/* log to syslog-safer through shared memory, no syscall per message
+ * while syslog-safer is busy, one eventfd write to wake it up when it
+ * is not. a message is what would go to /dev/log, "<PRI>...".
+ *
+ *   shmlogOpen("/dev/log.shm", 0);
+ *   shmlogWrite(msg, n);
+ *
+ * every call is thread safe, a fork()ed child has to open its own.
+ * link with libshmlog.a and -lpthread.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* path is the -u socket of syslog-safer, size of the ring is rounded
+ * up to a power of 2, 0 is 1M. returns 0 or -1 and errno.
+ */
+int shmlogOpen(const char *path, size_t size);
+
+/* shmlogOpen() that never waits, for a caller on its logging path: the
+ * first call connects and hands the ring over, it and the calls after
+ * return -1 and EINPROGRESS until syslog-safer's answer is there, 0
+ * then. any other errno ends the attempt, the next call starts anew.
+ */
+int shmlogOpenNonblock(const char *path, size_t size);
+
+/* 0 when the message is in the ring, -1 and errno ENOTCONN if nothing
+ * is open or EAGAIN if the ring is full, the message is dropped then
+ * and syslog-safer counts it, the caller may send it to /dev/log.
+ */
+int shmlogWrite(const char *msg, size_t n);
+
+void shmlogClose(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,61 @@
+/* vim:expandtab:shiftwidth=4:tabstop=4:smarttab:
+ */
+
+#ifndef _SHMRING_H_
+#define _SHMRING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* a process logs into a ring in its own shared memory, syslog-safer
+ * maps it and drains it. the client passes the memfd over the unix
+ * socket of -u with SCM_RIGHTS, syslog-safer answers with the eventfd
+ * the clients ring when it sleeps, and keeps the connection to learn
+ * when the process is gone.
+ *
+ * one producer per ring, the client library serializes its threads,
+ * syslog-safer is the consumer. head and tail count bytes ever written
+ * and consumed. a record is a uint32_t length and the message, padded
+ * to 8 bytes, one that would wrap leaves a shmPad marker behind and
+ * starts at data[0]. a record is never cut, a full ring drops it.
+ *
+ * the consumer sets waiting before it sleeps and looks at head once
+ * more, the producer publishes head and looks at waiting, one of the
+ * two always sees the other (a full fence on both sides).
+ */
+
+#define SHM_RING_MAGIC 0x31474e5252464153ULL    /* "SAFRRNG1" */
+
+typedef struct {
+    uint64_t magic;
+    uint32_t size;               /* of data, a power of 2 */
+    uint32_t pad0;
+    char     pad1[48];
+
+    /* the producer */
+    uint64_t head;
+    uint64_t drops;              /* records the full ring refused */
+    char     pad2[48];
+
+    /* the consumer */
+    uint64_t tail;
+    uint32_t waiting;
+    uint32_t pad3;
+    char     pad4[48];
+
+    char     data[];
+} ShmRing;
+
+enum {
+    shmPad     = 0xffffffffU,
+    shmMaxMsg  = 16384,          /* RingBuffer::nbuffer, a longer one is cut */
+    shmMinSize = 64 * 1024,
+    shmMaxSize = 64 * 1024 * 1024,
+};
+
+static inline uint32_t shmSlot(uint32_t len)
+{
+    return (sizeof(uint32_t) + len + 7) & ~7U;
+}
+
+#endif
@@ -0,0 +1,517 @@
+/* vim:expandtab:shiftwidth=4:tabstop=4:smarttab:
+ */
+
+#include <cstdlib>
+#include <algorithm>
+#include <vector>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <ringbuffer.h>
+#include <spill.h>
+#include <lz.h>
+
+static const uint32_t chunkMagic = 0x334c5053;   // "SPL3"
+static const char zeros[4096] = { 0 };
+
+Spill::Spill(const char *dir, size_t quota, bool readBorder)
+{
+    int eno = pthread_mutex_init(&mutex_, 0);
+    if (eno == 0) eno = pthread_cond_init(&work_, 0);
+    if (eno == 0) eno = pthread_cond_init(&room_, 0);
+    if (eno != 0) throw eno;
+
+    dir_ = dir ? strdup(dir) : 0;
+    if (dir && !dir_) throw errno;
+
+    quota_       = quota;
+    segmentSize_ = quota / 16 < 64 * chunkSize ? quota / 16 : 64 * chunkSize;
+    readBorder_ = readBorder;
+    used_       = 0;
+    nextId_     = 0;
+    pending_    = 0;
+    routes_     = 0;
+    quit_       = false;
+    dropMsgs_   = 0;
+    dropBytes_  = 0;
+
+    chunk_       = 0;
+    nchunk_      = 0;
+    pos_         = 0;
+    claimEnd_    = 0;
+    claimRecord_ = 0;
+    readId_      = 0;
+    readOff_     = 0;
+
+    /* memory, nothing left by a previous run */
+    if (dir_) {
+        if (mkdir(dir_, 0700) != 0 && errno != EEXIST) {
+            fprintf(stderr, "mkdir(%s) error, %d:%s\n", dir_, errno, strerror(errno));
+            throw errno;
+        }
+        if (!scan()) throw errno;
+    }
+
+    eno = pthread_create(&writer_, 0, writeRoutine, this);
+    if (eno != 0) {
+        fprintf(stderr, "pthread_create() error, %d:%s\n", eno, strerror(eno));
+        throw eno;
+    }
+}
+
+/* the writer stores what is queued before it quits, a disk tier
+ * finds it on the next start.
+ */
+Spill::~Spill()
+{
+    pthread_mutex_lock(&mutex_);
+    quit_ = true;
+    pthread_cond_signal(&work_);
+    pthread_mutex_unlock(&mutex_);
+    pthread_join(writer_, 0);
+
+    for (size_t i = 0; i < segments_.size(); ++i) {
+        if (segments_[i].fd != -1) close(segments_[i].fd);
+        free(segments_[i].data);
+    }
+    pthread_cond_destroy(&room_);
+    pthread_cond_destroy(&work_);
+    pthread_mutex_destroy(&mutex_);
+    free(chunk_);
+    free(dir_);
+}
+
+/* segments of a previous run, a chunk cut short by a crash ends its segment */
+bool Spill::scan()
+{
+    DIR *dp = opendir(dir_);
+    if (!dp) {
+        fprintf(stderr, "opendir(%s) error, %d:%s\n", dir_, errno, strerror(errno));
+        return false;
+    }
+
+    std::vector<uint64_t> ids;
+    struct dirent *de;
+    while ((de = readdir(dp)) != 0) {
+        unsigned long long id;
+        char c;
+        if (sscanf(de->d_name, "spill.%llx%c", &id, &c) == 1) ids.push_back(id);
+    }
+    closedir(dp);
+    std::sort(ids.begin(), ids.end());
+
+    for (size_t i = 0; i < ids.size(); ++i) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/spill.%016llx", dir_, (unsigned long long) ids[i]);
+
+        Segment seg;
+        seg.id      = ids[i];
+        seg.size    = 0;
+        seg.nrecord = 0;
+        seg.payload = 0;
+        seg.data    = 0;
+        seg.fd      = open(path, O_RDWR | O_APPEND);
+        if (seg.fd == -1) continue;
+
+        Chunk ck;
+        while (pread(seg.fd, &ck, sizeof(ck), seg.size) == (ssize_t) sizeof(ck) &&
+               ck.magic == chunkMagic) {
+            struct stat st;
+            size_t next = seg.size + alignPage(sizeof(ck) + ck.bytes);
+            if (fstat(seg.fd, &st) != 0 || (size_t) st.st_size < next) break;
+
+            seg.size     = next;
+            seg.nrecord += ck.nrecord;
+            seg.payload += ck.payload;
+        }
+
+        if (seg.nrecord == 0 || ftruncate(seg.fd, seg.size) != 0) {
+            close(seg.fd);
+            unlink(path);
+            continue;
+        }
+
+        segments_.push_back(seg);
+        used_    += seg.size;
+        pending_ += seg.nrecord;
+        nextId_   = seg.id + 1;
+    }
+
+    if (pending_) {
+        fprintf(stderr, "spill %s recovered %lu records, %lu bytes\n", dir_,
+                (unsigned long) pending_, (unsigned long) used_);
+    }
+    return true;
+}
+
+bool Spill::openSegment()
+{
+    Segment seg;
+    seg.id      = nextId_;
+    seg.fd      = -1;
+    seg.size    = 0;
+    seg.nrecord = 0;
+    seg.payload = 0;
+    seg.data    = 0;
+
+    if (!dir_) {
+        segments_.push_back(seg);
+        ++nextId_;
+        return true;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/spill.%016llx", dir_, (unsigned long long) nextId_);
+
+    seg.fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_TRUNC, 0600);
+    if (seg.fd == -1) {
+        fprintf(stderr, "open(%s) error, %d:%s\n", path, errno, strerror(errno));
+        return false;
+    }
+
+    segments_.push_back(seg);
+    ++nextId_;
+    return true;
+}
+
+/* called with the lock held, the records of the consumer's loaded
+ * chunk are not counted in the segment any more, it keeps draining them.
+ */
+void Spill::dropSegment()
+{
+    Segment &seg = segments_.front();
+
+    if (dir_) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/spill.%016llx", dir_, (unsigned long long) seg.id);
+        unlink(path);
+        close(seg.fd);
+    } else {
+        free(seg.data);
+    }
+
+    statAdd(&dropMsgs_, seg.nrecord);
+    statAdd(&dropBytes_, seg.payload);
+
+    __atomic_sub_fetch(&pending_, seg.nrecord, __ATOMIC_SEQ_CST);
+    used_ -= seg.size;
+    segments_.pop_front();
+}
+
+/* called with the lock held, a queued chunk that can not be stored */
+void Spill::dropChunk(const Chunk &ck)
+{
+    statAdd(&dropMsgs_, ck.nrecord);
+    statAdd(&dropBytes_, ck.payload);
+    __atomic_sub_fetch(&pending_, ck.nrecord, __ATOMIC_SEQ_CST);
+}
+
+bool Spill::append(const struct iovec *iov, size_t niov, size_t nrecord, size_t nbytes)
+{
+    Queued q;
+    q.ck.magic   = chunkMagic;
+    q.ck.nrecord = nrecord;
+    q.ck.bytes   = 0;
+    q.ck.payload = nbytes;
+    q.busy       = false;
+    for (size_t i = 0; i < niov; ++i) q.ck.bytes += iov[i].iov_len;
+
+    /* the records leave the ring now, a wrapped chunk in one piece */
+    q.data = (char *) malloc(q.ck.bytes ? q.ck.bytes : 1);
+    if (q.data) {
+        size_t off = 0;
+        for (size_t i = 0; i < niov; ++i) {
+            memcpy(q.data + off, iov[i].iov_base, iov[i].iov_len);
+            off += iov[i].iov_len;
+        }
+    }
+
+    pthread_mutex_lock(&mutex_);
+    if (!q.data) {
+        statAdd(&dropMsgs_, nrecord);
+        statAdd(&dropBytes_, nbytes);
+        pthread_mutex_unlock(&mutex_);
+        return false;
+    }
+
+    while (queue_.size() >= maxQueued) pthread_cond_wait(&room_, &mutex_);
+    queue_.push_back(q);
+    __atomic_add_fetch(&pending_, nrecord, __ATOMIC_SEQ_CST);
+    pthread_cond_signal(&work_);
+    pthread_mutex_unlock(&mutex_);
+    return true;
+}
+
+void *Spill::writeRoutine(void *data)
+{
+    ((Spill *) data)->writeOut();
+    return 0;
+}
+
+/* the oldest queued chunk stays queued while it is stored, the consumer
+ * finds it in a segment or not at all.
+ */
+void Spill::writeOut()
+{
+    pthread_mutex_lock(&mutex_);
+    while (true) {
+        while (queue_.empty() && !quit_) pthread_cond_wait(&work_, &mutex_);
+        if (queue_.empty()) break;
+
+        Queued &q = queue_.front();
+        q.busy = true;
+        Chunk ck   = q.ck;
+        char *data = q.data;
+        pthread_mutex_unlock(&mutex_);
+
+        bool ok = store(ck, data);
+
+        pthread_mutex_lock(&mutex_);
+        if (!ok) dropChunk(ck);
+        queue_.pop_front();
+        free(data);
+        pthread_cond_signal(&room_);
+    }
+    pthread_mutex_unlock(&mutex_);
+}
+
+/* called by the writer without the lock, the chunk goes to the newest
+ * segment, over quota the oldest are dropped first. only the writer
+ * adds segments and the consumer drops none but the last, so the
+ * newest is there while it is written without the lock.
+ */
+bool Spill::store(const Chunk &ck, const char *data)
+{
+    size_t total = alignPage(sizeof(ck) + ck.bytes);
+    char *packed = 0;
+    if (!dir_ && (packed = pack(data, ck, &total)) == 0) return false;
+
+    pthread_mutex_lock(&mutex_);
+
+    while (!segments_.empty() && used_ + total > quota_) dropSegment();
+
+    bool ok = (total <= quota_);
+    if (ok && (segments_.empty() || !dir_ || segments_.back().size >= segmentSize_)) {
+        ok = openSegment();
+    }
+
+    if (ok && !dir_) {
+        Segment &seg = segments_.back();
+        seg.data     = packed;
+        seg.size     = total;
+        seg.nrecord  = ck.nrecord;
+        seg.payload  = ck.payload;
+        used_       += total;
+        packed       = 0;
+    }
+
+    int fd = ok ? segments_.back().fd : -1;
+    size_t size = ok ? segments_.back().size : 0;
+    pthread_mutex_unlock(&mutex_);
+    free(packed);
+
+    if (!ok || !dir_) return ok;
+
+    struct iovec iov[3];
+    iov[0].iov_base = (void *) &ck;
+    iov[0].iov_len  = sizeof(ck);
+    iov[1].iov_base = (void *) data;
+    iov[1].iov_len  = ck.bytes;
+    iov[2].iov_base = (void *) zeros;
+    iov[2].iov_len  = total - sizeof(ck) - ck.bytes;
+
+    ok = writev(fd, iov, 3) == (ssize_t) total;
+    if (!ok) fprintf(stderr, "spill write error, %d:%s\n", errno, strerror(errno));
+
+    pthread_mutex_lock(&mutex_);
+    Segment &seg = segments_.back();
+    if (ok) {
+        seg.size    += total;
+        seg.nrecord += ck.nrecord;
+        seg.payload += ck.payload;
+        used_       += total;
+    } else if (ftruncate(fd, size) != 0) {
+        seg.size = segmentSize_;
+    }
+    pthread_mutex_unlock(&mutex_);
+    return ok;
+}
+
+/* [Chunk][lz of the records] in one allocation of its compressed size */
+char *Spill::pack(const char *data, const Chunk &ck, size_t *total)
+{
+    char *packed = (char *) malloc(sizeof(ck) + lzBound(ck.bytes));
+    if (!packed) return 0;
+
+    memcpy(packed, &ck, sizeof(ck));
+    *total = sizeof(ck) + lzCompress(data, ck.bytes, packed + sizeof(ck));
+
+    char *shrunk = (char *) realloc(packed, *total);
+    return shrunk ? shrunk : packed;
+}
+
+bool Spill::readChunk(const Segment &seg, Chunk *ck)
+{
+    if (!dir_) memcpy(ck, seg.data, sizeof(*ck));
+    else if (pread(seg.fd, ck, sizeof(*ck), readOff_) != (ssize_t) sizeof(*ck)) return false;
+    if (ck->magic != chunkMagic || ck->nrecord > seg.nrecord) return false;
+
+    char *chunk = (char *) realloc(chunk_, ck->bytes ? ck->bytes : 1);
+    if (!chunk) return false;
+    chunk_ = chunk;
+
+    if (!dir_) {
+        return lzDecompress(seg.data + sizeof(*ck), seg.size - sizeof(*ck), chunk_, ck->bytes);
+    }
+    return pread(seg.fd, chunk_, ck->bytes, readOff_ + sizeof(*ck)) == (ssize_t) ck->bytes;
+}
+
+/* called by the consumer with the lock held, a fully read segment is
+ * removed unless the writer still appends to it, a memory one holds
+ * a single chunk and is never appended to.
+ */
+bool Spill::loadChunk()
+{
+    while (!segments_.empty()) {
+        Segment &seg = segments_.front();
+        if (seg.id != readId_) {
+            readId_  = seg.id;
+            readOff_ = 0;
+        }
+
+        if (readOff_ < seg.size) {
+            Chunk ck;
+            if (!readChunk(seg, &ck)) {
+                fprintf(stderr, "spill segment %llx is corrupted, skip %lu records\n",
+                        (unsigned long long) seg.id, (unsigned long) seg.nrecord);
+                __atomic_sub_fetch(&pending_, seg.nrecord, __ATOMIC_SEQ_CST);
+                seg.nrecord = 0;
+                seg.payload = 0;
+                readOff_ = seg.size;
+                continue;
+            }
+
+            nchunk_ = ck.bytes;
+            pos_    = 0;
+
+            readOff_    += dir_ ? alignPage(sizeof(ck) + ck.bytes) : seg.size;
+            seg.nrecord -= ck.nrecord;
+            seg.payload -= ck.payload;
+            return true;
+        }
+
+        if (segments_.size() == 1 && dir_) break;
+        dropSegment();
+    }
+    return takeQueued();
+}
+
+/* called by the consumer with the lock held, past the last segment the
+ * oldest queued chunk is drained from memory if the writer is not at it.
+ */
+bool Spill::takeQueued()
+{
+    if (queue_.empty() || queue_.front().busy) return false;
+
+    Queued &q = queue_.front();
+    free(chunk_);
+    chunk_  = q.data;
+    nchunk_ = q.ck.bytes;
+    pos_    = 0;
+    queue_.pop_front();
+    pthread_cond_signal(&room_);
+    return true;
+}
+
+size_t Spill::peek(struct iovec *iov, size_t *niov, size_t n,
+                   bool paired, size_t *nrecord)
+{
+    /* records routed elsewhere before the first one are passed for good */
+    while (true) {
+        size_t passed = 0;
+        while (pos_ < nchunk_) {
+            RingBuffer::Record rec;
+            memcpy(&rec, chunk_ + pos_, sizeof(rec));
+            if (routed(rec)) break;
+            pos_ += RingBuffer::recordSize(rec.len);
+            ++passed;
+        }
+        if (passed) __atomic_sub_fetch(&pending_, passed, __ATOMIC_SEQ_CST);
+        if (pos_ < nchunk_) break;
+
+        pthread_mutex_lock(&mutex_);
+        bool loaded = loadChunk();
+        pthread_mutex_unlock(&mutex_);
+
+        if (!loaded) {
+            *niov = 0;
+            if (nrecord) *nrecord = 0;
+            return 0;
+        }
+    }
+
+    size_t pos = pos_, nn = 0, cnt = 0, nrec = 0;
+    while (pos < nchunk_ && cnt + 2 <= *niov) {
+        RingBuffer::Record rec;
+        memcpy(&rec, chunk_ + pos, sizeof(rec));
+        if (!routed(rec)) {
+            pos += RingBuffer::recordSize(rec.len);
+            continue;
+        }
+        if (cnt > 0 && nn + rec.len > n) break;
+
+        iov[cnt].iov_base = chunk_ + pos + sizeof(rec);
+        iov[cnt].iov_len  = rec.len;
+        ++cnt;
+        if (paired) {
+            iov[cnt].iov_base = chunk_;
+            iov[cnt].iov_len  = 0;
+            ++cnt;
+        }
+
+        nn  += rec.len;
+        pos += RingBuffer::recordSize(rec.len);
+        ++nrec;
+
+        if (readBorder_ && !paired) break;
+    }
+
+    claimEnd_    = pos;
+    claimRecord_ = nrec;
+
+    *niov = cnt;
+    if (nrecord) *nrecord = nrec;
+    return nn;
+}
+
+bool Spill::commit(RingBuffer::ConsumerStats *stats)
+{
+    return commit(claimRecord_, stats);
+}
+
+bool Spill::commit(size_t nrecord, RingBuffer::ConsumerStats *stats)
+{
+    uint64_t now = stats ? nowUsec() : 0;
+
+    size_t i = 0, passed = 0;
+    while (i < nrecord && i < claimRecord_) {
+        RingBuffer::Record rec;
+        memcpy(&rec, chunk_ + pos_, sizeof(rec));
+        pos_ += RingBuffer::recordSize(rec.len);
+        ++passed;
+        if (!routed(rec)) continue;
+        if (stats) stats->add(rec, now);
+        ++i;
+    }
+    __atomic_sub_fetch(&pending_, passed, __ATOMIC_SEQ_CST);
+    claimRecord_ = 0;
+    return true;
+}
+
+bool Spill::rollback()
+{
+    claimRecord_ = 0;
+    return true;
+}
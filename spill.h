@@ -0,0 +1,159 @@
+/* vim:expandtab:shiftwidth=4:tabstop=4:smarttab:
+ */
+
+#ifndef _SPILL_H_
+#define _SPILL_H_
+
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <ringbuffer.h>
+
+/* the disk tier behind RingBuffer, when the ring is full the producer
+ * appends its oldest records here in large page aligned chunks,
+ * the consumer drains them back, oldest first, before the ring.
+ *
+ * append() only copies the chunk and queues it, a writer thread of
+ * the Spill writes or compresses it, so the producer never waits on
+ * the disk or lz. it waits only while maxQueued chunks are queued,
+ * the disk does not keep up then. the consumer drains a queued chunk
+ * the writer has not started on from memory, it is never written.
+ *
+ * the directory holds segment files spill.<id>, each a sequence of
+ * [Chunk][raw ring records][pad to 4K]. over quota the oldest segment
+ * is dropped, segments are at most 1/16 of the quota (and 64M) so a
+ * drop costs a small share of it. segments left by a previous run are picked up on start.
+ *
+ * without a directory the tier is memory, every chunk is lz compressed
+ * (lz.h) into a segment of its own, quota bounds the compressed bytes
+ * and over it the oldest chunk is dropped. the ring keeps the fresh
+ * records as they are, only what it would lose is compressed.
+ */
+class Spill {
+public:
+    /* dir 0 is the compressed memory tier */
+    Spill(const char *dir, size_t quota, bool readBorder = false);
+    ~Spill();
+
+    /* producer, iov holds nrecord records in ring format, nbytes of
+     * payload. false if the chunk is dropped, dropped() counts it.
+     */
+    bool append(const struct iovec *iov, size_t niov, size_t nrecord, size_t nbytes);
+
+    /* the routes of the ring, records not routed to its first consumer
+     * are passed over.
+     */
+    void routeBy(const uint32_t *routes) { routes_ = routes; }
+
+    /* consumer, same contract as RingBuffer::peek()/commit()/rollback() */
+    size_t peek(struct iovec *iov, size_t *niov, size_t n,
+                bool paired, size_t *nrecord);
+    bool commit(RingBuffer::ConsumerStats *stats = 0);
+    bool commit(size_t nrecord, RingBuffer::ConsumerStats *stats = 0);
+    bool rollback();
+
+    bool empty() const {
+        return pending() == 0;
+    }
+
+    size_t pending() const {
+        return __atomic_load_n(&pending_, __ATOMIC_SEQ_CST);
+    }
+
+    /* bytes of the segments, compressed in memory */
+    size_t used() const {
+        return __atomic_load_n(&used_, __ATOMIC_RELAXED);
+    }
+
+    /* messages and payload bytes lost to the quota or a write error */
+    void dropped(uint64_t *msgs, uint64_t *bytes) const {
+        *msgs  = statGet(&dropMsgs_);
+        *bytes = statGet(&dropBytes_);
+    }
+
+    static const size_t chunkSize   = 1024 * 1024;        // 1M
+    static const size_t minQuota    = 16 * chunkSize;
+    static const size_t maxQueued   = 8;                  // chunks not written yet
+
+private:
+    struct Chunk {
+        uint32_t magic;
+        uint32_t nrecord;
+        uint64_t bytes;          // of the records in ring format
+        uint64_t payload;
+    };
+
+    /* nrecord and payload are what the consumer has not loaded yet */
+    struct Segment {
+        uint64_t id;
+        int      fd;
+        size_t   size;
+        size_t   nrecord;
+        size_t   payload;
+        char    *data;           // memory, [Chunk][lz of the records]
+    };
+
+    struct Queued {
+        Chunk  ck;
+        char  *data;             // the records in ring format
+        bool   busy;             // the writer is at it
+    };
+
+    static size_t alignPage(size_t n) {
+        return (n + 4095) & ~(size_t) 4095;
+    }
+
+    bool routed(const RingBuffer::Record &rec) const {
+        return !routes_ || (routes_[msgRoute(rec.flags)] & 1);
+    }
+
+    static void *writeRoutine(void *data);
+
+    bool scan();
+    bool openSegment();
+    void writeOut();
+    bool store(const Chunk &ck, const char *data);
+    char *pack(const char *data, const Chunk &ck, size_t *total);
+    void dropSegment();
+    void dropChunk(const Chunk &ck);
+    bool readChunk(const Segment &seg, Chunk *ck);
+    bool loadChunk();
+    bool takeQueued();
+
+private:
+    char   *dir_;
+    size_t  quota_;
+    size_t  segmentSize_;
+    bool    readBorder_;
+    size_t  used_;
+    uint64_t nextId_;
+
+    const uint32_t     *routes_;
+    std::deque<Segment> segments_;
+    std::deque<Queued>  queue_;
+    pthread_mutex_t     mutex_;
+    pthread_cond_t      work_;           // a chunk was queued or quit_
+    pthread_cond_t      room_;           // a queued chunk is gone
+    pthread_t           writer_;
+    bool                quit_;
+    size_t              pending_;
+
+    /* added with the lock held */
+    uint64_t dropMsgs_;
+    uint64_t dropBytes_;
+
+    /* consumer private, the chunk being drained */
+    char    *chunk_;
+    size_t   nchunk_;
+    size_t   pos_;
+    size_t   claimEnd_;
+    size_t   claimRecord_;
+    uint64_t readId_;
+    size_t   readOff_;
+};
+
+#endif
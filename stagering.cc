@@ -0,0 +1,271 @@
+/* vim:expandtab:shiftwidth=4:tabstop=4:smarttab:
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include <stagering.h>
+
+StageRing::StageRing(size_t size, StageMerger *merger)
+    : buffer_(0), size_(4096), merger_(merger), head_(0), dropMsgs_(0), dropBytes_(0), tail_(0)
+{
+    while (size_ < size) size_ *= 2;
+    buffer_ = (char *) malloc(size_);
+    if (!buffer_) throw errno;
+}
+
+StageRing::~StageRing()
+{
+    free(buffer_);
+}
+
+size_t StageRing::write(const char *buffer, size_t n, uint32_t flags)
+{
+    struct iovec iov;
+    iov.iov_base = (void *) buffer;
+    iov.iov_len  = n;
+    return write(&iov, 1, &flags) == 1 ? n : 0;
+}
+
+/* head is published once per call, the merger is woken once */
+size_t StageRing::write(const struct iovec *records, size_t n, const uint32_t *flags)
+{
+    uint64_t head = head_;
+    uint64_t tail = __atomic_load_n(&tail_, __ATOMIC_ACQUIRE);
+    uint64_t now  = nowUsec();
+
+    size_t nwrite = 0;
+    for (size_t i = 0; i < n; ++i) {
+        size_t rsize = recordSize(records[i].iov_len);
+        size_t off   = head & (size_ - 1);
+        size_t skip  = (size_ - off < rsize) ? size_ - off : 0;
+
+        if (head + skip + rsize - tail > size_) {
+            tail = __atomic_load_n(&tail_, __ATOMIC_ACQUIRE);
+            if (head + skip + rsize - tail > size_) {
+                statAdd(&dropMsgs_);
+                statAdd(&dropBytes_, records[i].iov_len);
+                continue;
+            }
+        }
+
+        if (skip) {
+            ((Record *) (buffer_ + off))->len = padMark;
+            head += skip;
+            off   = 0;
+        }
+
+        Record *rec = (Record *) (buffer_ + off);
+        rec->len   = records[i].iov_len;
+        rec->flags = flags ? flags[i] : 0;
+        rec->stamp = now;
+        memcpy(rec + 1, records[i].iov_base, records[i].iov_len);
+        head += rsize;
+        ++nwrite;
+    }
+
+    if (head != head_) {
+        __atomic_store_n(&head_, head, __ATOMIC_RELEASE);
+        merger_->wakeup();
+    }
+    return nwrite;
+}
+
+const StageRing::Record *StageRing::front(uint64_t *pos, uint64_t head) const
+{
+    while (*pos != head) {
+        size_t off = *pos & (size_ - 1);
+        const Record *rec = (const Record *) (buffer_ + off);
+        if (rec->len != padMark) return rec;
+        *pos += size_ - off;
+    }
+    return 0;
+}
+
+StageMerger::StageMerger(RingBuffer *outbuffer, Order order)
+    : outbuffer_(outbuffer), order_(order), nstage_(0), next_(0), efd_(-1), quit_(false),
+      waiting_(0), mergeMsgs_(0), mergeBytes_(0), dropMsgs_(0), dropBytes_(0)
+{
+    efd_ = eventfd(0, EFD_NONBLOCK);
+    if (efd_ == -1) throw errno;
+}
+
+StageMerger::~StageMerger()
+{
+    for (size_t i = 0; i < nstage_; ++i) delete stages_[i];
+    close(efd_);
+}
+
+/* before the readers start */
+StageRing *StageMerger::addStage(size_t size)
+{
+    if (nstage_ == maxStages) return 0;
+    stages_[nstage_] = new StageRing(size, this);
+    return stages_[nstage_++];
+}
+
+/* the reader published, it writes the eventfd only if the merger sleeps */
+void StageMerger::wakeup()
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&waiting_, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&waiting_, 0, __ATOMIC_ACQ_REL)) {
+        uint64_t one = 1;
+        if (::write(efd_, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+            fprintf(stderr, "write(eventfd) error, %d:%s\n", errno, strerror(errno));
+        }
+    }
+}
+
+bool StageMerger::hasData() const
+{
+    for (size_t i = 0; i < nstage_; ++i) {
+        if (__atomic_load_n(&stages_[i]->head_, __ATOMIC_ACQUIRE) != stages_[i]->tail_) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* waiting_ first, then a last look, a reader sees one or the other */
+bool StageMerger::wait(int timeout)
+{
+    __atomic_store_n(&waiting_, 1, __ATOMIC_SEQ_CST);
+    if (hasData() || quit_) {
+        __atomic_store_n(&waiting_, 0, __ATOMIC_RELAXED);
+        return true;
+    }
+
+    struct pollfd pfd;
+    pfd.fd     = efd_;
+    pfd.events = POLLIN;
+    int n = poll(&pfd, 1, timeout);
+
+    uint64_t v;
+    if (n == 1 && ::read(efd_, &v, sizeof(v)) == -1 && errno != EAGAIN) {
+        fprintf(stderr, "read(eventfd) error, %d:%s\n", errno, strerror(errno));
+    }
+    __atomic_store_n(&waiting_, 0, __ATOMIC_RELAXED);
+    return n == 1;
+}
+
+/* up to max records of ring i from pos_[i] into the batch at cnt */
+size_t StageMerger::collect(size_t i, size_t max, size_t cnt)
+{
+    const StageRing::Record *rec;
+    for (size_t k = 0; k < max && (rec = stages_[i]->front(&pos_[i], heads_[i])) != 0; ++k) {
+        iov_[cnt].iov_base = (void *) (rec + 1);
+        iov_[cnt].iov_len  = rec->len;
+        flags_[cnt]  = rec->flags;
+        stamps_[cnt] = rec->stamp;
+        pos_[i] += StageRing::recordSize(rec->len);
+        ++cnt;
+    }
+    return cnt;
+}
+
+/* what the stage rings dropped goes to the RingBuffer, its dropped()
+ * and the report then cover a message lost on either ring.
+ */
+void StageMerger::collectDrops()
+{
+    uint64_t msgs = 0, bytes = 0;
+    for (size_t i = 0; i < nstage_; ++i) {
+        msgs  += statGet(&stages_[i]->dropMsgs_);
+        bytes += statGet(&stages_[i]->dropBytes_);
+    }
+    if (msgs == dropMsgs_) return;
+
+    outbuffer_->stageDropped(msgs - dropMsgs_, bytes - dropBytes_);
+    statAdd(&dropMsgs_, msgs - dropMsgs_);
+    statAdd(&dropBytes_, bytes - dropBytes_);
+}
+
+/* one batch, zero-copy out of the stage rings, their tails move after
+ * the RingBuffer took it. a drop is seen no later than the records
+ * written after it.
+ */
+size_t StageMerger::merge()
+{
+    for (size_t i = 0; i < nstage_; ++i) {
+        pos_[i]   = stages_[i]->tail_;
+        heads_[i] = __atomic_load_n(&stages_[i]->head_, __ATOMIC_ACQUIRE);
+    }
+    collectDrops();
+
+    size_t cnt = 0;
+    if (order_ == ByTime) {
+        while (cnt < batch) {
+            size_t best = nstage_;
+            uint64_t stamp = 0;
+            for (size_t i = 0; i < nstage_; ++i) {
+                const StageRing::Record *rec = stages_[i]->front(&pos_[i], heads_[i]);
+                if (rec && (best == nstage_ || rec->stamp < stamp)) {
+                    best  = i;
+                    stamp = rec->stamp;
+                }
+            }
+            if (best == nstage_) break;
+            cnt = collect(best, 1, cnt);
+        }
+    } else {
+        size_t share = batch / nstage_ ? batch / nstage_ : 1;
+        for (size_t k = 0; k < nstage_ && cnt < batch; ++k) {
+            size_t i = (next_ + k) % nstage_;
+            cnt = collect(i, share < batch - cnt ? share : batch - cnt, cnt);
+        }
+        next_ = (next_ + 1) % nstage_;
+    }
+
+    if (cnt) {
+        outbuffer_->write(iov_, cnt, flags_, stamps_);
+
+        size_t bytes = 0;
+        for (size_t i = 0; i < cnt; ++i) bytes += iov_[i].iov_len;
+        statAdd(&mergeMsgs_, cnt);
+        statAdd(&mergeBytes_, bytes);
+    }
+    for (size_t i = 0; i < nstage_; ++i) {
+        __atomic_store_n(&stages_[i]->tail_, pos_[i], __ATOMIC_RELEASE);
+    }
+    return cnt;
+}
+
+bool StageMerger::run()
+{
+    while (!quit_) {
+        if (merge() == 0) wait(500);
+        outbuffer_->tick();
+    }
+    while (merge() > 0) {
+    }
+    return true;
+}
+
+bool StageMerger::stop()
+{
+    quit_ = true;
+    uint64_t one = 1;
+    if (::write(efd_, &one, sizeof(one)) == -1) {
+        /* the merger looks at quit_ every 500 ms anyway */
+    }
+    return true;
+}
+
+void StageMerger::dumpStats(FILE *fp) const
+{
+    uint64_t msgs = 0, bytes = 0;
+    for (size_t i = 0; i < nstage_; ++i) {
+        msgs  += statGet(&stages_[i]->dropMsgs_);
+        bytes += statGet(&stages_[i]->dropBytes_);
+    }
+
+    statPrint(fp, "merge_msgs", statGet(&mergeMsgs_));
+    statPrint(fp, "merge_bytes", statGet(&mergeBytes_));
+    statPrint(fp, "merge_stage_drop_msgs", msgs);
+    statPrint(fp, "merge_stage_drop_bytes", bytes);
+}
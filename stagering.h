@@ -0,0 +1,131 @@
+/* vim:expandtab:shiftwidth=4:tabstop=4:smarttab:
+ */
+
+#ifndef _STAGERING_H_
+#define _STAGERING_H_
+
+#include <cstdio>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <ringbuffer.h>
+#include <stats.h>
+
+class StageMerger;
+
+/* what one reader thread received, on its way to the RingBuffer. one
+ * producer, the reader thread, and one consumer, the merger of all of
+ * them. records are [Record][payload][pad to 8] and carry the time they
+ * were received, one that would wrap leaves a padMark behind and starts
+ * at the front. a full ring drops the new record, the reader never
+ * waits for the merger.
+ */
+class StageRing {
+public:
+    StageRing(size_t size, StageMerger *merger);
+    ~StageRing();
+
+    size_t write(const char *buffer, size_t n, uint32_t flags = 0);
+    size_t write(const struct iovec *records, size_t n, const uint32_t *flags = 0);
+
+    /* the merger ticks the RingBuffer */
+    void tick() {}
+
+    static const size_t nbuffer = RingBuffer::nbuffer;
+
+private:
+    friend class StageMerger;
+
+    struct Record {
+        uint32_t len;
+        uint32_t flags;
+        uint64_t stamp;          // nowUsec() of the receive
+    };
+
+    static const uint32_t padMark   = 0xffffffff;
+    static const size_t   cacheline = 64;
+
+    static size_t recordSize(size_t n) {
+        return (sizeof(Record) + n + 7) & ~(size_t) 7;
+    }
+
+    /* the first record at or after *pos, 0 if none, for the merger */
+    const Record *front(uint64_t *pos, uint64_t head) const;
+
+private:
+    char        *buffer_;
+    size_t       size_;
+    StageMerger *merger_;
+    char         pad0_[cacheline];
+
+    uint64_t     head_;          // by the reader
+    uint64_t     dropMsgs_;
+    uint64_t     dropBytes_;
+    char         pad1_[cacheline];
+
+    uint64_t     tail_;          // by the merger
+    char         pad2_[cacheline];
+};
+
+/* moves the records of the stage rings into the RingBuffer, on the
+ * thread that runs it. ByTime takes the oldest record any ring has
+ * first, RoundRobin a share of each ring in turn. order across rings
+ * is only as good as the time a reader takes from receive to publish.
+ * it sleeps on an eventfd the readers write only when it said so.
+ */
+class StageMerger {
+public:
+    enum Order { ByTime, RoundRobin };
+
+    StageMerger(RingBuffer *outbuffer, Order order);
+    ~StageMerger();
+
+    StageRing *addStage(size_t size);
+
+    /* until stop(), the rings are drained after that */
+    bool run();
+    bool stop();
+
+    /* merge_msgs and what the stage rings dropped */
+    void dumpStats(FILE *fp) const;
+
+    static const size_t maxStages = 64;
+
+private:
+    friend class StageRing;
+
+    void wakeup();
+    bool wait(int timeout);
+    bool hasData() const;
+    size_t merge();
+    size_t collect(size_t i, size_t max, size_t cnt);
+    void collectDrops();
+
+    static const size_t batch = 256;
+
+private:
+    RingBuffer   *outbuffer_;
+    Order         order_;
+    StageRing    *stages_[maxStages];
+    size_t        nstage_;
+    size_t        next_;             // where RoundRobin starts
+    int           efd_;
+    volatile bool quit_;
+    char          pad0_[StageRing::cacheline];
+
+    int           waiting_;          // set by the merger, cleared by the reader that wakes it
+    char          pad1_[StageRing::cacheline];
+
+    /* merger private, the batch in hand and where each ring's tail goes */
+    struct iovec  iov_[batch];
+    uint32_t      flags_[batch];
+    uint64_t      stamps_[batch];
+    uint64_t      pos_[maxStages];
+    uint64_t      heads_[maxStages];
+
+    uint64_t      mergeMsgs_;
+    uint64_t      mergeBytes_;
+    uint64_t      dropMsgs_;         // stage drops the RingBuffer was told of
+    uint64_t      dropBytes_;
+};
+
+#endif
@@ -0,0 +1,102 @@
+/* vim:expandtab:shiftwidth=4:tabstop=4:smarttab:
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <cstdio>
+#include <stdint.h>
+#include <time.h>
+
+/* every counter has one writing thread, so a relaxed load and store
+ * is enough (no lock prefix), the stats dumper reads it with a relaxed
+ * load and may see it a little behind, never torn.
+ */
+inline void statAdd(uint64_t *counter, uint64_t n = 1)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+inline uint64_t statGet(const uint64_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+inline void statMax(uint64_t *counter, uint64_t n)
+{
+    if (n > __atomic_load_n(counter, __ATOMIC_RELAXED)) {
+        __atomic_store_n(counter, n, __ATOMIC_RELAXED);
+    }
+}
+
+inline void statPrint(FILE *fp, const char *name, uint64_t n)
+{
+    fprintf(fp, "%s %llu\n", name, (unsigned long long) n);
+}
+
+inline void statPrint(FILE *fp, const char *prefix, const char *name, uint64_t n)
+{
+    fprintf(fp, "%s_%s %llu\n", prefix, name, (unsigned long long) n);
+}
+
+/* microseconds since the epoch, records keep it across restarts */
+inline uint64_t nowUsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* milliseconds of the monotonic clock, for intervals and deadlines */
+inline long nowMsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* log2 buckets, bucket i counts values in [2^(i-1), 2^i) */
+class Histogram {
+public:
+    static const int nbucket = 40;
+
+    Histogram() {
+        for (int i = 0; i < nbucket; ++i) bucket_[i] = 0;
+    }
+
+    void add(uint64_t v) {
+        int i = v ? 64 - __builtin_clzll(v) : 0;
+        statAdd(&bucket_[i < nbucket ? i : nbucket - 1]);
+    }
+
+    /* one line per bucket, name_le_<upper bound> count, and quantiles */
+    void print(FILE *fp, const char *name) const {
+        uint64_t snap[nbucket], total = 0;
+        for (int i = 0; i < nbucket; ++i) {
+            snap[i] = statGet(&bucket_[i]);
+            total  += snap[i];
+        }
+
+        for (int i = 0; i < nbucket; ++i) {
+            if (snap[i] == 0) continue;
+            fprintf(fp, "%s_le_%llu %llu\n", name,
+                    (unsigned long long) (i ? (1ULL << i) - 1 : 0),
+                    (unsigned long long) snap[i]);
+        }
+
+        static const double qs[]    = { 0.5, 0.99, 0.999 };
+        static const char  *qname[] = { "p50", "p99", "p999" };
+        for (int q = 0; q < 3; ++q) {
+            uint64_t want = (uint64_t) (total * qs[q]), seen = 0;
+            int i = 0;
+            for (; i < nbucket - 1 && seen + snap[i] <= want; ++i) seen += snap[i];
+            fprintf(fp, "%s_%s %llu\n", name, qname[q],
+                    (unsigned long long) (total ? (i ? (1ULL << i) - 1 : 0) : 0));
+        }
+    }
+
+private:
+    uint64_t bucket_[nbucket];
+};
+
+#endif
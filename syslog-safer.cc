@@ -7,9 +7,19 @@
 #include <errno.h>
 #include <signal.h>
 #include <unistd.h>
+#include <poll.h>
+#include <time.h>
 #include <pthread.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 
 #include <ringbuffer.h>
+#include <spill.h>
+#include <stagering.h>
+#include <ratelimit.h>
+#include <dedup.h>
+#include <router.h>
 #include <logreader.h>
 #include <logwriter.h>
 
@@ -18,17 +28,53 @@
 
 struct config_t {
     const char *source;
-    const char *dest;
+    const char *shmsock;
+    const char *dest[RingBuffer::maxConsumers];
+    size_t      ndest;
+    const char *also[RingBuffer::maxConsumers];
+    size_t      nalso;
     const char *pidfile;
     const char *notifyf;
+    int         notifyms;
+    bool        report;
     bool        verbose;
     bool        stream;
     bool        daemonize;
     size_t      bsize;
+    size_t      rbatch;
+    size_t      threads;
+    StageMerger::Order order;
+    bool        uring;
+    size_t      wbatch;
+    int         latency;
+    Framing     framing;
+    int         wtimeout;
+    size_t      rotsize;
+    int         rotsec;
+    int         fsyncms;
+    RingBuffer::SyncMode sync;
+    const char *spool;
+    RingBuffer::FlushPolicy flush;
+    int         flushms;
+    const char *spilldir;
+    size_t      quota;
+    size_t      packsize;
+    RingBuffer::EvictPolicy evict;
+    const char *limit;
+    int         dedupms;
+    const char *rules;
+    const char *statsock;
+    const char *statsf;
+    int         statsms;
 };
 
 LogReader<RingBuffer> *logr;
-LogWriter<RingBuffer> *logw;
+LogReader<StageRing>  *logrs[StageMerger::maxStages];
+size_t nlogr;
+StageMerger *merger;
+Router *router;
+LogWriter<RingBuffer::Consumer> *logw[RingBuffer::maxConsumers];
+size_t nlogw;
 
 int usage(const char *error = 0)
 {
@@ -37,51 +83,227 @@ int usage(const char *error = 0)
            "   if syslogd(or something like) is blocked, the system who use syslog will be hanged up,\n"
            "   syslog-safer copy from source(usually /dev/log) to dest, never blocked by dest,\n"
            "   it read source as fast as possible, stor the content in buffer first, and then write to dest,\n"
-           "   if buffer is full, drop the oldest data\n\n"
+           "   if buffer is full, drop the oldest data (or spill it to disk, see -o, or compress it, see -z)\n\n"
            "   -s source, default is /dev/log\n"
-           "   -d dest, you must appoint, for example /dev/xlog\n"
+           "   -d dest, you must appoint, for example /dev/xlog, repeat it to copy to more dests,\n"
+           "      dest,backup writes to backup while dest is down, tcp://host:port and\n"
+           "      udp://host:port forward to a remote syslogd, tcp always uses octet framing,\n"
+           "      file:///path appends to a file, one line per message, SIGHUP reopens it\n"
+           "   -a dest, one more dest that may fall behind, when the buffer is full it loses\n"
+           "      the oldest data the -d dests took already, -d ones lose nothing for it\n"
            "   -t stream|dgram, default dgram\n"
+           "   -u path, unix socket where processes linked with libshmlog hand over their\n"
+           "      shared memory rings, default no\n"
            "   -p pidifle, default /var/run/syslog-safer.pid\n"
            "   -b buffer, default is 128M, you cant use(K/M/G) unit\n"
+           "   -B batch, receive up to batch datagrams per recvmmsg(), default 32, 1 use recv()\n"
+           "   -j threads, read the source with threads threads, each into its own ring that\n"
+           "      one thread merges into the buffer, default 1, reads into the buffer itself\n"
+           "   -g time|rr, how -j merges, the oldest message first or a share of every ring\n"
+           "      in turn, default time\n"
+           "   -E epoll|uring, io engine of the source and of dgram dests, uring reads with\n"
+           "      multishot recv into provided buffers and sends batches as linked sends,\n"
+           "      epoll if the kernel has no io_uring (before 6.1), default epoll\n"
+           "   -w batch, send up to batch datagrams per sendmmsg(), default 32, 1 use sendmsg()\n"
+           "   -l ms, wait at most ms for a send batch to fill, default 0, on tcp it is\n"
+           "      how long small writes may sit corked before they go out\n"
+           "   -F lf|octet, how messages are framed on a stream dest, a LF after each or\n"
+           "      a length before each (RFC 6587), stream sources may use either, default lf\n"
+           "   -W ms, reconnect when dest takes nothing for ms, default 10000\n"
+           "   -L size, rotate file dests when they reach size, default no, you cant use(K/M/G) unit\n"
+           "   -T sec, rotate file dests every sec, on the multiples of sec since the epoch, default no\n"
+           "   -Y ms, fdatasync file dests at most ms after a write, default no\n"
+           "   -f spool file, keep the buffer in this file so it survives restarts, default no\n"
+           "   -S none|async|sync, how the spool file is pushed to disk, default none\n"
+           "   -i ms, interval of -S, default 1000\n"
+           "   -o dir, when the buffer is full move the oldest data to files in dir, default no\n"
+           "   -q quota, disk space -o may use, default 1G, you cant use(K/M/G) unit\n"
+           "   -z size, when the buffer is full keep the oldest data lz compressed in up to\n"
+           "      size bytes of memory instead, 1M of it a block, over size the oldest block\n"
+           "      is dropped, it allows one -d like -o and excludes it, default no\n"
+           "   -e fifo|severity|sender, what a full buffer drops first, the oldest data,\n"
+           "      the oldest data of the least important severity, or the oldest data of\n"
+           "      the processes that have more than their share queued, default fifo,\n"
+           "      severity and sender exclude -o and -z, those keep what a full buffer drops\n"
+           "   -k pid|uid|tag:rate[:burst], let each sender pid, sender uid or TAG pass rate\n"
+           "      messages per second, bursts of up to burst (default rate), the others are\n"
+           "      dropped on receipt and counted in a syslog message every -N ms, with -j\n"
+           "      each thread gets its part of rate, default no\n"
+           "   -c ms, keep one of the same message a sender repeats, after ms or when the\n"
+           "      sender says something else \"last message repeated N times\" follows it,\n"
+           "      senders with credentials only, the others always pass, the kept repeats\n"
+           "      take none of the -k rate, default no\n"
+           "   -x rules file, route messages to the -d and -a dests by facility, severity\n"
+           "      and TAG, or discard them, one \"selector tag dest...\" a line, the first\n"
+           "      rule that matches decides, see router.h, default every dest gets all\n"
+           "   -r lockfree|mutex, how reader and writer share the buffer, default lockfree\n"
+           "   -m path, unix stream socket that answers every connection with the stats, default no\n"
+           "   -M stats file, rewritten every -I ms, default no\n"
+           "   -I ms, interval of -M, default 10000\n"
            "   -D default no daemonize\n"
-           "   -n notify file, default no\n"
+           "   -n notify file, rewritten at most every -N ms while data is dropped, default no\n"
+           "   -N ms, interval of -n, -R and the -k reports, default 1000\n"
+           "   -R tell dest how much was dropped with a syslog message, default no\n"
            "   -h show this help screen\n");
     return error == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
+size_t parseSize(const char *arg)
+{
+    char *endptr;
+    size_t size = strtoul(arg, &endptr, 10);
+    if (endptr[0] == 'G' || endptr[0] == 'g') {
+        size *= 1024 * 1024 * 1024;
+    } else if (endptr[0] == 'M' || endptr[0] == 'm') {
+        size *= 1024 * 1024;
+    } else if (endptr[0] == 'K' || endptr[0] == 'k') {
+        size *= 1024;
+    }
+    return size;
+}
+
+/* -k, one per reader, 0 without -k or if it is wrong */
+RateLimiter *newLimiter(const config_t *config)
+{
+    if (!config->limit) return 0;
+
+    RateLimiter::Key key;
+    const char *colon = strchr(config->limit, ':');
+    size_t n = colon ? colon - config->limit : 0;
+    if (n == 3 && strncmp(config->limit, "pid", 3) == 0) key = RateLimiter::ByPid;
+    else if (n == 3 && strncmp(config->limit, "uid", 3) == 0) key = RateLimiter::ByUid;
+    else if (n == 3 && strncmp(config->limit, "tag", 3) == 0) key = RateLimiter::ByTag;
+    else return 0;
+
+    char *end;
+    unsigned long rate = strtoul(colon + 1, &end, 10), burst = rate;
+    if (*end == ':') burst = strtoul(end + 1, &end, 10);
+    if (*end || rate < 1 || burst < 1 || rate > UINT32_MAX || burst > UINT32_MAX) return 0;
+
+    /* the source is spread over the -j readers */
+    rate  = rate / config->threads ? rate / config->threads : 1;
+    burst = burst / config->threads ? burst / config->threads : 1;
+    return new RateLimiter(key, rate, burst, config->notifyms);
+}
+
+/* -c, one per reader */
+Dedup *newDedup(const config_t *config)
+{
+    return config->dedupms > 0 ? new Dedup(config->dedupms) : 0;
+}
+
 void getoption(int argc, char *argv[], config_t *config)
 {
     config->source    = "/dev/log";
-    config->dest      = 0;
+    config->shmsock   = 0;
+    config->ndest     = 0;
+    config->nalso     = 0;
     config->stream    = false;
     config->pidfile   = "/var/run/syslog-safer.pid";
     config->notifyf   = 0;
+    config->notifyms  = 1000;
+    config->report    = false;
     config->bsize     = 128 * 1024 * 1024;
     config->verbose   = false;
     config->daemonize = false;
+    config->sync      = RingBuffer::LockFree;
+    config->rbatch    = 32;
+    config->threads   = 1;
+    config->order     = StageMerger::ByTime;
+    config->uring     = false;
+    config->wbatch    = 32;
+    config->latency   = 0;
+    config->framing   = FrameLF;
+    config->wtimeout  = 10000;
+    config->rotsize   = 0;
+    config->rotsec    = 0;
+    config->fsyncms   = 0;
+    config->spool     = 0;
+    config->flush     = RingBuffer::FlushNone;
+    config->flushms   = 1000;
+    config->spilldir  = 0;
+    config->quota     = 1024 * 1024 * 1024;
+    config->packsize  = 0;
+    config->evict     = RingBuffer::Fifo;
+    config->limit     = 0;
+    config->dedupms   = 0;
+    config->rules     = 0;
+    config->statsock  = 0;
+    config->statsf    = 0;
+    config->statsms   = 10000;
 
     opterr = 0;
 
     int c;
-    while ((c = getopt(argc, argv, "s:d:t:p:n:b:Dvh")) != -1) {
+    while ((c = getopt(argc, argv, "s:u:d:a:t:p:n:N:Rb:B:j:g:E:w:l:F:W:L:T:Y:r:f:S:i:o:q:z:e:k:c:x:m:M:I:Dvh")) != -1) {
         switch (c) {
             case 's': config->source  = optarg; break;
-            case 'd': config->dest    = optarg; break;
+            case 'u': config->shmsock = optarg; break;
+            case 'd':
+            case 'a':
+                if (config->ndest + config->nalso == RingBuffer::maxConsumers) {
+                    exit(usage("too many -d and -a"));
+                }
+                if (c == 'd') config->dest[config->ndest++] = optarg;
+                else config->also[config->nalso++] = optarg;
+                break;
             case 't': config->stream  = (strcmp(optarg, "stream") == 0); break;
             case 'p': config->pidfile = optarg; break;
             case 'n': config->notifyf = optarg; break;
-            case 'b': {
-                char *endptr;
-                config->bsize = strtoul(optarg, &endptr, 10);
-                if (endptr[0] == 'G' || endptr[0] == 'g') {
-                    config->bsize *= 1024 * 1024 * 1024;
-                } else if (endptr[0] == 'M' || endptr[0] == 'm') {
-                    config->bsize *= 1024 * 1024;
-                } else if (endptr[0] == 'K' || endptr[0] == 'k') {
-                    config->bsize *= 1024;
-                }
+            case 'N': config->notifyms = atoi(optarg); break;
+            case 'R': config->report = true; break;
+            case 'b': config->bsize = parseSize(optarg); break;
+            case 'B': config->rbatch = strtoul(optarg, 0, 10); break;
+            case 'j': config->threads = strtoul(optarg, 0, 10); break;
+            case 'g':
+                if (strcmp(optarg, "time") == 0) config->order = StageMerger::ByTime;
+                else if (strcmp(optarg, "rr") == 0) config->order = StageMerger::RoundRobin;
+                else exit(usage("-g must be time or rr"));
+                break;
+            case 'E':
+                if (strcmp(optarg, "epoll") == 0) config->uring = false;
+                else if (strcmp(optarg, "uring") == 0) config->uring = true;
+                else exit(usage("-E must be epoll or uring"));
+                break;
+            case 'w': config->wbatch = strtoul(optarg, 0, 10); break;
+            case 'l': config->latency = atoi(optarg); break;
+            case 'F':
+                if (strcmp(optarg, "lf") == 0) config->framing = FrameLF;
+                else if (strcmp(optarg, "octet") == 0) config->framing = FrameOctet;
+                else exit(usage("-F must be lf or octet"));
+                break;
+            case 'W': config->wtimeout = atoi(optarg); break;
+            case 'L': config->rotsize = parseSize(optarg); break;
+            case 'T': config->rotsec = atoi(optarg); break;
+            case 'Y': config->fsyncms = atoi(optarg); break;
+            case 'r':
+                if (strcmp(optarg, "lockfree") == 0) config->sync = RingBuffer::LockFree;
+                else if (strcmp(optarg, "mutex") == 0) config->sync = RingBuffer::Locked;
+                else exit(usage("-r must be lockfree or mutex"));
+                break;
+            case 'f': config->spool = optarg; break;
+            case 'S':
+                if (strcmp(optarg, "none") == 0) config->flush = RingBuffer::FlushNone;
+                else if (strcmp(optarg, "async") == 0) config->flush = RingBuffer::FlushAsync;
+                else if (strcmp(optarg, "sync") == 0) config->flush = RingBuffer::FlushSync;
+                else exit(usage("-S must be none, async or sync"));
+                break;
+            case 'i': config->flushms = atoi(optarg); break;
+            case 'e':
+                if (strcmp(optarg, "fifo") == 0) config->evict = RingBuffer::Fifo;
+                else if (strcmp(optarg, "severity") == 0) config->evict = RingBuffer::BySeverity;
+                else if (strcmp(optarg, "sender") == 0) config->evict = RingBuffer::BySender;
+                else exit(usage("-e must be fifo, severity or sender"));
                 break;
-            }
+            case 'k': config->limit = optarg; break;
+            case 'c': config->dedupms = atoi(optarg); break;
+            case 'x': config->rules = optarg; break;
+            case 'o': config->spilldir = optarg; break;
+            case 'q': config->quota = parseSize(optarg); break;
+            case 'z': config->packsize = parseSize(optarg); break;
+            case 'm': config->statsock = optarg; break;
+            case 'M': config->statsf = optarg; break;
+            case 'I': config->statsms = atoi(optarg); break;
             case 'D': config->daemonize = true; break;
             case 'v': config->verbose = true; break;
             case 'h': exit(usage()); break;
@@ -89,18 +311,41 @@ void getoption(int argc, char *argv[], config_t *config)
         }
     }
 
-    if (config->dest == 0) exit(usage("you must appoint -d"));
+    if (config->ndest == 0) exit(usage("you must appoint -d"));
+    if (config->spilldir && config->ndest > 1) exit(usage("-o allows one -d, add the others with -a"));
+    if (config->packsize && config->ndest > 1) exit(usage("-z allows one -d, add the others with -a"));
+    if (config->packsize && config->spilldir) exit(usage("-z and -o exclude each other"));
+    if (config->evict != RingBuffer::Fifo && (config->spilldir || config->packsize)) {
+        exit(usage("-e severity and -e sender exclude -o and -z"));
+    }
     if (config->bsize < 8 * 1024 * 1024) exit(usage("-b at least 8M"));
+    if (config->rbatch < 1 || config->rbatch > 1024) exit(usage("-B must be 1-1024"));
+    if (config->threads < 1 || config->threads > StageMerger::maxStages) exit(usage("-j must be 1-64"));
+    if (config->wbatch < 1 || config->wbatch > 1024) exit(usage("-w must be 1-1024"));
+    if (config->latency < 0) exit(usage("-l must not be negative"));
+    if (config->wtimeout < 1) exit(usage("-W at least 1"));
+    if (config->rotsec < 0) exit(usage("-T must not be negative"));
+    if (config->fsyncms < 0) exit(usage("-Y must not be negative"));
+    if (config->flushms < 1) exit(usage("-i at least 1"));
+    if (config->quota < Spill::minQuota) exit(usage("-q at least 16M"));
+    if (config->packsize && config->packsize < Spill::minQuota) exit(usage("-z at least 16M"));
+    if (config->statsms < 1) exit(usage("-I at least 1"));
+    if (config->notifyms < 1) exit(usage("-N at least 1"));
+    if (config->dedupms < 0) exit(usage("-c must not be negative"));
+
+    RateLimiter *limiter = newLimiter(config);
+    if (config->limit && !limiter) exit(usage("-k must be pid, uid or tag:rate[:burst]"));
+    delete limiter;
 }
 
 void *logwRoutine(void *data)
 {
-    LogWriter<RingBuffer> *logw = (LogWriter<RingBuffer> *) data;
+    LogWriter<RingBuffer::Consumer> *logw = (LogWriter<RingBuffer::Consumer> *) data;
     logw->run();
     return 0;
 }
 
-bool startWriteThread(pthread_t *tid, LogWriter<RingBuffer> *logw)
+bool startWriteThread(pthread_t *tid, LogWriter<RingBuffer::Consumer> *logw)
 {
     int eno = pthread_create(tid, 0, logwRoutine, logw);
     if (eno != 0) {
@@ -110,18 +355,222 @@ bool startWriteThread(pthread_t *tid, LogWriter<RingBuffer> *logw)
     return true;
 }
 
-bool stopWriteThread(pthread_t *tid, RingBuffer *rbuffer)
+/* what one -j reader may get ahead of the merger */
+static const size_t stageSize = 4 * 1024 * 1024;
+
+void *logrRoutine(void *data)
 {
-    logw->stop();
+    LogReader<StageRing> *logr = (LogReader<StageRing> *) data;
+    logr->run();
+    return 0;
+}
+
+/* -j, reader 0 owns the source socket and the -u one, the others share
+ * the source, EPOLLEXCLUSIVE hands each connection or datagram to one.
+ */
+bool startReadThreads(pthread_t *tids, const config_t *config, RingBuffer *rbuffer)
+{
+    merger = new StageMerger(rbuffer, config->order);
+
+    for (size_t i = 0; i < config->threads; ++i) {
+        StageRing *stage = merger->addStage(stageSize);
+        logrs[i] = new LogReader<StageRing>(config->source, stage, config->stream, config->rbatch,
+                                            i == 0 ? config->shmsock : 0, config->uring,
+                                            newLimiter(config), newDedup(config), router);
+        if (!logrs[i]->open(i == 0 ? -1 : logrs[0]->sourceFd(), true)) return false;
+        ++nlogr;
+    }
+
+    for (size_t i = 0; i < nlogr; ++i) {
+        int eno = pthread_create(&tids[i], 0, logrRoutine, logrs[i]);
+        if (eno != 0) {
+            fprintf(stderr, "pthread_create() error, %d:%s\n", eno, strerror(eno));
+            for (size_t j = 0; j < i; ++j) logrs[j]->stop();
+            for (size_t j = 0; j < i; ++j) pthread_join(tids[j], 0);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool stopWriteThreads(pthread_t *tids, size_t n, RingBuffer *rbuffer)
+{
+    for (size_t i = 0; i < n; ++i) logw[i]->stop();
     rbuffer->interrupt();
-    pthread_join(*tid, 0);
+    for (size_t i = 0; i < n; ++i) pthread_join(tids[i], 0);
     return true;
 }
 
+int createStatsFd(const char *addr)
+{
+    int fd;
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        fprintf(stderr, "socket() error, %d:%s\n", errno, strerror(errno));
+        return -1;
+    }
+
+    struct sockaddr_un un;
+    memset(&un, 0x00, sizeof(un));
+    un.sun_family = AF_UNIX;
+    strncpy(un.sun_path, addr, sizeof(un.sun_path) - 1);
+
+    unlink(addr);
+
+    if (bind(fd, (struct sockaddr *)(&un), sizeof(un)) < 0 || listen(fd, 16) < 0) {
+        fprintf(stderr, "bind(%s) error, %d:%s\n", addr, errno, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (chmod(addr, 0600) != 0) {
+        fprintf(stderr, "chmod(%s, 0600) error, %d:%s\n", addr, errno, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+struct keeper_t {
+    RingBuffer             *rbuffer;
+    RingBuffer::FlushPolicy policy;
+    int                     interval;
+    int                     statsfd;
+    const char             *statsf;
+    int                     statsms;
+    const char             *notifyf;
+    int                     notifyms;
+    long                    start;
+    volatile bool           quit;
+
+    /* the drops already in the notify file */
+    uint64_t                notifiedMsgs;
+    uint64_t                notifiedBytes;
+    time_t                  notifiedAt;
+};
+
+void dumpStats(FILE *fp, keeper_t *keeper)
+{
+    statPrint(fp, "uptime_sec", (nowMsec() - keeper->start) / 1000);
+    keeper->rbuffer->dumpStats(fp);
+    if (logr) logr->dumpStats(fp);
+
+    /* reader_recv_msgs for the first -j thread, reader1_ for the next */
+    for (size_t i = 0; i < nlogr; ++i) {
+        char prefix[32];
+        if (i == 0) snprintf(prefix, sizeof(prefix), "reader");
+        else snprintf(prefix, sizeof(prefix), "reader%lu", (unsigned long) i);
+        logrs[i]->dumpStats(fp, prefix);
+    }
+    if (merger) merger->dumpStats(fp);
+
+    /* writer_send_bytes for the first dest, writer1_ for the next */
+    for (size_t i = 0; i < nlogw; ++i) {
+        char prefix[32];
+        if (i == 0) snprintf(prefix, sizeof(prefix), "writer");
+        else snprintf(prefix, sizeof(prefix), "writer%lu", (unsigned long) i);
+        logw[i]->dumpStats(fp, prefix);
+    }
+}
+
+/* a reader that does not read gets cut off, the stats are small */
+void serveStats(keeper_t *keeper)
+{
+    int fd = accept(keeper->statsfd, 0, 0);
+    if (fd == -1) return;
+
+    struct timeval tv = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    FILE *fp = fdopen(fd, "w");
+    if (!fp) {
+        close(fd);
+        return;
+    }
+    dumpStats(fp, keeper);
+    fclose(fp);
+}
+
+/* the stats file is replaced by rename, readers never see half of it */
+void writeStats(keeper_t *keeper)
+{
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", keeper->statsf);
+
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        fprintf(stderr, "fopen(%s) error, %d:%s\n", tmp, errno, strerror(errno));
+        return;
+    }
+    dumpStats(fp, keeper);
+    if (fclose(fp) != 0 || rename(tmp, keeper->statsf) != 0) {
+        fprintf(stderr, "rename(%s) error, %d:%s\n", tmp, errno, strerror(errno));
+        unlink(tmp);
+    }
+}
+
+/* only when something was dropped since the last time */
+void notifyDrops(keeper_t *keeper)
+{
+    uint64_t msgs, bytes;
+    keeper->rbuffer->dropped(&msgs, &bytes);
+    if (msgs == keeper->notifiedMsgs) return;
+
+    FILE *fp = fopen(keeper->notifyf, "w");
+    if (!fp) return;
+
+    time_t now = time(0);
+    fprintf(fp, "syslog-safer: DROP @%ld dropped %llu messages (%llu bytes) since %ld",
+            (long) now, (unsigned long long) (msgs - keeper->notifiedMsgs),
+            (unsigned long long) (bytes - keeper->notifiedBytes), (long) keeper->notifiedAt);
+    fclose(fp);
+
+    keeper->notifiedMsgs  = msgs;
+    keeper->notifiedBytes = bytes;
+    keeper->notifiedAt    = now;
+}
+
+/* msync of the spool, the stats and drop notices run here, the reader and writer
+ * never wait on them.
+ */
+void *keepRoutine(void *data)
+{
+    keeper_t *keeper = (keeper_t *) data;
+
+    long lastFlush = nowMsec(), lastStats = lastFlush, lastNotify = lastFlush;
+    while (!keeper->quit) {
+        struct pollfd pfd;
+        pfd.fd     = keeper->statsfd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, keeper->statsfd != -1 ? 1 : 0, 10) > 0) serveStats(keeper);
+
+        long now = nowMsec();
+        if (now - lastFlush >= keeper->interval) {
+            keeper->rbuffer->flush(keeper->policy);
+            lastFlush = now;
+        }
+        if (keeper->statsf && now - lastStats >= keeper->statsms) {
+            writeStats(keeper);
+            lastStats = now;
+        }
+        if (keeper->notifyf && now - lastNotify >= keeper->notifyms) {
+            notifyDrops(keeper);
+            lastNotify = now;
+        }
+    }
+    keeper->rbuffer->flush(keeper->policy);
+    if (keeper->statsf) writeStats(keeper);
+    if (keeper->notifyf) notifyDrops(keeper);
+    return 0;
+}
+
 void sigHandler(int signo)
 {
     if (signo == SIGTERM) {
-        logr->stop();
+        if (logr) logr->stop();
+        for (size_t i = 0; i < nlogr; ++i) logrs[i]->stop();
+        if (merger) merger->stop();
+    } else if (signo == SIGHUP) {
+        for (size_t i = 0; i < nlogw; ++i) logw[i]->reopen();
     }
 }
 
@@ -146,21 +595,116 @@ int main(int argc, char *argv[])
 
     signal(SIGTERM, sigHandler);
 
-    RingBuffer rbuffer(config.bsize, config.verbose, config.notifyf, !config.stream);
-    LogReader<RingBuffer> logr(config.source, &rbuffer, config.stream);
-    LogWriter<RingBuffer> logw(config.dest, &rbuffer, config.stream);
+    /* -d then -a, the order of the consumers */
+    if (config.rules) {
+        const char *dests[RingBuffer::maxConsumers];
+        for (size_t i = 0; i < config.ndest; ++i) dests[i] = config.dest[i];
+        for (size_t i = 0; i < config.nalso; ++i) dests[config.ndest + i] = config.also[i];
 
-    pthread_t tid;
-    if (!startWriteThread(&tid, &logw)) {
-        fprintf(stderr, "can't start write thread, %d:%s\n", errno, strerror(errno));
-        return EXIT_FAILURE;
+        try {
+            router = new Router(config.rules, dests, config.ndest + config.nalso);
+        } catch (int eno) {
+            fprintf(stderr, "can't load rules %s, %d:%s\n", config.rules, eno, strerror(eno));
+            return EXIT_FAILURE;
+        }
     }
 
-    if (!logr.run()) {
-        stopWriteThread(&tid, &rbuffer);
+    Spill      *spill = 0;
+    RingBuffer *rbuffer;
+    try {
+        if (config.spilldir) spill = new Spill(config.spilldir, config.quota, !config.stream);
+        if (config.packsize) spill = new Spill(0, config.packsize, !config.stream);
+        rbuffer = new RingBuffer(config.bsize, config.verbose, config.report ? config.notifyms : 0,
+                                 !config.stream, config.sync, config.spool, spill,
+                                 config.evict);
+    } catch (int eno) {
+        fprintf(stderr, "can't create buffer, %d:%s\n", eno, strerror(eno));
         return EXIT_FAILURE;
     }
 
-    stopWriteThread(&tid, &rbuffer);
-    return EXIT_SUCCESS;
+    for (size_t i = 0; router && i < router->routes(); ++i) {
+        rbuffer->route(i, router->consumers(i));
+    }
+    rbuffer->router(router);
+
+    /* the -d dests first, the first of them is the first consumer */
+    for (size_t i = 0; i < config.ndest + config.nalso; ++i) {
+        bool required = i < config.ndest;
+        const char *dest = required ? config.dest[i] : config.also[i - config.ndest];
+
+        RingBuffer::Consumer *consumer = i == 0 ? rbuffer->consumer(0) :
+            rbuffer->addConsumer(required);
+        if (!consumer) return EXIT_FAILURE;
+
+        try {
+            logw[nlogw++] = new LogWriter<RingBuffer::Consumer>(dest, consumer, config.stream,
+                                                                config.wbatch, config.latency,
+                                                                config.framing, config.wtimeout,
+                                                                config.rotsize, config.rotsec,
+                                                                config.fsyncms, config.uring);
+        } catch (int eno) {
+            fprintf(stderr, "can't use dest %s, %d:%s\n", dest, eno, strerror(eno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    signal(SIGHUP, sigHandler);
+
+    pthread_t tids[RingBuffer::maxConsumers];
+    for (size_t i = 0; i < nlogw; ++i) {
+        if (!startWriteThread(&tids[i], logw[i])) {
+            fprintf(stderr, "can't start write thread, %d:%s\n", errno, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    keeper_t keeper = { rbuffer, config.spool ? config.flush : RingBuffer::FlushNone,
+                        config.flushms, -1, config.statsf, config.statsms,
+                        config.notifyf, config.notifyms, nowMsec(), false, 0, 0, time(0) };
+    if (config.statsock) {
+        keeper.statsfd = createStatsFd(config.statsock);
+        if (keeper.statsfd == -1) return EXIT_FAILURE;
+    }
+
+    pthread_t ktid;
+    bool keeping = (keeper.policy != RingBuffer::FlushNone || keeper.statsfd != -1 ||
+                    keeper.statsf || keeper.notifyf) &&
+        pthread_create(&ktid, 0, keepRoutine, &keeper) == 0;
+
+    bool ok;
+    if (config.threads == 1) {
+        logr = new LogReader<RingBuffer>(config.source, rbuffer, config.stream, config.rbatch,
+                                         config.shmsock, config.uring, newLimiter(&config),
+                                         newDedup(&config), router);
+        ok = logr->run();
+    } else {
+        pthread_t rtids[StageMerger::maxStages];
+        ok = startReadThreads(rtids, &config, rbuffer);
+        if (ok) {
+            merger->run();
+            for (size_t i = 0; i < nlogr; ++i) pthread_join(rtids[i], 0);
+
+            /* what the readers got before they saw SIGTERM */
+            merger->run();
+        }
+    }
+
+    stopWriteThreads(tids, nlogw, rbuffer);
+    if (keeping) {
+        keeper.quit = true;
+        pthread_join(ktid, 0);
+    }
+    if (keeper.statsfd != -1) {
+        close(keeper.statsfd);
+        unlink(config.statsock);
+    }
+    for (size_t i = 0; i < nlogw; ++i) delete logw[i];
+    delete logr;
+    for (size_t i = 0; i < nlogr; ++i) delete logrs[i];
+    delete merger;
+    delete rbuffer;
+    delete spill;
+    delete router;
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,158 @@
+/* vim:expandtab:shiftwidth=4:tabstop=4:smarttab:
+ */
+
+#ifndef _SYSLOGMSG_H_
+#define _SYSLOGMSG_H_
+
+#include <cstddef>
+#include <cstring>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* what the reader learns from a message once at ingest,
+ * it is kept in RingBuffer::Record::flags.
+ */
+enum {
+    MsgPriMask = 0x000000ff,     // facility << 3 | severity
+    MsgHasPri  = 0x00000100,
+    MsgSenderMask = 0x00ff0000,  // senderTag() of the process, 0 if unknown
+    MsgRouteMask  = 0xff000000,  // Router route, 0 goes to every dest
+};
+
+static const int msgSenderShift = 16;
+static const int nsender = 256;
+static const int msgRouteShift = 24;
+static const int nroute = 256;
+
+static const int defaultPri = 13;   // user.notice, RFC 3164 4.3.3
+
+inline int msgSeverity(uint32_t flags)
+{
+    return (flags & MsgPriMask) & 0x07;
+}
+
+inline int msgFacility(uint32_t flags)
+{
+    return (flags & MsgPriMask) >> 3;
+}
+
+inline int msgSender(uint32_t flags)
+{
+    return (flags & MsgSenderMask) >> msgSenderShift;
+}
+
+inline int msgRoute(uint32_t flags)
+{
+    return (flags & MsgRouteMask) >> msgRouteShift;
+}
+
+/* pid and uid folded into a slot 1-255, processes that share a slot
+ * share what is kept per sender. no pid is slot 0.
+ */
+inline uint32_t senderTag(pid_t pid, uid_t uid)
+{
+    if (pid <= 0) return 0;
+
+    uint32_t h = (uint32_t) pid * 0x9e3779b1u ^ (uint32_t) uid * 0x85ebca6bu;
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+    return (h % (nsender - 1) + 1) << msgSenderShift;
+}
+
+/* "<PRI>" is 3 to 5 bytes, PRI is 0-191 */
+inline uint32_t parsePri(const char *msg, size_t n)
+{
+    if (n < 3 || msg[0] != '<') return defaultPri;
+
+    int pri = 0;
+    size_t i = 1;
+    for (; i < n && i < 4 && msg[i] >= '0' && msg[i] <= '9'; ++i) {
+        pri = pri * 10 + (msg[i] - '0');
+    }
+    if (i == 1 || i >= n || msg[i] != '>' || pri > 191) return defaultPri;
+
+    return MsgHasPri | pri;
+}
+
+/* where a message goes on after "<PRI>" and the RFC 3164 timestamp
+ * "Mmm dd hh:mm:ss ", both are optional.
+ */
+inline size_t skipHeader(const char *msg, size_t n)
+{
+    size_t i = 0;
+    const char *gt = n > 0 && msg[0] == '<' ?
+        (const char *) memchr(msg, '>', n < 5 ? n : 5) : 0;
+    if (gt) i = gt - msg + 1;
+
+    if (n - i >= 16 && msg[i+3] == ' ' && msg[i+6] == ' ' && msg[i+9] == ':' &&
+        msg[i+12] == ':' && msg[i+15] == ' ') {
+        i += 16;
+    }
+    return i;
+}
+
+/* the RFC 3164 TAG, "<PRI>Mmm dd hh:mm:ss [HOSTNAME ]TAG[pid]: MSG",
+ * up to 32 characters. the timestamp and the hostname are optional,
+ * *len is 0 if there is no TAG.
+ */
+inline const char *parseTag(const char *msg, size_t n, size_t *len)
+{
+    size_t i = skipHeader(msg, n);
+
+    *len = 0;
+    for (int word = 0; word < 2; ++word) {
+        size_t j = i;
+        while (j < n && j - i < 32 && msg[j] > ' ' && msg[j] != ':' && msg[j] != '[') ++j;
+        if (j == i || j == n) break;
+
+        if (msg[j] == ':' || msg[j] == '[') {
+            *len = j - i;
+            break;
+        }
+        if (msg[j] != ' ') break;
+        i = j + 1;               // it was the hostname
+    }
+    return msg + i;
+}
+
+/* how messages are delimited on a stream, RFC 6587 */
+enum Framing {
+    FrameLF,                     // MSG LF, a NUL ends a message too
+    FrameOctet,                  // MSGLEN SP MSG
+};
+
+/* the first message of a stream buffer, *off and *len locate it in buf.
+ * returns the bytes the whole frame takes, 0 if it is not complete, then
+ * *len is the length an octet counted frame announced (0 if unknown).
+ * a frame that starts with a digit is octet counted, any other uses a
+ * trailer, the trailer is not part of the message.
+ */
+inline size_t parseFrame(const char *buf, size_t n, size_t *off, size_t *len)
+{
+    *off = 0;
+    *len = 0;
+
+    if (n > 0 && buf[0] >= '1' && buf[0] <= '9') {
+        size_t i = 0, msglen = 0;
+        for (; i < n && i < 10 && buf[i] >= '0' && buf[i] <= '9'; ++i) {
+            msglen = msglen * 10 + (buf[i] - '0');
+        }
+        if (i == n) return 0;
+        if (buf[i] == ' ') {
+            *off = i + 1;
+            *len = msglen;
+            return (n - *off >= msglen) ? *off + msglen : 0;
+        }
+    }
+
+    const char *lf  = (const char *) memchr(buf, '\n', n);
+    const char *nul = (const char *) memchr(buf, '\0', lf ? lf - buf : n);
+    const char *end = nul ? nul : lf;
+    if (!end) return 0;
+
+    *len = end - buf;
+    return *len + 1;
+}
+
+#endif
@@ -0,0 +1,290 @@
+/* vim:expandtab:shiftwidth=4:tabstop=4:smarttab:
+ */
+
+#include <cstdio>
+#include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+#include <shmlog.h>
+
+/* LD_PRELOAD=libsyslogshim.so replaces openlog(), syslog() and friends,
+ * a message is formatted as glibc does into a thread local buffer and
+ * goes to the ring of SYSLOG_SAFER_SHM (the -u socket) if that is set,
+ * else or when the ring is full it is sent to SYSLOG_SAFER_SOCK
+ * (/dev/log) with MSG_DONTWAIT. what neither takes is dropped and
+ * counted, the next message that goes through tells how many. no call
+ * waits on syslog-safer, LOG_CONS is ignored for that, the ring is
+ * handed over without waiting for the answer, messages go to the socket
+ * until it is there.
+ *
+ * g++ -O2 -shared -fPIC syslogshim.cc shmlog.cc -I. -lpthread -o libsyslogshim.so
+ */
+
+static const size_t nbuffer = 16384;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;    // open and close only
+static const char *logIdent    = 0;
+static int         logOption   = 0;
+static int         logFacility = LOG_USER;
+static int         logMask     = 0xff;
+static int         sockfd      = -1;
+static int         senders     = 0;      // threads between loading sockfd and send()
+static int         shmState    = 0;      // 0 not tried, 1 open, -1 not yet, -2 not set
+static time_t      shmRetryAt  = 0;      // a failed handshake is tried once a second
+static time_t      sockRetryAt = 0;      // a failed connect is tried once a second
+static bool        atfork      = false;
+static uint64_t    drops       = 0;
+
+static __thread char buffer[nbuffer];
+
+static void forkChild()
+{
+    pthread_mutex_init(&mutex, 0);
+    senders = 0;
+    if (shmState != -2) shmState = 0;
+}
+
+static int connectSock()
+{
+    const char *path = getenv("SYSLOG_SAFER_SOCK");
+    if (!path) path = _PATH_LOG;
+
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+
+    struct sockaddr_un un;
+    memset(&un, 0x00, sizeof(un));
+    un.sun_family = AF_UNIX;
+    strncpy(un.sun_path, path, sizeof(un.sun_path) - 1);
+
+    if (connect(fd, (struct sockaddr *) &un, sizeof(un)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* called with the lock held. a sender may have loaded sockfd and not
+ * sent yet, the fd is closed once none has, so its number can not go
+ * to another file of the program while a message is on its way.
+ */
+static void retireSock()
+{
+    int fd = sockfd;
+    if (fd == -1) return;
+
+    __atomic_store_n(&sockfd, -1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&senders, __ATOMIC_SEQ_CST) != 0) sched_yield();
+    close(fd);
+}
+
+static bool shmDue()
+{
+    return shmState == 0 || (shmState == -1 && time(0) >= shmRetryAt);
+}
+
+/* connects what is not connected yet, reconnect replaces a dead socket.
+ * the new one takes the number of the old one, senders that still hold
+ * the number send to syslog-safer either way.
+ */
+static void openTransport(bool reconnect)
+{
+    pthread_mutex_lock(&mutex);
+    if (!atfork) atfork = pthread_atfork(0, 0, forkChild) == 0;
+
+    if (shmDue()) {
+        const char *shm = getenv("SYSLOG_SAFER_SHM");
+        if (!shm) {
+            shmState = -2;
+        } else if (shmlogOpenNonblock(shm, 0) == 0) {
+            shmState = 1;
+        } else {
+            /* an answer on its way is looked for by the next call */
+            shmState   = -1;
+            shmRetryAt = time(0) + (errno == EINPROGRESS ? 0 : 1);
+        }
+    }
+    if (reconnect && sockfd != -1) {
+        int fd = connectSock();
+        if (fd != -1 && dup3(fd, sockfd, O_CLOEXEC) != -1) {
+            close(fd);
+        } else {
+            if (fd != -1) close(fd);
+            retireSock();
+        }
+    }
+    if (sockfd == -1) {
+        __atomic_store_n(&sockfd, connectSock(), __ATOMIC_SEQ_CST);
+        if (sockfd == -1) sockRetryAt = time(0) + 1;
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+static bool sendOnce(const char *msg, size_t n)
+{
+    __atomic_add_fetch(&senders, 1, __ATOMIC_SEQ_CST);
+
+    ssize_t nn = -1;
+    int fd = __atomic_load_n(&sockfd, __ATOMIC_SEQ_CST);
+    if (fd == -1) errno = ENOTCONN;
+    while (fd != -1 && (nn = send(fd, msg, n, MSG_DONTWAIT | MSG_NOSIGNAL)) == -1 &&
+           errno == EINTR) {
+    }
+
+    int saved = errno;
+    __atomic_sub_fetch(&senders, 1, __ATOMIC_SEQ_CST);
+    errno = saved;
+    return nn != -1;
+}
+
+static bool sendSock(const char *msg, size_t n)
+{
+    if (__atomic_load_n(&sockfd, __ATOMIC_RELAXED) == -1) return false;
+    if (sendOnce(msg, n)) return true;
+
+    /* syslog-safer was restarted, one more try on a new socket */
+    if (errno != ECONNREFUSED && errno != ENOTCONN) return false;
+    openTransport(true);
+
+    return sendOnce(msg, n);
+}
+
+static bool deliver(const char *msg, size_t n)
+{
+    if (shmState == 1) {
+        if (shmlogWrite(msg, n) == 0) return true;
+        if (errno == ENOTCONN) {
+            shmState   = -1;
+            shmRetryAt = time(0) + 1;
+        }
+    }
+    return sendSock(msg, n);
+}
+
+/* "<PRI>Mmm dd hh:mm:ss ident[pid]: ", as glibc writes it */
+static size_t header(char *buf, size_t size, int pri)
+{
+    time_t now = time(0);
+    struct tm tm;
+    localtime_r(&now, &tm);
+
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%h %e %T", &tm);
+
+    const char *ident = logIdent ? logIdent : program_invocation_short_name;
+    int n = (logOption & LOG_PID) ?
+        snprintf(buf, size, "<%d>%s %s[%d]: ", pri, stamp, ident, (int) getpid()) :
+        snprintf(buf, size, "<%d>%s %s: ", pri, stamp, ident);
+    return (n > 0 && (size_t) n < size) ? n : size - 1;
+}
+
+static void report(int saved)
+{
+    uint64_t n = __atomic_exchange_n(&drops, 0, __ATOMIC_RELAXED);
+    if (n == 0) return;
+
+    char msg[256];
+    size_t len = header(msg, sizeof(msg), LOG_SYSLOG | LOG_WARNING);
+    len += snprintf(msg + len, sizeof(msg) - len, "syslog-safer shim dropped %llu messages",
+                    (unsigned long long) n);
+    if (len >= sizeof(msg)) len = sizeof(msg) - 1;
+    if (!deliver(msg, len)) __atomic_add_fetch(&drops, n, __ATOMIC_RELAXED);
+    errno = saved;
+}
+
+extern "C" {
+
+void openlog(const char *ident, int option, int facility)
+{
+    pthread_mutex_lock(&mutex);
+    logIdent  = ident;
+    logOption = option;
+    if (facility != 0 && (facility & ~LOG_FACMASK) == 0) logFacility = facility;
+    pthread_mutex_unlock(&mutex);
+
+    if (option & LOG_NDELAY) openTransport(false);
+}
+
+void closelog(void)
+{
+    pthread_mutex_lock(&mutex);
+    retireSock();
+    if (shmState == 1) shmlogClose();
+    shmState = 0;
+    logIdent = 0;
+    pthread_mutex_unlock(&mutex);
+}
+
+int setlogmask(int mask)
+{
+    int old = logMask;
+    if (mask != 0) logMask = mask;
+    return old;
+}
+
+void vsyslog(int pri, const char *fmt, va_list ap)
+{
+    if (pri & ~(LOG_PRIMASK | LOG_FACMASK)) pri &= LOG_PRIMASK | LOG_FACMASK;
+    if (!(LOG_MASK(LOG_PRI(pri)) & logMask)) return;
+    if ((pri & LOG_FACMASK) == 0) pri |= logFacility;
+
+    int saved = errno;
+    if (shmDue() || (sockfd == -1 && time(0) >= sockRetryAt)) openTransport(false);
+
+    size_t n = header(buffer, nbuffer, pri);
+    size_t hdr = n;
+
+    /* glibc's printf knows %m, errno is the caller's */
+    errno = saved;
+    int len = vsnprintf(buffer + n, nbuffer - n, fmt, ap);
+    if (len > 0) n += ((size_t) len < nbuffer - n) ? (size_t) len : nbuffer - n - 1;
+
+    if (logOption & LOG_PERROR) {
+        struct iovec iov[2] = { { buffer + hdr, n - hdr }, { (void *) "\n", 1 } };
+        ssize_t nn = writev(STDERR_FILENO, iov, buffer[n - 1] == '\n' ? 1 : 2);
+        (void) nn;
+    }
+
+    if (deliver(buffer, n)) {
+        report(saved);
+    } else {
+        __atomic_add_fetch(&drops, 1, __ATOMIC_RELAXED);
+    }
+    errno = saved;
+}
+
+void syslog(int pri, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsyslog(pri, fmt, ap);
+    va_end(ap);
+}
+
+/* what -D_FORTIFY_SOURCE makes of syslog() and vsyslog() */
+void __vsyslog_chk(int pri, int, const char *fmt, va_list ap)
+{
+    vsyslog(pri, fmt, ap);
+}
+
+void __syslog_chk(int pri, int, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsyslog(pri, fmt, ap);
+    va_end(ap);
+}
+
+}
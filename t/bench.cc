@@ -0,0 +1,536 @@
+/* vim:expandtab:shiftwidth=4:tabstop=4:smarttab:
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstddef>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <stats.h>
+#include <syslogmsg.h>
+#include <shmlog.h>
+
+/* end-to-end benchmark, starts syslog-safer between client threads and
+ * a sink, every message carries its client, sequence and send time, the
+ * sink measures ingest to delivery latency and what was lost.
+ * one JSON object per run goes to stdout. with -o the sink listens on
+ * loopback and syslog-safer forwards to it over tcp or udp. -t shm logs
+ * through libshmlog instead of a socket.
+ *
+ * g++ -O2 -Wall bench.cc -I.. -lpthread -o bench
+ */
+
+struct bench_t {
+    const char *name;
+    const char *daemon;
+    const char *args;
+    bool        stream;
+    bool        shm;
+    const char *net;             // "tcp" or "udp" sink, 0 for a unix one
+    bool        sinkStream;
+    int         clients;
+    int         rate;            // msgs/s per client, 0 as fast as possible
+    int         seconds;
+    char        dist;            // 'f'ixed, 'u'niform or 'e'xponential sizes
+    size_t      sizeMin;
+    size_t      sizeMax;
+    int         delay;           // sink usec per message
+    int         block;           // sink stops reading ms of every second
+    char        dir[64];
+    char        src[128];
+    char        shmsock[128];
+    char        dst[128];
+    char        pid[128];
+};
+
+struct client_t {
+    bench_t      *bench;
+    int           id;
+    uint64_t      sent;
+    uint64_t      bytes;
+    unsigned int  seed;
+    pthread_t     tid;
+};
+
+struct sink_t {
+    bench_t              *bench;
+    int                   fd;
+    volatile bool         quit;
+    uint64_t              received;
+    uint64_t              bytes;
+    uint64_t              other;         // not from a client, e.g. drop reports
+    uint64_t              last;          // usec of the last delivery
+    std::vector<uint32_t> latency;
+    std::vector<uint64_t> seen;          // per client
+    pthread_t             tid;
+};
+
+static volatile bool stopClients = false;
+
+static int usage(const char *error = 0)
+{
+    if (error) fprintf(stderr, "%s\n", error);
+    fprintf(stderr,
+            "usage: bench -x syslog-safer [options]\n"
+            "   -n name of the run, default bench\n"
+            "   -a \"args\", more arguments for syslog-safer\n"
+            "   -t stream|dgram|shm, default dgram\n"
+            "   -o tcp|udp, forward to a sink on 127.0.0.1 instead of a unix socket\n"
+            "   -c clients, default 4\n"
+            "   -r msgs/s per client, default 0 (no limit)\n"
+            "   -T seconds, default 5\n"
+            "   -z N | min:max | ~mean, fixed, uniform or exponential sizes, default 64:1024\n"
+            "   -k usec, the sink spends usec per message, default 0\n"
+            "   -K ms, the sink does not read ms of every second, default 0\n");
+    return error ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static bool parseDist(const char *arg, bench_t *bench)
+{
+    if (arg[0] == '~') {
+        bench->dist    = 'e';
+        bench->sizeMin = strtoul(arg + 1, 0, 10);
+        bench->sizeMax = bench->sizeMin * 16;
+    } else if (strchr(arg, ':')) {
+        bench->dist = 'u';
+        if (sscanf(arg, "%zu:%zu", &bench->sizeMin, &bench->sizeMax) != 2) return false;
+    } else {
+        bench->dist    = 'f';
+        bench->sizeMin = bench->sizeMax = strtoul(arg, 0, 10);
+    }
+    return bench->sizeMin > 0 && bench->sizeMin <= bench->sizeMax;
+}
+
+static void getoption(int argc, char *argv[], bench_t *bench)
+{
+    memset(bench, 0x00, sizeof(*bench));
+    bench->name    = "bench";
+    bench->args    = "";
+    bench->clients = 4;
+    bench->seconds = 5;
+    parseDist("64:1024", bench);
+
+    int c;
+    while ((c = getopt(argc, argv, "x:n:a:t:o:c:r:T:z:k:K:h")) != -1) {
+        switch (c) {
+            case 'x': bench->daemon  = optarg; break;
+            case 'n': bench->name    = optarg; break;
+            case 'a': bench->args    = optarg; break;
+            case 't':
+                bench->stream = (strcmp(optarg, "stream") == 0);
+                bench->shm    = (strcmp(optarg, "shm") == 0);
+                break;
+            case 'o': bench->net     = optarg; break;
+            case 'c': bench->clients = atoi(optarg); break;
+            case 'r': bench->rate    = atoi(optarg); break;
+            case 'T': bench->seconds = atoi(optarg); break;
+            case 'z': if (!parseDist(optarg, bench)) exit(usage("bad -z")); break;
+            case 'k': bench->delay   = atoi(optarg); break;
+            case 'K': bench->block   = atoi(optarg); break;
+            case 'h': exit(usage()); break;
+            default: exit(usage("unknow option"));
+        }
+    }
+
+    if (!bench->daemon) exit(usage("you must appoint -x"));
+    if (bench->clients < 1 || bench->seconds < 1) exit(usage("-c and -T at least 1"));
+    if (bench->block >= 1000) exit(usage("-K must be less than 1000"));
+    if (bench->net && strcmp(bench->net, "tcp") != 0 && strcmp(bench->net, "udp") != 0) {
+        exit(usage("-o must be tcp or udp"));
+    }
+    bench->sinkStream = bench->net ? strcmp(bench->net, "tcp") == 0 : bench->stream;
+
+    snprintf(bench->dir, sizeof(bench->dir), "/tmp/ssbench.%d", getpid());
+    snprintf(bench->src, sizeof(bench->src), "%s/src.sock", bench->dir);
+    snprintf(bench->shmsock, sizeof(bench->shmsock), "%s/shm.sock", bench->dir);
+    snprintf(bench->dst, sizeof(bench->dst), "%s/dst.sock", bench->dir);
+    snprintf(bench->pid, sizeof(bench->pid), "%s/pid", bench->dir);
+}
+
+static int unixSocket(const char *path, bool stream, bool listening)
+{
+    int fd = socket(AF_UNIX, stream ? SOCK_STREAM : SOCK_DGRAM, 0);
+    if (fd == -1) {
+        fprintf(stderr, "socket() error, %d:%s\n", errno, strerror(errno));
+        return -1;
+    }
+
+    struct sockaddr_un un;
+    memset(&un, 0x00, sizeof(un));
+    un.sun_family = AF_UNIX;
+    strncpy(un.sun_path, path, sizeof(un.sun_path) - 1);
+
+    int rc;
+    if (listening) {
+        unlink(path);
+        rc = bind(fd, (struct sockaddr *) &un, sizeof(un));
+        if (rc == 0 && stream) rc = listen(fd, 16);
+    } else {
+        rc = connect(fd, (struct sockaddr *) &un, sizeof(un));
+    }
+
+    if (rc != 0) {
+        fprintf(stderr, "%s(%s) error, %d:%s\n", listening ? "bind" : "connect",
+                path, errno, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* a loopback sink on a port of the kernel's choice, dst names it */
+static int inetSocket(bench_t *bench)
+{
+    int fd = socket(AF_INET, bench->sinkStream ? SOCK_STREAM : SOCK_DGRAM, 0);
+    if (fd == -1) {
+        fprintf(stderr, "socket() error, %d:%s\n", errno, strerror(errno));
+        return -1;
+    }
+
+    struct sockaddr_in in;
+    socklen_t len = sizeof(in);
+    memset(&in, 0x00, sizeof(in));
+    in.sin_family      = AF_INET;
+    in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int rcvbuf = 4 * 1024 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    if (bind(fd, (struct sockaddr *) &in, sizeof(in)) != 0 ||
+        (bench->sinkStream && listen(fd, 16) != 0) ||
+        getsockname(fd, (struct sockaddr *) &in, &len) != 0) {
+        fprintf(stderr, "bind(127.0.0.1) error, %d:%s\n", errno, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    snprintf(bench->dst, sizeof(bench->dst), "%s://127.0.0.1:%d", bench->net, ntohs(in.sin_port));
+    return fd;
+}
+
+static size_t msgSize(client_t *client)
+{
+    bench_t *bench = client->bench;
+    if (bench->dist == 'f') return bench->sizeMin;
+
+    double r = rand_r(&client->seed) / (RAND_MAX + 1.0);
+    if (bench->dist == 'u') return bench->sizeMin + (size_t) (r * (bench->sizeMax - bench->sizeMin + 1));
+
+    size_t size = (size_t) (-log1p(-r) * bench->sizeMin);
+    return size < 16 ? 16 : size > bench->sizeMax ? bench->sizeMax : size;
+}
+
+static void *clientRoutine(void *data)
+{
+    client_t *client = (client_t *) data;
+    bench_t  *bench  = client->bench;
+
+    int fd = bench->shm ? -1 : unixSocket(bench->src, bench->stream, false);
+    if (fd == -1 && !bench->shm) return 0;
+
+    char *buffer = new char[bench->sizeMax + 128];
+    uint64_t start = nowUsec();
+
+    while (!stopClients) {
+        if (bench->rate > 0) {
+            uint64_t due = start + client->sent * 1000000 / bench->rate;
+            uint64_t now = nowUsec();
+            if (due > now) usleep(due - now);
+        }
+
+        int n = snprintf(buffer, 128, "<13>bench %d %llu %llu ", client->id,
+                         (unsigned long long) client->sent, (unsigned long long) nowUsec());
+        size_t size = msgSize(client);
+        if (size > (size_t) n) {
+            memset(buffer + n, 'x', size - n);
+            n = size;
+        }
+        if (bench->stream) buffer[n++] = '\n';
+
+        /* a full ring drops the message, it shows as dropped */
+        if (bench->shm) {
+            if (shmlogWrite(buffer, n) != 0 && errno != EAGAIN) {
+                fprintf(stderr, "shmlogWrite() error, %d:%s\n", errno, strerror(errno));
+                break;
+            }
+            ++client->sent;
+            client->bytes += n;
+            continue;
+        }
+
+        ssize_t nn = send(fd, buffer, n, MSG_NOSIGNAL);
+        if (nn != n) {
+            if (nn == -1 && errno == EINTR) continue;
+            fprintf(stderr, "send() error, %d:%s\n", errno, strerror(errno));
+            break;
+        }
+        ++client->sent;
+        client->bytes += n;
+    }
+
+    delete[] buffer;
+    if (fd != -1) close(fd);
+    return 0;
+}
+
+static void deliver(sink_t *sink, const char *msg, size_t n)
+{
+    int id;
+    unsigned long long seq, stamp;
+
+    uint64_t now = nowUsec();
+    sink->last   = now;
+    sink->bytes += n;
+
+    if (n < 11 || memcmp(msg, "<13>bench ", 10) != 0 ||
+        sscanf(msg + 10, "%d %llu %llu", &id, &seq, &stamp) != 3 ||
+        id < 0 || (size_t) id >= sink->seen.size()) {
+        ++sink->other;
+        return;
+    }
+
+    statAdd(&sink->received);
+    ++sink->seen[id];
+    sink->latency.push_back(now > stamp ? (uint32_t) (now - stamp) : 0);
+    if (sink->bench->delay > 0) usleep(sink->bench->delay);
+}
+
+/* a blocked sink just stops reading for block ms of every second */
+static void blocked(sink_t *sink, uint64_t start)
+{
+    int block = sink->bench->block;
+    if (block <= 0) return;
+
+    uint64_t ms = (nowUsec() - start) / 1000 % 1000;
+    if (ms < (uint64_t) block) usleep((block - ms) * 1000);
+}
+
+static void *sinkRoutine(void *data)
+{
+    sink_t  *sink  = (sink_t *) data;
+    bench_t *bench = sink->bench;
+
+    size_t cap = 256 * 1024, nbuf = 0;
+    char *buffer = new char[cap];
+    int conn = -1;
+    uint64_t start = nowUsec();
+
+    while (!sink->quit) {
+        blocked(sink, start);
+
+        struct pollfd pfd;
+        pfd.fd     = conn != -1 ? conn : sink->fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 100) <= 0) continue;
+
+        if (!bench->sinkStream) {
+            ssize_t nn = recv(sink->fd, buffer, cap, 0);
+            if (nn > 0) deliver(sink, buffer, nn);
+            continue;
+        }
+
+        if (conn == -1) {
+            conn = accept(sink->fd, 0, 0);
+            nbuf = 0;
+            continue;
+        }
+
+        ssize_t nn = recv(conn, buffer + nbuf, cap - nbuf, 0);
+        if (nn <= 0) {
+            close(conn);
+            conn = -1;
+            continue;
+        }
+        nbuf += nn;
+
+        /* tcp comes octet counted, "MSGLEN SP MSG", the rest LF ended */
+        size_t pos = 0;
+        if (bench->net) {
+            size_t off, len, n;
+            while ((n = parseFrame(buffer + pos, nbuf - pos, &off, &len)) != 0) {
+                deliver(sink, buffer + pos + off, len);
+                pos += n;
+            }
+        } else {
+            char *lf;
+            while ((lf = (char *) memchr(buffer + pos, '\n', nbuf - pos)) != 0) {
+                deliver(sink, buffer + pos, lf - (buffer + pos));
+                pos = lf - buffer + 1;
+            }
+        }
+        nbuf -= pos;
+        memmove(buffer, buffer + pos, nbuf);
+        if (nbuf == cap) nbuf = 0;
+    }
+
+    if (conn != -1) close(conn);
+    delete[] buffer;
+    return 0;
+}
+
+static pid_t startDaemon(bench_t *bench)
+{
+    std::vector<char *> argv;
+    char args[1024];
+    snprintf(args, sizeof(args), "%s", bench->args);
+
+    argv.push_back((char *) bench->daemon);
+    argv.push_back((char *) "-s");
+    argv.push_back(bench->src);
+    argv.push_back((char *) "-d");
+    argv.push_back(bench->dst);
+    argv.push_back((char *) "-p");
+    argv.push_back(bench->pid);
+    argv.push_back((char *) "-t");
+    argv.push_back((char *) (bench->stream ? "stream" : "dgram"));
+    if (bench->shm) {
+        argv.push_back((char *) "-u");
+        argv.push_back(bench->shmsock);
+    }
+    for (char *arg = strtok(args, " "); arg; arg = strtok(0, " ")) argv.push_back(arg);
+    argv.push_back(0);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        execv(bench->daemon, &argv[0]);
+        fprintf(stderr, "execv(%s) error, %d:%s\n", bench->daemon, errno, strerror(errno));
+        _exit(127);
+    }
+    return pid;
+}
+
+static bool waitSocket(const char *path)
+{
+    for (int i = 0; i < 100; ++i) {
+        if (access(path, F_OK) == 0) return true;
+        usleep(20 * 1000);
+    }
+    return false;
+}
+
+static uint32_t quantile(const std::vector<uint32_t> &v, double q)
+{
+    if (v.empty()) return 0;
+    size_t i = (size_t) (q * v.size());
+    return v[i < v.size() ? i : v.size() - 1];
+}
+
+int main(int argc, char *argv[])
+{
+    bench_t bench;
+    getoption(argc, argv, &bench);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (mkdir(bench.dir, 0700) != 0) {
+        fprintf(stderr, "mkdir(%s) error, %d:%s\n", bench.dir, errno, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    sink_t sink;
+    sink.bench    = &bench;
+    sink.quit     = false;
+    sink.received = sink.bytes = sink.other = sink.last = 0;
+    sink.seen.assign(bench.clients, 0);
+    sink.fd = bench.net ? inetSocket(&bench) : unixSocket(bench.dst, bench.stream, true);
+    if (sink.fd == -1) return EXIT_FAILURE;
+    pthread_create(&sink.tid, 0, sinkRoutine, &sink);
+
+    pid_t pid = startDaemon(&bench);
+    if (pid == -1 || !waitSocket(bench.src) || (bench.shm && !waitSocket(bench.shmsock))) {
+        fprintf(stderr, "can't start %s\n", bench.daemon);
+        return EXIT_FAILURE;
+    }
+    if (bench.shm && shmlogOpen(bench.shmsock, 16 * 1024 * 1024) != 0) {
+        fprintf(stderr, "shmlogOpen(%s) error, %d:%s\n", bench.shmsock, errno, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    std::vector<client_t> clients(bench.clients);
+    uint64_t start = nowUsec();
+    for (int i = 0; i < bench.clients; ++i) {
+        clients[i].bench = &bench;
+        clients[i].id    = i;
+        clients[i].sent  = clients[i].bytes = 0;
+        clients[i].seed  = i + 1;
+        pthread_create(&clients[i].tid, 0, clientRoutine, &clients[i]);
+    }
+
+    sleep(bench.seconds);
+    stopClients = true;
+
+    uint64_t sent = 0, sentBytes = 0;
+    for (int i = 0; i < bench.clients; ++i) {
+        pthread_join(clients[i].tid, 0);
+        sent      += clients[i].sent;
+        sentBytes += clients[i].bytes;
+    }
+    uint64_t stop = nowUsec();
+
+    /* the backlog drains until nothing arrives for a second, 30s at most */
+    uint64_t received;
+    do {
+        received = statGet(&sink.received);
+        sleep(1);
+    } while (statGet(&sink.received) != received &&
+             nowUsec() - stop < 30 * 1000000ULL);
+
+    kill(pid, SIGTERM);
+    int status;
+    struct rusage ru;
+    memset(&ru, 0x00, sizeof(ru));
+    wait4(pid, &status, 0, &ru);
+
+    sink.quit = true;
+    pthread_join(sink.tid, 0);
+    close(sink.fd);
+
+    shmlogClose();
+    unlink(bench.src);
+    unlink(bench.shmsock);
+    unlink(bench.dst);
+    unlink(bench.pid);
+    rmdir(bench.dir);
+
+    std::sort(sink.latency.begin(), sink.latency.end());
+
+    double elapsed = ((sink.last > start ? sink.last : stop) - start) / 1e6;
+    double cpu = ru.ru_utime.tv_sec * 1e9 + ru.ru_utime.tv_usec * 1e3 +
+                 ru.ru_stime.tv_sec * 1e9 + ru.ru_stime.tv_usec * 1e3;
+
+    printf("{\"name\":\"%s\",\"proto\":\"%s\",\"args\":\"%s\",\"clients\":%d,\"rate\":%d,"
+           "\"seconds\":%d,\"size\":\"%c:%zu:%zu\",\"sink_delay_us\":%d,\"sink_block_ms\":%d,"
+           "\"sent\":%llu,\"sent_bytes\":%llu,\"delivered\":%llu,\"delivered_bytes\":%llu,"
+           "\"dropped\":%llu,\"other\":%llu,\"msgs_per_sec\":%.0f,\"mb_per_sec\":%.2f,"
+           "\"p50_us\":%u,\"p99_us\":%u,\"p999_us\":%u,\"max_us\":%u,\"cpu_ns_per_msg\":%.0f}\n",
+           bench.name, bench.net ? bench.net : (bench.shm ? "shm" : (bench.stream ? "stream" : "dgram")), bench.args, bench.clients,
+           bench.rate, bench.seconds, bench.dist, bench.sizeMin, bench.sizeMax,
+           bench.delay, bench.block,
+           (unsigned long long) sent, (unsigned long long) sentBytes,
+           (unsigned long long) sink.received, (unsigned long long) sink.bytes,
+           (unsigned long long) (sent > sink.received ? sent - sink.received : 0),
+           (unsigned long long) sink.other,
+           elapsed > 0 ? sink.received / elapsed : 0.0,
+           elapsed > 0 ? sink.bytes / elapsed / (1024 * 1024) : 0.0,
+           quantile(sink.latency, 0.5), quantile(sink.latency, 0.99),
+           quantile(sink.latency, 0.999),
+           sink.latency.empty() ? 0 : sink.latency.back(),
+           sent ? cpu / sent : 0.0);
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
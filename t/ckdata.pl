@@ -5,12 +5,22 @@ use warnings;
 
 use Digest::MD5;
 
+# --truncated=N, a line of N bytes that fails is a long one the reader
+# truncated to its buffer, any other part of it is an error
+my $truncated = 0;
+@ARGV = grep { /^--truncated=(\d+)$/ ? ($truncated = $1, 0) : 1 } @ARGV;
+
+my $ntruncated = 0;
 while (my $line = <>) {
     chomp($line);
     my ($md5, $len, $c) = split / /, $line;
     if (!defined $len || !defined $c || $md5 ne Digest::MD5::md5_hex($c)) {
+        if ($truncated && length($line) == $truncated && $len > length($c)) {
+            $ntruncated++;
+            next;
+        }
         die "checksum ERROR\n$line";
     }
 }
 
-print "checksum OK\n";
+print "checksum OK", ($truncated ? ", $ntruncated truncated" : ""), "\n";
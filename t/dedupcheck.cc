@@ -0,0 +1,75 @@
+/* vim:expandtab:shiftwidth=4:tabstop=4:smarttab:
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <dedup.h>
+
+/* Dedup checks, each case feeds repeated() the messages of a few senders
+ * in turn and counts what was collapsed and reported. inet senders and
+ * senders without credentials have no slot, sender 0, two of them must
+ * never collapse into one run.
+ */
+
+struct sender_t {
+    uint32_t    flags;
+    const char *msg;
+    int         times;           // in a row
+};
+
+struct case_t {
+    const char *name;
+    sender_t    senders[2];
+    int         rounds;          // each sender in turn
+    uint64_t    repeated;        // expected
+    uint64_t    reports;
+};
+
+static const uint32_t inet   = 13;
+static const uint32_t local1 = 13 | senderTag(100, 0);
+static const uint32_t local2 = 13 | senderTag(200, 0);
+
+static const case_t cases[] = {
+    { "inet-alternate",  { { inet,   "<13>Oct 17 07:00:00 web1 app: same thing", 1 },
+                           { inet,   "<13>Oct 17 07:00:00 web2 app: same thing", 1 } }, 10, 0,  0 },
+    { "inet-same-text",  { { inet,   "<13>Oct 17 07:00:00 app: same thing",      5 },
+                           { inet,   "<13>Oct 17 07:00:01 app: same thing",      5 } }, 2,  0,  0 },
+    { "local-run",       { { local1, "<13>Oct 17 07:00:00 app[100]: same thing", 10 },
+                           { local1, "<13>Oct 17 07:00:00 app[100]: other",      1 } }, 1,  9,  1 },
+    { "local-alternate", { { local1, "<13>Oct 17 07:00:00 app[100]: same thing", 3 },
+                           { local2, "<13>Oct 17 07:00:00 app[200]: same thing", 3 } }, 4,  22, 0 },
+};
+
+static bool run(const case_t *cs)
+{
+    Dedup dedup(60000);
+    dedup.clock();
+
+    uint64_t repeated = 0, reports = 0;
+    char report[Dedup::maxReport];
+    size_t n;
+
+    for (int round = 0; round < cs->rounds; ++round) {
+        for (size_t i = 0; i < 2; ++i) {
+            const sender_t *s = &cs->senders[i];
+            for (int k = 0; k < s->times; ++k) {
+                if (dedup.repeated(s->msg, strlen(s->msg), s->flags, report, &n)) ++repeated;
+                if (n) ++reports;
+            }
+        }
+    }
+
+    bool ok = repeated == cs->repeated && reports == cs->reports;
+    printf("{\"case\":\"%s\",\"repeated\":%llu,\"reports\":%llu,\"ok\":%s}\n", cs->name,
+           (unsigned long long) repeated, (unsigned long long) reports, ok ? "true" : "false");
+    return ok;
+}
+
+int main()
+{
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) ok = run(&cases[i]) && ok;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -5,28 +5,50 @@
 #include <cstdlib>
 #include <cstring>
 #include <errno.h>
+#include <sys/uio.h>
 
 #include <logwriter.h>
 
 /* g++ -g -Wall input.cc -I. -o input
+ *
+ * lines longer than the reader's 16K buffer, each must come out once,
+ * truncated, and no rest of it as a message of its own:
+ *   perl mkdata.pl --min=100 --max=30000 --num=300 > long.txt
+ *   input long.txt src.sock stream, into syslog-safer -t stream
+ *   perl ckdata.pl --truncated=16384 out.txt
  */
 
 class InputFile {
 public:
-    InputFile(const char *file);
+    InputFile(const char *file, bool lines = false);
     ~InputFile();
 
     size_t read(char *buffer, size_t n);
+    size_t peek(struct iovec *iov, size_t *niov, size_t n);
+    bool commit();
+    bool rollback();
+
+    size_t peekRecords(struct iovec *iov, size_t nrecord, size_t n);
+    bool commit(size_t nrecord);
+    bool waitMore(int timeout);
+    bool ready(int timeout);
+
     static const size_t nbuffer = 81920 + 30;
 
 private:
-    FILE *fp_;
+    FILE  *fp_;
+    char   line_[nbuffer];
+    size_t nline_;
+    bool   lines_;
 };
 
-InputFile::InputFile(const char *file)
+/* with lines a record is a line without its LF, the writer frames it */
+InputFile::InputFile(const char *file, bool lines)
 {
+    lines_ = lines;
     fp_ = fopen(file, "r");
     if (!fp_) throw errno;
+    nline_ = 0;
 }
 
 InputFile::~InputFile()
@@ -45,6 +67,54 @@ size_t InputFile::read(char *buffer, size_t n)
     return line ? strlen(line) : 0;
 }
 
+size_t InputFile::peek(struct iovec *iov, size_t *niov, size_t n)
+{
+    if (nline_ == 0) nline_ = read(line_, n < nbuffer ? n : nbuffer);
+
+    iov[0].iov_base = line_;
+    iov[0].iov_len  = nline_;
+    *niov = nline_ ? 1 : 0;
+    return nline_;
+}
+
+bool InputFile::commit()
+{
+    nline_ = 0;
+    return true;
+}
+
+bool InputFile::rollback()
+{
+    return true;
+}
+
+size_t InputFile::peekRecords(struct iovec *iov, size_t nrecord, size_t n)
+{
+    size_t niov = 1;
+    if (nrecord == 0 || peek(iov, &niov, n) == 0) return 0;
+    if (lines_ && line_[nline_ - 1] == '\n') iov[0].iov_len = nline_ - 1;
+
+    iov[1].iov_base = line_;
+    iov[1].iov_len  = 0;
+    return 1;
+}
+
+bool InputFile::commit(size_t nrecord)
+{
+    if (nrecord) nline_ = 0;
+    return true;
+}
+
+bool InputFile::waitMore(int)
+{
+    return false;
+}
+
+bool InputFile::ready(int)
+{
+    return true;
+}
+
 int main(int argc, char *argv[])
 {
     if (argc != 4) {
@@ -56,7 +126,7 @@ int main(int argc, char *argv[])
     const char *dest = argv[2];
     bool isStream = (strcmp(argv[3], "stream") == 0);
 
-    InputFile input(src);
+    InputFile input(src, isStream);
     LogWriter<InputFile> logw(dest, &input, isStream);
 
     logw.run();
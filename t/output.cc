@@ -5,26 +5,37 @@
 #include <cstdlib>
 #include <cstring>
 #include <errno.h>
+#include <stdint.h>
+#include <sys/uio.h>
 
 #include <logreader.h>
+#include <inetaddr.h>
 
 /* g++ -g -Wall output.cc -I. -o output
+ *
+ * a tcp:// or udp:// srcsock is a loopback sink for the network dests,
+ * it is bound here and handed to the reader as its source.
  */
 
 class OutputFile {
 public:
-    OutputFile(const char *file);
+    OutputFile(const char *file, bool lines = false);
     ~OutputFile();
 
-    size_t write(const char *buffer, size_t n);
+    size_t write(const char *buffer, size_t n, uint32_t flags = 0);
+    size_t write(const struct iovec *records, size_t n, const uint32_t *flags = 0);
+    void tick() {}
     static const size_t nbuffer = 81920 + 30;
 
 private:
     FILE *fp_;
+    bool  lines_;
 };
 
-OutputFile::OutputFile(const char *file)
+/* stream records come without their LF, lines puts it back */
+OutputFile::OutputFile(const char *file, bool lines)
 {
+    lines_ = lines;
     fp_ = fopen(file, "w");
     if (!fp_) throw errno;
     setvbuf(fp_, (char *)NULL, _IOLBF, 0);
@@ -35,15 +46,51 @@ OutputFile::~OutputFile()
     fclose(fp_);
 }
 
-size_t OutputFile::write(const char *buffer, size_t n)
+size_t OutputFile::write(const char *buffer, size_t n, uint32_t)
 {
-    return fwrite(buffer, 1, n, fp_);
+    size_t nn = fwrite(buffer, 1, n, fp_);
+    if (lines_) fputc('\n', fp_);
+    return nn;
+}
+
+size_t OutputFile::write(const struct iovec *records, size_t n, const uint32_t *)
+{
+    for (size_t i = 0; i < n; ++i) {
+        write((const char *) records[i].iov_base, records[i].iov_len);
+    }
+    return n;
+}
+
+/* the first address of addr that binds */
+static int listenInet(const char *addr, bool isStream)
+{
+    struct addrinfo *res = resolveInet(addr, true);
+    if (!res) return -1;
+
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai && fd == -1; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK, ai->ai_protocol);
+        if (fd == -1) continue;
+
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) < 0 || (isStream && listen(fd, 1024) < 0)) {
+            fprintf(stderr, "bind(%s) error, %d:%s\n", addr, errno, strerror(errno));
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    freeaddrinfo(res);
+    return fd;
 }
 
 int main(int argc, char *argv[])
 {
     if (argc != 4) {
-        fprintf(stderr, "Usage: %s srcsock destfile stream|dgram\n", argv[0]);
+        fprintf(stderr, "Usage: %s srcsock destfile stream|dgram\n"
+                "   srcsock may be tcp://127.0.0.1:port or udp://127.0.0.1:port\n", argv[0]);
         return EXIT_FAILURE;
     }
 
@@ -51,9 +98,16 @@ int main(int argc, char *argv[])
     const char *dest = argv[2];
     bool isStream = (strcmp(argv[3], "stream") == 0);
 
-    OutputFile output(dest);
-    LogReader<OutputFile> logr(src, &output, isStream);
+    bool inetStream = isStream;
+    bool inet = inetAddr(src, &inetStream);
+
+    OutputFile output(dest, isStream);
+    LogReader<OutputFile> logr(src, &output, inet ? inetStream : isStream);
 
+    if (inet) {
+        int fd = listenInet(src, inetStream);
+        if (fd == -1 || !logr.open(fd)) return EXIT_FAILURE;
+    }
     logr.run();
     return EXIT_SUCCESS;
 }
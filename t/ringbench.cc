@@ -0,0 +1,522 @@
+/* vim:expandtab:shiftwidth=4:tabstop=4:smarttab:
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include <ringbuffer.h>
+#include <stagering.h>
+#include <spill.h>
+
+/* RingBuffer stress and micro benchmark. producers write records that
+ * describe themselves, [seq][producer][len] pattern [seq], the consumer
+ * checks every byte, every record boundary and the order per producer.
+ *
+ * without overflow the producers stay within half the ring of the
+ * consumer, with overflow they run free. either way what the consumer
+ * misses must be exactly what the buffer says it dropped.
+ *
+ * run() is a template, another buffer with the same interface (write,
+ * peek/commit, peekRecords/commit(k), read, dropped) is measured head
+ * to head by running the cases on it too. a staged case writes through
+ * a StageRing and its merger, as -j does, what the small stage ring
+ * drops must show up in dropped() too.
+ *
+ * a case with a Spill tier behind the ring, in a temporary directory
+ * or lz compressed in memory, also reports the slowest write(). its
+ * producer is paced to tierRate and its consumer takes a batch per ms,
+ * the ring overflows at a rate the tier keeps up with, so the slowest
+ * write() is one that spilled, what the disk or lz cost it.
+ *
+ * g++ -O2 -Wall ringbench.cc ../ringbuffer.cc ../spill.cc ../lz.cc ../stagering.cc
+ *     -I.. -lpthread -o ringbench
+ */
+
+enum Consumer { ByPeek, ByRecords, ByRead };
+enum Tier { NoTier, DiskTier, LzTier };
+
+struct case_t {
+    const char *name;
+    size_t      ring;
+    int         producers;       // more than 1 runs the buffer Locked
+    Consumer    consumer;
+    bool        overflow;
+    bool        border;          // readBorder, one record per peek()/read()
+    size_t      sizeMin;
+    size_t      sizeMax;
+    size_t      sizeEvery8th;    // 0 none
+    size_t      stage;           // StageRing size, 0 writes the ring itself
+    Tier        tier;            // Spill behind the ring, as -o or -z
+};
+
+struct Head {
+    uint64_t seq;
+    uint32_t producer;
+    uint32_t len;
+};
+
+static const size_t   minSize = sizeof(Head) + sizeof(uint64_t);
+static const uint64_t endSeq  = ~0ULL;
+
+static int duration = 1000;      // ms per case
+
+static const long tierRate = 64;         // MB/s
+
+static inline char pattern(size_t i)
+{
+    return (char) (i * 131 + 7);
+}
+
+static long nowNsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static size_t maxSize(const case_t *cs)
+{
+    return cs->sizeMax > cs->sizeEvery8th ? cs->sizeMax : cs->sizeEvery8th;
+}
+
+template <typename Buffer>
+struct bench_t {
+    const case_t *cs;
+    Buffer       *buffer;
+    volatile bool stop;
+
+    std::vector<uint64_t> sent;          // per producer
+    std::vector<double>   ns;
+    std::vector<long>     slowest;       // ns of the slowest write, with a tier
+    uint64_t              sentBytes;
+
+    /* consumer */
+    std::vector<uint64_t> next;          // expected seq per producer
+    uint64_t              received;
+    uint64_t              consumed;      // received and skipped, for the flow control
+    uint64_t              errors;
+    bool                  ended;
+};
+
+template <typename Buffer>
+struct producer_t {
+    bench_t<Buffer> *bench;
+    int              id;
+};
+
+template <typename Buffer>
+static void *produce(void *data)
+{
+    producer_t<Buffer> *producer = (producer_t<Buffer> *) data;
+    bench_t<Buffer>    *bench    = producer->bench;
+    const case_t       *cs       = bench->cs;
+
+    size_t max = maxSize(cs);
+    char *buffer = new char[max];
+    for (size_t i = 0; i < max; ++i) buffer[i] = pattern(i);
+
+    /* records in flight that surely fit in half the ring, or the stage */
+    size_t ring = (cs->stage && cs->stage < cs->ring) ? cs->stage : cs->ring;
+    uint64_t window = ring / 2 / RingBuffer::recordSize(max);
+    if (window == 0) window = 1;
+
+    unsigned int seed = producer->id + 1;
+    uint64_t seq = 0, bytes = 0;
+    long start = nowNsec();
+
+    while (!bench->stop) {
+        if (!cs->overflow) {
+            uint64_t all = 0;
+            for (int i = 0; i < cs->producers; ++i) all += statGet(&bench->sent[i]);
+            if (all - statGet(&bench->consumed) >= window) {
+                sched_yield();
+                continue;
+            }
+        }
+
+        size_t len = cs->sizeMin;
+        if (cs->sizeEvery8th && seq % 8 == 7) {
+            len = cs->sizeEvery8th;
+        } else if (cs->sizeMax > cs->sizeMin) {
+            len += rand_r(&seed) % (cs->sizeMax - cs->sizeMin + 1);
+        }
+
+        Head head = { seq, (uint32_t) producer->id, (uint32_t) len };
+        memcpy(buffer, &head, sizeof(head));
+        memcpy(buffer + len - sizeof(seq), &seq, sizeof(seq));
+
+        if (cs->tier) {
+            long t = nowNsec();
+            bench->buffer->write(buffer, len);
+            t = nowNsec() - t;
+            if (t > bench->slowest[producer->id]) bench->slowest[producer->id] = t;
+
+            long ahead = start + (long) ((bytes + len) * 1000 / tierRate) - nowNsec();
+            if (ahead > 100000) usleep(ahead / 1000);
+        } else {
+            bench->buffer->write(buffer, len);
+        }
+
+        for (size_t i = len - sizeof(seq); i < len; ++i) buffer[i] = pattern(i);
+
+        bytes += len;
+        statAdd(&bench->sent[producer->id]);
+        ++seq;
+    }
+
+    bench->ns[producer->id] = nowNsec() - start;
+    __atomic_add_fetch(&bench->sentBytes, bytes, __ATOMIC_RELAXED);
+    delete[] buffer;
+    return 0;
+}
+
+template <typename Buffer>
+static void check(bench_t<Buffer> *bench, const char *rec, size_t len)
+{
+    Head head;
+    if (len < minSize) {
+        ++bench->errors;
+        return;
+    }
+    memcpy(&head, rec, sizeof(head));
+
+    if (head.seq == endSeq) {
+        bench->ended = true;
+        return;
+    }
+
+    uint64_t tail;
+    memcpy(&tail, rec + len - sizeof(tail), sizeof(tail));
+
+    bool ok = head.len == len && tail == head.seq &&
+              head.producer < (uint32_t) bench->cs->producers &&
+              head.seq >= bench->next[head.producer];
+    for (size_t i = sizeof(head); ok && i < len - sizeof(tail); ++i) {
+        ok = rec[i] == pattern(i);
+    }
+
+    if (!ok) {
+        if (bench->errors++ < 5) {
+            fprintf(stderr, "%s: bad record, len %lu head.len %u seq %llu tail %llu\n",
+                    bench->cs->name, (unsigned long) len, head.len,
+                    (unsigned long long) head.seq, (unsigned long long) tail);
+        }
+        return;
+    }
+
+    statAdd(&bench->consumed, head.seq - bench->next[head.producer] + 1);
+    bench->next[head.producer] = head.seq + 1;
+    ++bench->received;
+}
+
+/* records of a concatenated peek()/read(), they tell their own length */
+template <typename Buffer>
+static void checkStream(bench_t<Buffer> *bench, const char *data, size_t n)
+{
+    size_t pos = 0;
+    while (pos < n) {
+        Head head;
+        size_t len = 0;
+        if (n - pos >= sizeof(head)) {
+            memcpy(&head, data + pos, sizeof(head));
+            len = (head.seq == endSeq) ? minSize : head.len;
+        }
+
+        if (len < minSize || len > n - pos) {
+            if (bench->errors++ < 5) {
+                fprintf(stderr, "%s: broken boundary at %lu of %lu\n", bench->cs->name,
+                        (unsigned long) pos, (unsigned long) n);
+            }
+            return;
+        }
+        check(bench, data + pos, len);
+        pos += len;
+    }
+}
+
+template <typename Buffer>
+static void *consume(void *data)
+{
+    bench_t<Buffer> *bench = (bench_t<Buffer> *) data;
+    const case_t    *cs    = bench->cs;
+
+    static const size_t nrecord = 64;
+    struct iovec iov[2 * nrecord];
+
+    size_t cap = maxSize(cs) + 2 * nrecord * Buffer::nbuffer;
+    char *scratch = new char[cap];
+
+    for (size_t round = 0; !bench->ended; ++round) {
+        if (cs->tier) usleep(1000);
+
+        if (cs->consumer == ByRecords) {
+            size_t n = bench->buffer->peekRecords(iov, nrecord, 4 * Buffer::nbuffer);
+
+            /* every third round hands the last record back, commit(k) */
+            size_t k = (n > 1 && round % 3 == 0) ? n - 1 : n;
+            for (size_t i = 0; i < k; ++i) {
+                const struct iovec *a = iov + 2 * i, *b = a + 1;
+                if (b->iov_len == 0) {
+                    check(bench, (const char *) a->iov_base, a->iov_len);
+                } else {
+                    memcpy(scratch, a->iov_base, a->iov_len);
+                    memcpy(scratch + a->iov_len, b->iov_base, b->iov_len);
+                    check(bench, scratch, a->iov_len + b->iov_len);
+                }
+            }
+            bench->buffer->commit(k);
+        } else if (cs->consumer == ByPeek) {
+            size_t niov = 2 * nrecord;
+            size_t n = bench->buffer->peek(iov, &niov, Buffer::nbuffer);
+
+            size_t nn = 0;
+            for (size_t i = 0; i < niov; ++i) {
+                memcpy(scratch + nn, iov[i].iov_base, iov[i].iov_len);
+                nn += iov[i].iov_len;
+            }
+            if (round % 5 == 0) {
+                bench->buffer->rollback();
+                continue;
+            }
+            bench->buffer->commit();
+
+            if (nn != n) ++bench->errors;
+            checkStream(bench, scratch, nn);
+        } else {
+            checkStream(bench, scratch, bench->buffer->read(scratch, cap));
+        }
+    }
+
+    delete[] scratch;
+    return 0;
+}
+
+template <typename Buffer>
+static bool run(const char *type, const case_t *cs, Buffer *buffer)
+{
+    bench_t<Buffer> bench;
+    bench.cs        = cs;
+    bench.buffer    = buffer;
+    bench.stop      = false;
+    bench.sentBytes = 0;
+    bench.sent.assign(cs->producers, 0);
+    bench.ns.assign(cs->producers, 0);
+    bench.slowest.assign(cs->producers, 0);
+    bench.next.assign(cs->producers, 0);
+    bench.received  = 0;
+    bench.consumed  = 0;
+    bench.errors    = 0;
+    bench.ended     = false;
+
+    pthread_t ctid;
+    pthread_create(&ctid, 0, consume<Buffer>, &bench);
+
+    std::vector<producer_t<Buffer> > producers(cs->producers);
+    std::vector<pthread_t> ptids(cs->producers);
+    for (int i = 0; i < cs->producers; ++i) {
+        producers[i].bench = &bench;
+        producers[i].id    = i;
+        pthread_create(&ptids[i], 0, produce<Buffer>, &producers[i]);
+    }
+
+    usleep(duration * 1000);
+    bench.stop = true;
+    for (int i = 0; i < cs->producers; ++i) pthread_join(ptids[i], 0);
+
+    /* the newest record is never evicted, it ends the consumer, a full
+     * stage ring takes it once the merger caught up.
+     */
+    char end[minSize];
+    Head head = { endSeq, 0, (uint32_t) minSize };
+    memset(end, 0x00, sizeof(end));
+    memcpy(end, &head, sizeof(head));
+    while (buffer->write(end, sizeof(end)) == 0) sched_yield();
+    pthread_join(ctid, 0);
+
+    uint64_t sent = 0;
+    double ns = 0;
+    long slowest = 0;
+    for (int i = 0; i < cs->producers; ++i) {
+        sent += bench.sent[i];
+        ns   += bench.ns[i];
+        if (bench.slowest[i] > slowest) slowest = bench.slowest[i];
+    }
+
+    char tier[64] = "";
+    if (cs->tier) {
+        snprintf(tier, sizeof(tier), ",\"tier\":\"%s\",\"slowest_write_us\":%.1f",
+                 cs->tier == DiskTier ? "disk" : "lz", slowest / 1000.0);
+    }
+
+    uint64_t dropMsgs, dropBytes;
+    buffer->dropped(&dropMsgs, &dropBytes);
+
+    uint64_t lost = sent - bench.received;
+    bool ok = bench.errors == 0 && lost == dropMsgs;
+
+    printf("{\"case\":\"%s\",\"buffer\":\"%s\",\"ring\":%lu,\"producers\":%d,"
+           "\"consumer\":\"%s\",\"overflow\":%s,\"border\":%s,\"sizes\":\"%lu:%lu:%lu\","
+           "\"writes\":%llu,\"ops_per_sec\":%.0f,\"ns_per_op\":%.1f,\"mb_per_sec\":%.1f,"
+           "\"received\":%llu,\"lost\":%llu,\"dropped\":%llu,\"errors\":%llu%s,\"ok\":%s}\n",
+           cs->name, type, (unsigned long) cs->ring, cs->producers,
+           cs->consumer == ByPeek ? "peek" : cs->consumer == ByRecords ? "records" : "read",
+           cs->overflow ? "true" : "false", cs->border ? "true" : "false",
+           (unsigned long) cs->sizeMin, (unsigned long) cs->sizeMax,
+           (unsigned long) cs->sizeEvery8th,
+           (unsigned long long) sent, sent * 1000.0 / duration,
+           sent ? ns / sent : 0.0,
+           bench.sentBytes * 1000.0 / duration / (1024 * 1024),
+           (unsigned long long) bench.received, (unsigned long long) lost,
+           (unsigned long long) dropMsgs, (unsigned long long) bench.errors,
+           tier, ok ? "true" : "false");
+    fflush(stdout);
+    return ok;
+}
+
+/* the RingBuffer behind a StageRing, the producer writes the stage ring
+ * and a merger thread moves it on, the consumer side is the ring's.
+ */
+struct StagedBuffer {
+    static const size_t nbuffer = RingBuffer::nbuffer;
+
+    StagedBuffer(const case_t *cs)
+        : ring(cs->ring, false, 0, cs->border), merger(&ring, StageMerger::ByTime) {
+        stage = merger.addStage(cs->stage);
+        pthread_create(&tid, 0, run, &merger);
+    }
+    ~StagedBuffer() {
+        merger.stop();
+        pthread_join(tid, 0);
+    }
+
+    static void *run(void *data) {
+        ((StageMerger *) data)->run();
+        return 0;
+    }
+
+    size_t write(const char *buffer, size_t n) { return stage->write(buffer, n); }
+    size_t read(char *buffer, size_t n) { return ring.read(buffer, n); }
+    size_t peek(struct iovec *iov, size_t *niov, size_t n) { return ring.peek(iov, niov, n); }
+    bool commit() { return ring.commit(); }
+    bool rollback() { return ring.rollback(); }
+    size_t peekRecords(struct iovec *iov, size_t nrecord, size_t n) {
+        return ring.peekRecords(iov, nrecord, n);
+    }
+    bool commit(size_t nrecord) { return ring.commit(nrecord); }
+    void dropped(uint64_t *msgs, uint64_t *bytes) const { ring.dropped(msgs, bytes); }
+
+    RingBuffer  ring;
+    StageMerger merger;
+    StageRing  *stage;
+    pthread_t   tid;
+};
+
+/* the segments a disk tier leaves behind */
+static void removeDir(const char *dir)
+{
+    DIR *dp = opendir(dir);
+    if (!dp) return;
+
+    struct dirent *de;
+    while ((de = readdir(dp)) != 0) {
+        if (de->d_name[0] == '.') continue;
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        unlink(path);
+    }
+    closedir(dp);
+    rmdir(dir);
+}
+
+/* the RingBuffer with a Spill tier, at the minimum quota */
+static bool runSpilled(const case_t *cs)
+{
+    char dir[] = "/tmp/ringbench.XXXXXX";
+    if (cs->tier == DiskTier && !mkdtemp(dir)) throw errno;
+
+    bool ok;
+    try {
+        Spill spill(cs->tier == DiskTier ? dir : 0, Spill::minQuota, cs->border);
+        RingBuffer rbuffer(cs->ring, false, 0, cs->border, RingBuffer::LockFree, 0, &spill);
+        ok = run("RingBuffer", cs, &rbuffer);
+    } catch (int eno) {
+        if (cs->tier == DiskTier) removeDir(dir);
+        throw eno;
+    }
+    if (cs->tier == DiskTier) removeDir(dir);
+    return ok;
+}
+
+/* 64 bytes records fill a 64K ring exactly, every wrap is at a record edge */
+static const size_t exact = 64 - sizeof(RingBuffer::Record);
+
+static const case_t cases[] = {
+    /* name           ring     prod consumer  overflow border  min    max    every8th stage    tier */
+    { "tiny",         1 << 20, 1,   ByPeek,    false, false,   24,    24,    0,       0,       NoTier },
+    { "tiny-evict",   1 << 20, 1,   ByRecords, true,  false,   24,    24,    0,       0,       NoTier },
+    { "mixed-read",   1 << 20, 1,   ByRead,    false, false,   24,    1024,  0,       0,       NoTier },
+    { "mixed-evict",  1 << 20, 1,   ByPeek,    true,  false,   24,    1024,  0,       0,       NoTier },
+    { "exact-wrap",   1 << 16, 1,   ByRecords, false, false,   exact, exact, 0,       0,       NoTier },
+    { "exact-evict",  1 << 16, 1,   ByRecords, true,  false,   exact, exact, 0,       0,       NoTier },
+    { "odd-ring",     100000,  1,   ByPeek,    true,  true,    24,    3000,  0,       0,       NoTier },
+    { "odd-read",     100000,  1,   ByRead,    false, true,    24,    3000,  0,       0,       NoTier },
+    { "large",        1 << 20, 1,   ByRecords, false, false,   16384, 65536, 0,       0,       NoTier },
+    { "large-evict",  1 << 20, 1,   ByPeek,    true,  false,   16384, 65536, 0,       0,       NoTier },
+    { "oversize",     1 << 16, 1,   ByRecords, true,  false,   24,    1024,  70000,   0,       NoTier },
+    { "locked",       1 << 20, 4,   ByPeek,    false, false,   24,    1024,  0,       0,       NoTier },
+    { "locked-evict", 1 << 20, 4,   ByRecords, true,  false,   24,    1024,  0,       0,       NoTier },
+    { "staged",       1 << 20, 1,   ByRecords, false, false,   24,    1024,  0,       1 << 16, NoTier },
+    { "staged-evict", 1 << 20, 1,   ByPeek,    true,  false,   24,    1024,  0,       1 << 16, NoTier },
+    { "spill-disk",   1 << 20, 1,   ByRecords, true,  false,   24,    1024,  0,       0,       DiskTier },
+    { "spill-lz",     1 << 20, 1,   ByPeek,    true,  false,   24,    1024,  0,       0,       LzTier },
+};
+
+int main(int argc, char *argv[])
+{
+    const char *only = 0;
+
+    int c;
+    while ((c = getopt(argc, argv, "T:c:h")) != -1) {
+        switch (c) {
+            case 'T': duration = atoi(optarg); break;
+            case 'c': only = optarg; break;
+            default:
+                fprintf(stderr, "usage: ringbench [-T ms per case] [-c case]\n");
+                return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        const case_t *cs = &cases[i];
+        if (only && strcmp(only, cs->name) != 0) continue;
+
+        try {
+            if (cs->stage) {
+                StagedBuffer sbuffer(cs);
+                ok = run("StageRing", cs, &sbuffer) && ok;
+                continue;
+            }
+            if (cs->tier) {
+                ok = runSpilled(cs) && ok;
+                continue;
+            }
+            RingBuffer rbuffer(cs->ring, false, 0, cs->border,
+                               cs->producers > 1 ? RingBuffer::Locked : RingBuffer::LockFree);
+            ok = run("RingBuffer", cs, &rbuffer) && ok;
+        } catch (int eno) {
+            fprintf(stderr, "can't create buffer, %d:%s\n", eno, strerror(eno));
+            return EXIT_FAILURE;
+        }
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
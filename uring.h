@@ -0,0 +1,316 @@
+/* vim:expandtab:shiftwidth=4:tabstop=4:smarttab:
+ */
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* io_uring on the raw syscalls, there is no liburing to link. one
+ * thread owns a ring, it is created on that thread (SINGLE_ISSUER) and
+ * completions are posted only when that thread waits for them
+ * (DEFER_TASKRUN), both and multishot recv need linux 6.1, older
+ * kernels refuse the setup and the caller stays with epoll.
+ *
+ * the provided buffers are nbuf slots of size bytes in buffer group 0,
+ * a multishot recv takes one per completion, the cqe names it, it is
+ * handed back with recycle() and publish() once its data was copied.
+ */
+class Uring {
+public:
+    Uring(unsigned entries);
+    ~Uring();
+
+    /* whether this kernel sets up a ring as the constructor does */
+    static bool supported();
+
+    /* the next free sqe, zeroed, 0 if the SQ stays full */
+    struct io_uring_sqe *sqe();
+
+    /* submits the queued sqes and waits up to timeout ms for a
+     * completion, returns what io_uring_enter() did, the sqes it took
+     * or -1 and ETIME or EINTR, peek() tells what completed.
+     */
+    int wait(int timeout);
+
+    /* the completions in order, seen() consumes the one peek() gave */
+    struct io_uring_cqe *peek();
+    void seen();
+
+    bool addBuffers(size_t nbuf, size_t size);
+    char *buffer(uint16_t bid) { return bufs_ + (size_t) bid * bufSize_; }
+    void recycle(uint16_t bid);
+    void publish();
+
+    /* sendmmsg() as a chain of linked IORING_OP_SENDMSG, a failed one
+     * cancels the rest, returns how many went, or -1 and the errno of
+     * the first, with one io_uring_enter().
+     */
+    int sendmmsg(int fd, struct mmsghdr *msgs, size_t n, int flags);
+
+    static const uint16_t bgid = 0;
+
+private:
+    int enter(unsigned submit, unsigned complete, unsigned flags, void *arg = 0, size_t argsz = 0);
+    void release();
+
+private:
+    int       fd_;
+    void     *ring_;
+    size_t    ringLen_;
+    struct io_uring_sqe *sqes_;
+    size_t    sqesLen_;
+
+    unsigned *sqHead_;
+    unsigned *sqTail_;
+    unsigned  sqMask_;
+    unsigned  sqEntries_;
+    unsigned  sqLocal_;          // tail with the sqes not yet submitted
+    unsigned  queued_;
+
+    unsigned *cqHead_;
+    unsigned *cqTail_;
+    unsigned  cqMask_;
+    struct io_uring_cqe *cqes_;
+
+    /* buffer group 0, brTail_ counts the recycled ones */
+    struct io_uring_buf_ring *br_;
+    size_t    brLen_;
+    char     *bufs_;
+    size_t    nbuf_;
+    size_t    bufSize_;
+    uint16_t  brTail_;
+};
+
+inline Uring::Uring(unsigned entries)
+    : fd_(-1), ring_(MAP_FAILED), ringLen_(0), sqes_((struct io_uring_sqe *) MAP_FAILED),
+      sqesLen_(0), sqLocal_(0), queued_(0), br_(0), brLen_(0), bufs_(0), nbuf_(0),
+      bufSize_(0), brTail_(0)
+{
+    struct io_uring_params p;
+    memset(&p, 0x00, sizeof(p));
+    p.flags      = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 8;
+
+    fd_ = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd_ == -1) throw errno;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+        release();
+        throw EOPNOTSUPP;
+    }
+
+    size_t sqLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cqLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ringLen_ = sqLen > cqLen ? sqLen : cqLen;
+    sqesLen_ = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring_ = mmap(0, ringLen_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_,
+                 IORING_OFF_SQ_RING);
+    if (ring_ != MAP_FAILED) {
+        sqes_ = (struct io_uring_sqe *) mmap(0, sqesLen_, PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    }
+    if (sqes_ == MAP_FAILED) {
+        int eno = errno;
+        release();
+        throw eno;
+    }
+
+    char *base = (char *) ring_;
+    sqHead_    = (unsigned *) (base + p.sq_off.head);
+    sqTail_    = (unsigned *) (base + p.sq_off.tail);
+    sqMask_    = *(unsigned *) (base + p.sq_off.ring_mask);
+    sqEntries_ = p.sq_entries;
+    sqLocal_   = *sqTail_;
+
+    /* sqe i always sits in slot i */
+    unsigned *array = (unsigned *) (base + p.sq_off.array);
+    for (unsigned i = 0; i < sqEntries_; ++i) array[i] = i;
+
+    cqHead_ = (unsigned *) (base + p.cq_off.head);
+    cqTail_ = (unsigned *) (base + p.cq_off.tail);
+    cqMask_ = *(unsigned *) (base + p.cq_off.ring_mask);
+    cqes_   = (struct io_uring_cqe *) (base + p.cq_off.cqes);
+}
+
+inline Uring::~Uring()
+{
+    release();
+}
+
+inline void Uring::release()
+{
+    if (br_) munmap(br_, brLen_);
+    free(bufs_);
+    if (sqes_ != MAP_FAILED) munmap(sqes_, sqesLen_);
+    if (ring_ != MAP_FAILED) munmap(ring_, ringLen_);
+    if (fd_ != -1) close(fd_);
+    br_   = 0;
+    bufs_ = 0;
+    sqes_ = (struct io_uring_sqe *) MAP_FAILED;
+    ring_ = MAP_FAILED;
+    fd_   = -1;
+}
+
+inline bool Uring::supported()
+{
+    try {
+        Uring ring(2);
+        return true;
+    } catch (int eno) {
+        return false;
+    }
+}
+
+inline int Uring::enter(unsigned submit, unsigned complete, unsigned flags, void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, fd_, submit, complete, flags, arg, argsz);
+}
+
+inline struct io_uring_sqe *Uring::sqe()
+{
+    if (sqLocal_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) >= sqEntries_) {
+        __atomic_store_n(sqTail_, sqLocal_, __ATOMIC_RELEASE);
+        int n = enter(queued_, 0, 0);
+        if (n > 0) queued_ -= n;
+        if (sqLocal_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) >= sqEntries_) return 0;
+    }
+
+    struct io_uring_sqe *sqe = &sqes_[sqLocal_ & sqMask_];
+    memset(sqe, 0x00, sizeof(*sqe));
+    ++sqLocal_;
+    ++queued_;
+    return sqe;
+}
+
+inline int Uring::wait(int timeout)
+{
+    struct __kernel_timespec ts;
+    ts.tv_sec  = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000L;
+
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0x00, sizeof(arg));
+    arg.ts = (uint64_t) (uintptr_t) &ts;
+
+    __atomic_store_n(sqTail_, sqLocal_, __ATOMIC_RELEASE);
+    int n = enter(queued_, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (n > 0) queued_ -= n;
+    return n;
+}
+
+inline struct io_uring_cqe *Uring::peek()
+{
+    unsigned head = *cqHead_;
+    if (head == __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE)) return 0;
+    return &cqes_[head & cqMask_];
+}
+
+inline void Uring::seen()
+{
+    __atomic_store_n(cqHead_, *cqHead_ + 1, __ATOMIC_RELEASE);
+}
+
+/* nbuf is a power of 2, the buffer ring is page aligned anonymous memory */
+inline bool Uring::addBuffers(size_t nbuf, size_t size)
+{
+    brLen_ = nbuf * sizeof(struct io_uring_buf);
+    void *addr = mmap(0, brLen_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) return false;
+    br_ = (struct io_uring_buf_ring *) addr;
+
+    bufs_ = (char *) malloc(nbuf * size);
+    if (!bufs_) return false;
+    nbuf_    = nbuf;
+    bufSize_ = size;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0x00, sizeof(reg));
+    reg.ring_addr    = (uint64_t) (uintptr_t) br_;
+    reg.ring_entries = nbuf;
+    reg.bgid         = bgid;
+    if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        fprintf(stderr, "io_uring_register(PBUF_RING) error, %d:%s\n", errno, strerror(errno));
+        return false;
+    }
+
+    for (size_t i = 0; i < nbuf; ++i) recycle(i);
+    publish();
+    return true;
+}
+
+inline void Uring::recycle(uint16_t bid)
+{
+    /* not br_->bufs, in C++ the empty struct of __DECLARE_FLEX_ARRAY moves it */
+    struct io_uring_buf *buf = (struct io_uring_buf *) br_ + (brTail_ & (nbuf_ - 1));
+    buf->addr = (uint64_t) (uintptr_t) buffer(bid);
+    buf->len  = bufSize_;
+    buf->bid  = bid;
+    ++brTail_;
+}
+
+inline void Uring::publish()
+{
+    __atomic_store_n(&br_->tail, brTail_, __ATOMIC_RELEASE);
+}
+
+inline int Uring::sendmmsg(int fd, struct mmsghdr *msgs, size_t n, int flags)
+{
+    struct io_uring_sqe *prev = 0;
+    for (size_t i = 0; i < n; ++i) {
+        struct io_uring_sqe *sqe = this->sqe();
+        if (!sqe) {
+            n = i;
+            break;
+        }
+        sqe->opcode    = IORING_OP_SENDMSG;
+        sqe->fd        = fd;
+        sqe->addr      = (uint64_t) (uintptr_t) &msgs[i].msg_hdr;
+        sqe->len       = 1;
+        sqe->msg_flags = flags;
+        sqe->user_data = i;
+        if (prev) prev->flags |= IOSQE_IO_LINK;
+        prev = sqe;
+    }
+
+    __atomic_store_n(sqTail_, sqLocal_, __ATOMIC_RELEASE);
+    int nn;
+    while ((nn = enter(queued_, n, IORING_ENTER_GETEVENTS)) == -1 && errno == EINTR) {
+    }
+    if (nn > 0) queued_ -= nn;
+
+    /* the chain runs in order, the first failure ends it */
+    size_t sent = n, reaped = 0;
+    int eno = 0;
+    struct io_uring_cqe *cqe;
+    while (reaped < n && (cqe = peek()) != 0) {
+        size_t i = cqe->user_data;
+        if (cqe->res >= 0) {
+            msgs[i].msg_len = cqe->res;
+        } else if (i < sent) {
+            sent = i;
+            eno  = -cqe->res;
+        }
+        seen();
+        ++reaped;
+    }
+    if (reaped < n && sent > reaped) sent = reaped;
+
+    if (sent == 0) {
+        errno = eno ? eno : EAGAIN;
+        return -1;
+    }
+    return sent;
+}
+
+#endif